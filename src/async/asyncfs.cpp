@@ -0,0 +1,124 @@
+#include "asyncfs.h"
+
+async_fs::async_fs(file_system* fs, const std::size_t threads) : fs_(fs)
+{
+	for (std::size_t i = 0; i < (threads ? threads : 1); ++i)
+		workers_.emplace_back(&async_fs::work, this);
+}
+
+async_fs::~async_fs()
+{
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		stopping_ = true;
+	}
+	requested_.notify_all();
+	for (auto& worker : workers_)
+		worker.join();
+}
+
+ticket_t async_fs::read(const fid_t fid, char* buffer, const std::size_t size, const std::size_t offset)
+{
+	return submit([this, fid, buffer, size, offset] { return fs_->pread(fid, buffer, size, offset); });
+}
+
+ticket_t async_fs::write(const fid_t fid, const char* buffer, const std::size_t size, const std::size_t offset)
+{
+	return submit([this, fid, buffer, size, offset] { return fs_->pwrite(fid, buffer, size, offset); });
+}
+
+ticket_t async_fs::open(const std::string& disk_file)
+{
+	return submit([this, disk_file] { return static_cast<int>(fs_->open(disk_file)); });
+}
+
+ticket_t async_fs::close(const fid_t fid)
+{
+	return submit([this, fid] { return fs_->close(fid); });
+}
+
+ticket_t async_fs::readdir(const did_t dir_id, dirent_t* entry_out)
+{
+	return submit([this, dir_id, entry_out]
+	{
+		*entry_out = fs_->readdir(dir_id);
+		return 0;
+	});
+}
+
+ticket_t async_fs::sync()
+{
+	return submit([this] { return fs_->sync(); });
+}
+
+ticket_t async_fs::fsync(const fid_t fid)
+{
+	return submit([this, fid] { return fs_->fsync(fid); });
+}
+
+std::size_t async_fs::poll(std::vector<completion_t>* completions_out, const std::size_t max)
+{
+	std::lock_guard<std::mutex> lock(lock_);
+	std::size_t taken = 0;
+	while (taken < max && !completions_.empty())
+	{
+		completions_out->push_back(completions_.front());
+		completions_.pop_front();
+		--outstanding_;
+		++taken;
+	}
+	return taken;
+}
+
+bool async_fs::wait(completion_t* completion_out)
+{
+	std::unique_lock<std::mutex> lock(lock_);
+	if (outstanding_ == 0)
+		return false;
+	completed_.wait(lock, [this] { return !completions_.empty(); });
+	*completion_out = completions_.front();
+	completions_.pop_front();
+	--outstanding_;
+	return true;
+}
+
+std::size_t async_fs::outstanding() const
+{
+	std::lock_guard<std::mutex> lock(lock_);
+	return outstanding_;
+}
+
+ticket_t async_fs::submit(std::function<int()> run)
+{
+	ticket_t ticket;
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		ticket = next_ticket_++;
+		requests_.push_back({ticket, std::move(run)});
+		++outstanding_;
+	}
+	requested_.notify_one();
+	return ticket;
+}
+
+void async_fs::work()
+{
+	std::unique_lock<std::mutex> lock(lock_);
+	for (;;)
+	{
+		requested_.wait(lock, [this] { return stopping_ || !requests_.empty(); });
+		// the queue is drained before the workers leave
+		if (requests_.empty())
+			return;
+
+		auto request = std::move(requests_.front());
+		requests_.pop_front();
+
+		lock.unlock();
+		const auto result = request.run();
+		lock.lock();
+
+		completions_.push_back({request.ticket, result});
+		completed_.notify_all();
+	}
+}
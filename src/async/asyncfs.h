@@ -0,0 +1,85 @@
+#ifndef ASYNCFS_H_GUARD
+#define ASYNCFS_H_GUARD
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include "../fs/fs.h"
+
+#define ASYNC_THREADS_DEF	(4)
+
+// identifies a submitted request in its completion
+typedef uint64_t ticket_t;
+
+typedef struct completion_struct
+{
+	ticket_t ticket;
+	// what the blocking call would have returned
+	int result;
+} completion_t;
+
+/**
+ * \brief runs file_system calls on a pool of worker threads.
+ * Every call returns at once with a ticket, its result is picked up later
+ * from the completion queue. Requests may complete in any order
+ */
+class async_fs
+{
+public:
+	explicit async_fs(file_system* fs, std::size_t threads = ASYNC_THREADS_DEF);
+
+	async_fs(const async_fs& that) = delete;
+	async_fs& operator=(const async_fs& that) = delete;
+
+	// runs what was already submitted before returning
+	~async_fs();
+
+	// positional, so that requests in flight on one fid don't share a cursor
+	ticket_t read(fid_t fid, char* buffer, std::size_t size, std::size_t offset);
+	ticket_t write(fid_t fid, const char* buffer, std::size_t size, std::size_t offset);
+	// completes with the fid or an error code
+	ticket_t open(const std::string& disk_file);
+	ticket_t close(fid_t fid);
+	// entry_out must stay valid until the ticket completes
+	ticket_t readdir(did_t dir_id, dirent_t* entry_out);
+	ticket_t sync();
+	ticket_t fsync(fid_t fid);
+
+	// moves up to max finished requests to completions_out without waiting
+	std::size_t poll(std::vector<completion_t>* completions_out, std::size_t max = SIZE_MAX);
+	// blocks until a request finishes, false if none is outstanding
+	bool wait(completion_t* completion_out);
+
+	// submitted and not yet taken from the completion queue
+	std::size_t outstanding() const;
+private:
+	typedef struct request_struct
+	{
+		ticket_t ticket;
+		std::function<int()> run;
+	} request_t;
+
+	file_system* fs_;
+	std::vector<std::thread> workers_;
+
+	mutable std::mutex lock_;
+	std::condition_variable requested_;
+	std::condition_variable completed_;
+	std::deque<request_t> requests_;
+	std::deque<completion_t> completions_;
+	ticket_t next_ticket_{1};
+	std::size_t outstanding_{0};
+	bool stopping_{false};
+
+	ticket_t submit(std::function<int()> run);
+	void work();
+};
+
+#endif
@@ -0,0 +1,237 @@
+#ifndef CORO_H_GUARD
+#define CORO_H_GUARD
+
+#if __cplusplus < 202002L
+#error "coro.h needs C++20, see the nfso20 target of the Makefile"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include <deque>
+
+#include "asyncfs.h"
+
+template <typename T>
+struct fs_task_result
+{
+	T value{};
+	void return_value(T result) { value = std::move(result); }
+	T take() { return std::move(value); }
+};
+
+template <>
+struct fs_task_result<void>
+{
+	void return_void() {}
+	void take() {}
+};
+
+/**
+ * \brief coroutine returning T, started when first awaited
+ * or handed to fs_executor::spawn
+ */
+template <typename T = void>
+class fs_task
+{
+public:
+	struct promise_type : fs_task_result<T>
+	{
+		std::coroutine_handle<> continuation{std::noop_coroutine()};
+		std::exception_ptr error;
+
+		fs_task get_return_object() { return fs_task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		auto final_suspend() noexcept
+		{
+			// hands control straight back to whoever awaited the task
+			struct final_awaiter
+			{
+				bool await_ready() noexcept { return false; }
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept
+				{
+					return h.promise().continuation;
+				}
+				void await_resume() noexcept {}
+			};
+			return final_awaiter{};
+		}
+		void unhandled_exception() { error = std::current_exception(); }
+	};
+
+	fs_task(fs_task&& that) noexcept : handle_(that.handle_) { that.handle_ = nullptr; }
+	fs_task& operator=(fs_task&& that) noexcept
+	{
+		std::swap(handle_, that.handle_);
+		return *this;
+	}
+	fs_task(const fs_task& that) = delete;
+	fs_task& operator=(const fs_task& that) = delete;
+
+	~fs_task()
+	{
+		if (handle_)
+			handle_.destroy();
+	}
+
+	bool done() const { return !handle_ || handle_.done(); }
+
+	bool await_ready() const noexcept { return done(); }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+	{
+		handle_.promise().continuation = awaiting;
+		return handle_;
+	}
+	T await_resume()
+	{
+		if (handle_.promise().error)
+			std::rethrow_exception(handle_.promise().error);
+		return handle_.promise().take();
+	}
+private:
+	std::coroutine_handle<promise_type> handle_;
+
+	explicit fs_task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+	friend class fs_executor;
+};
+
+class fs_executor;
+
+/**
+ * \brief one file system call, submitted when awaited.
+ * Yields the call's int result, or for T other than int the value written to out
+ */
+template <typename T>
+class fs_op
+{
+public:
+	typedef std::function<ticket_t(async_fs&, T*)> submit_fn;
+
+	fs_op(fs_executor* executor, submit_fn submit) : executor_(executor), submit_(std::move(submit)) {}
+
+	bool await_ready() const noexcept { return false; }
+	void await_suspend(std::coroutine_handle<> awaiting);
+	T await_resume() const
+	{
+		if constexpr (std::is_same<T, int>::value)
+			return result_;
+		else
+			return value_;
+	}
+private:
+	fs_executor* executor_;
+	submit_fn submit_;
+	T value_{};
+	int result_{0};
+};
+
+/**
+ * \brief runs coroutines on the calling thread and their file system calls
+ * on the worker threads of an async_fs, resuming each one as its call completes
+ */
+class fs_executor
+{
+public:
+	explicit fs_executor(file_system* fs, std::size_t threads = ASYNC_THREADS_DEF) : io_(fs, threads) {}
+
+	fs_executor(const fs_executor& that) = delete;
+	fs_executor& operator=(const fs_executor& that) = delete;
+
+	// the task starts on the next run
+	void spawn(fs_task<> task)
+	{
+		ready_.push_back(task.handle_);
+		tasks_.push_back(std::move(task));
+	}
+
+	// returns once every spawned task has finished
+	void run()
+	{
+		for (;;)
+		{
+			while (!ready_.empty())
+			{
+				const auto handle = ready_.front();
+				ready_.pop_front();
+				handle.resume();
+			}
+
+			completion_t completion;
+			if (!io_.wait(&completion))
+				break;
+			const auto it = waiting_.find(completion.ticket);
+			if (it == waiting_.end())
+				continue;
+			*it->second.result = completion.result;
+			ready_.push_back(it->second.handle);
+			waiting_.erase(it);
+		}
+
+		for (auto& task : tasks_)
+			if (task.handle_.promise().error)
+				std::rethrow_exception(task.handle_.promise().error);
+		tasks_.clear();
+	}
+
+	fs_op<int> read(fid_t fid, char* buffer, std::size_t size, std::size_t offset)
+	{
+		return {this, [=](async_fs& io, int*) { return io.read(fid, buffer, size, offset); }};
+	}
+	fs_op<int> write(fid_t fid, const char* buffer, std::size_t size, std::size_t offset)
+	{
+		return {this, [=](async_fs& io, int*) { return io.write(fid, buffer, size, offset); }};
+	}
+	// yields the fid or an error code
+	fs_op<int> open(const std::string& disk_file)
+	{
+		return {this, [=](async_fs& io, int*) { return io.open(disk_file); }};
+	}
+	fs_op<int> close(fid_t fid)
+	{
+		return {this, [=](async_fs& io, int*) { return io.close(fid); }};
+	}
+	fs_op<dirent_t> readdir(did_t dir_id)
+	{
+		return {this, [=](async_fs& io, dirent_t* entry_out) { return io.readdir(dir_id, entry_out); }};
+	}
+	fs_op<int> sync()
+	{
+		return {this, [](async_fs& io, int*) { return io.sync(); }};
+	}
+	fs_op<int> fsync(fid_t fid)
+	{
+		return {this, [=](async_fs& io, int*) { return io.fsync(fid); }};
+	}
+private:
+	typedef struct waiter_struct
+	{
+		std::coroutine_handle<> handle;
+		int* result;
+	} waiter_t;
+
+	async_fs io_;
+	std::vector<fs_task<>> tasks_;
+	std::deque<std::coroutine_handle<>> ready_;
+	std::unordered_map<ticket_t, waiter_t> waiting_;
+
+	void suspend(const ticket_t ticket, int* result, const std::coroutine_handle<> handle)
+	{
+		waiting_[ticket] = {handle, result};
+	}
+
+	template <typename T>
+	friend class fs_op;
+};
+
+template <typename T>
+void fs_op<T>::await_suspend(const std::coroutine_handle<> awaiting)
+{
+	// only run picks up completions, so registering after submitting is safe
+	executor_->suspend(submit_(executor_->io_, &value_), &result_, awaiting);
+}
+
+#endif
@@ -0,0 +1,453 @@
+#include "blockcache.h"
+
+#include <cstring>
+#include <algorithm>
+#include <limits>
+
+block_cache::block_cache(const std::size_t budget, const cache_policy policy, const std::size_t compressed_budget)
+	: budget_(budget), compressed_budget_(compressed_budget), policy_(policy) {}
+
+block_cache::block_cache(const block_cache& that)
+	: block_cache(that.budget_, that.policy_, that.compressed_budget_)
+{
+	reset(that.block_bytes_);
+}
+
+block_cache::block_cache(block_cache&& that) noexcept
+	: budget_(that.budget_.load()), compressed_budget_(that.compressed_budget_.load()),
+	  capacity_(that.capacity_.load()), policy_(that.policy_),
+	  shards_count_(that.shards_count_), block_bytes_(that.block_bytes_), shards_(std::move(that.shards_))
+{
+	that.shards_count_ = 0;
+	that.capacity_ = 0;
+}
+
+block_cache& block_cache::operator=(const block_cache& that)
+{
+	if (this == &that) return *this;
+
+	budget_ = that.budget_.load();
+	compressed_budget_ = that.compressed_budget_.load();
+	policy_ = that.policy_;
+	reset(that.block_bytes_);
+	return *this;
+}
+
+block_cache& block_cache::operator=(block_cache&& that) noexcept
+{
+	if (this == &that) return *this;
+
+	budget_ = that.budget_.load();
+	compressed_budget_ = that.compressed_budget_.load();
+	capacity_ = that.capacity_.load();
+	policy_ = that.policy_;
+	shards_count_ = that.shards_count_;
+	block_bytes_ = that.block_bytes_;
+	shards_ = std::move(that.shards_);
+	that.shards_count_ = 0;
+	that.capacity_ = 0;
+	return *this;
+}
+
+void block_cache::reset(const std::size_t block_bytes)
+{
+	block_bytes_ = block_bytes;
+	const auto capacity = block_bytes != 0 ? budget_.load() / block_bytes : 0;
+	capacity_ = capacity;
+	shards_count_ = std::min<std::size_t>(capacity, CACHE_SHARDS_MAX);
+	shards_.reset(shards_count_ != 0 ? new cache_shard_t[shards_count_] : nullptr);
+	for (std::size_t i = 0; i < shards_count_; ++i)
+	{
+		auto& shard = shards_[i];
+		// the first capacity % shards_count_ shards take one block more
+		shard.capacity = capacity / shards_count_ + (i < capacity % shards_count_);
+		shard.keys.assign(shard.capacity, 0);
+		shard.policy = make_policy(policy_);
+		shard.policy->reset(shard.capacity);
+		shard.unread.reset(new std::atomic<bool>[shard.capacity]());
+		shard.pins.assign(shard.capacity, 0);
+		shard.data.assign(shard.capacity * block_bytes, 0);
+		shard.tier.reset(compressed_budget_ / shards_count_, block_bytes);
+	}
+}
+
+void block_cache::resize(const std::size_t budget)
+{
+	budget_ = budget;
+	if (shards_count_ == 0)
+		return;
+
+	const auto capacity = budget / block_bytes_;
+	std::size_t total = 0;
+	for (std::size_t i = 0; i < shards_count_; ++i)
+	{
+		auto& shard = shards_[i];
+		unique_guard lock(shard.lock);
+		resize_shard(shard, capacity / shards_count_ + (i < capacity % shards_count_));
+		total += shard.capacity;
+	}
+	capacity_ = total;
+}
+
+void block_cache::resize_compressed(const std::size_t budget)
+{
+	compressed_budget_ = budget;
+	for (std::size_t i = 0; i < shards_count_; ++i)
+	{
+		unique_guard lock(shards_[i].lock);
+		shards_[i].tier.resize(budget / shards_count_);
+	}
+}
+
+void block_cache::set_policy(const cache_policy policy)
+{
+	policy_ = policy;
+	reset(block_bytes_);
+}
+
+bool block_cache::read(const uint32_t block, char* buffer)
+{
+	if (shards_count_ == 0)
+		return false;
+
+	auto& shard = shard_of(block);
+	{
+		shared_guard lock(shard.lock);
+		const auto it = shard.index.find(block);
+		if (it != shard.index.end())
+		{
+			shard.hits.fetch_add(1, std::memory_order_relaxed);
+			auto& unread = shard.unread[it->second];
+			if (!unread.load(std::memory_order_relaxed) || !unread.exchange(false, std::memory_order_relaxed))
+				shard.policy->touch(it->second);
+			memcpy(buffer, shard.data.data() + it->second * block_bytes_, block_bytes_);
+			return true;
+		}
+		if (!shard.tier.contains(block))
+		{
+			shard.misses.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+	}
+
+	// moving a block back out of the tier changes the shard
+	unique_guard lock(shard.lock);
+	const auto it = shard.index.find(block);
+	if (it != shard.index.end())
+	{
+		shard.hits.fetch_add(1, std::memory_order_relaxed);
+		shard.unread[it->second].store(false, std::memory_order_relaxed);
+		shard.policy->touch(it->second);
+		memcpy(buffer, shard.data.data() + it->second * block_bytes_, block_bytes_);
+		return true;
+	}
+	shard.misses.fetch_add(1, std::memory_order_relaxed);
+	if (!shard.tier.take(block, buffer))
+		return false;
+	shard.compressed_hits.fetch_add(1, std::memory_order_relaxed);
+	store(shard, block, buffer);
+	return true;
+}
+
+bool block_cache::contains(const uint32_t block) const
+{
+	if (shards_count_ == 0)
+		return false;
+
+	auto& shard = shard_of(block);
+	shared_guard lock(shard.lock);
+	return shard.index.count(block) != 0 || shard.tier.contains(block);
+}
+
+bool block_cache::pin(const uint32_t block)
+{
+	if (shards_count_ == 0)
+		return false;
+
+	auto& shard = shard_of(block);
+	unique_guard lock(shard.lock);
+	auto it = shard.index.find(block);
+	if (it == shard.index.end())
+	{
+		std::vector<char> buffer(block_bytes_);
+		if (!shard.tier.take(block, buffer.data()))
+			return false;
+		store(shard, block, buffer.data());
+		it = shard.index.find(block);
+		if (it == shard.index.end())
+			return false;
+	}
+
+	auto& pins = shard.pins[it->second];
+	if (pins == std::numeric_limits<uint16_t>::max())
+		return false;
+	if (pins == 0)
+	{
+		if (shard.pinned + 1 >= shard.capacity)
+			return false;
+		++shard.pinned;
+	}
+	++pins;
+	return true;
+}
+
+void block_cache::unpin(const uint32_t block)
+{
+	if (shards_count_ == 0)
+		return;
+
+	auto& shard = shard_of(block);
+	unique_guard lock(shard.lock);
+	const auto it = shard.index.find(block);
+	if (it == shard.index.end() || shard.pins[it->second] == 0)
+		return;
+	if (--shard.pins[it->second] == 0)
+		--shard.pinned;
+}
+
+void block_cache::demote(const uint32_t block)
+{
+	if (shards_count_ == 0)
+		return;
+
+	auto& shard = shard_of(block);
+	unique_guard lock(shard.lock);
+	const auto it = shard.index.find(block);
+	if (it == shard.index.end() || shard.pins[it->second] != 0)
+		return;
+	shard.policy->demote(it->second);
+	if (shard.victims.size() < shard.capacity)
+		shard.victims.push_back(it->second);
+}
+
+void block_cache::drop(const uint32_t block)
+{
+	if (shards_count_ == 0)
+		return;
+
+	auto& shard = shard_of(block);
+	unique_guard lock(shard.lock);
+	const auto it = shard.index.find(block);
+	if (it != shard.index.end() && shard.pins[it->second] == 0)
+		evict(shard, block);
+}
+
+void block_cache::invalidate(const uint32_t block)
+{
+	if (shards_count_ == 0)
+		return;
+
+	auto& shard = shard_of(block);
+	unique_guard lock(shard.lock);
+	evict(shard, block);
+	++shard.epoch;
+}
+
+uint64_t block_cache::epoch(const uint32_t block) const
+{
+	if (shards_count_ == 0)
+		return 0;
+	return shard_of(block).epoch.load(std::memory_order_acquire);
+}
+
+void block_cache::fill(const uint32_t block, const char* buffer, const uint64_t epoch, const bool prefetch)
+{
+	if (shards_count_ == 0)
+		return;
+
+	auto& shard = shard_of(block);
+	unique_guard lock(shard.lock);
+	if (shard.epoch.load(std::memory_order_relaxed) != epoch || shard.index.count(block) != 0)
+		return;
+	store(shard, block, buffer, prefetch);
+}
+
+std::vector<uint32_t> block_cache::hot_blocks() const
+{
+	std::vector<uint32_t> hot;
+	std::vector<uint32_t> rest;
+	for (std::size_t i = 0; i < shards_count_; ++i)
+	{
+		auto& shard = shards_[i];
+		shared_guard lock(shard.lock);
+		for (const auto& entry : shard.index)
+		{
+			const auto slot = entry.second;
+			if (shard.unread[slot].load(std::memory_order_relaxed))
+				continue;
+			if (shard.pins[slot] != 0 || shard.policy->referenced(slot))
+				hot.push_back(entry.first);
+			else
+				rest.push_back(entry.first);
+		}
+	}
+	hot.insert(hot.end(), rest.begin(), rest.end());
+	return hot;
+}
+
+cache_stats_t block_cache::get_stats() const
+{
+	cache_stats_t stats{};
+	for (std::size_t i = 0; i < shards_count_; ++i)
+	{
+		auto& shard = shards_[i];
+		stats.hits += shard.hits.load(std::memory_order_relaxed);
+		stats.misses += shard.misses.load(std::memory_order_relaxed);
+		stats.evictions += shard.evictions.load(std::memory_order_relaxed);
+		stats.compressed_hits += shard.compressed_hits.load(std::memory_order_relaxed);
+		shared_guard lock(shard.lock);
+		stats.compressed_blocks += shard.tier.get_blocks();
+		stats.compressed_bytes += shard.tier.get_bytes();
+	}
+	return stats;
+}
+
+void block_cache::reset_stats()
+{
+	for (std::size_t i = 0; i < shards_count_; ++i)
+	{
+		shards_[i].hits = 0;
+		shards_[i].misses = 0;
+		shards_[i].evictions = 0;
+		shards_[i].compressed_hits = 0;
+	}
+}
+
+void block_cache::store(cache_shard_t& shard, const uint32_t block, const char* buffer, const bool prefetch)
+{
+	// a compressed copy would be older, even when the block can't be cached
+	shard.tier.erase(block);
+	if (shard.capacity == 0)
+		return;
+
+	std::size_t slot;
+	const auto it = shard.index.find(block);
+	if (it != shard.index.end())
+	{
+		slot = it->second;
+		shard.unread[slot].store(false, std::memory_order_relaxed);
+		shard.policy->touch(slot);
+	}
+	else
+	{
+		slot = take_slot(shard);
+		shard.index[block] = slot;
+		shard.keys[slot] = block;
+		shard.unread[slot].store(prefetch, std::memory_order_relaxed);
+		shard.policy->insert(block, slot);
+	}
+	memcpy(shard.data.data() + slot * block_bytes_, buffer, block_bytes_);
+}
+
+void block_cache::evict(cache_shard_t& shard, const uint32_t block)
+{
+	shard.tier.erase(block);
+	const auto it = shard.index.find(block);
+	if (it == shard.index.end())
+		return;
+
+	const auto slot = it->second;
+	shard.policy->remove(slot);
+	if (shard.pins[slot] != 0)
+	{
+		shard.pins[slot] = 0;
+		--shard.pinned;
+	}
+	shard.free.push_back(slot);
+	shard.index.erase(it);
+}
+
+void block_cache::resize_shard(cache_shard_t& shard, std::size_t capacity)
+{
+	// pinned blocks stay, along with the one slot that is never pinned
+	if (shard.pinned != 0)
+		capacity = std::max(capacity, shard.pinned + 1);
+	if (capacity == shard.capacity)
+		return;
+
+	// the policy picks what goes, as if the shard had filled up
+	while (shard.index.size() > capacity)
+	{
+		const auto slot = shard.policy->victim(shard.pins);
+		const auto it = shard.index.find(shard.keys[slot]);
+		if (it == shard.index.end() || it->second != slot)
+			continue;
+		shard.tier.put(it->first, shard.data.data() + slot * block_bytes_);
+		shard.index.erase(it);
+		shard.evictions.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// the rest move down to the first slots, keeping their reference bits
+	auto policy = make_policy(policy_);
+	policy->reset(capacity);
+	std::vector<uint32_t> keys(capacity, 0);
+	std::vector<uint16_t> pins(capacity, 0);
+	std::unique_ptr<std::atomic<bool>[]> unread(new std::atomic<bool>[capacity]());
+	std::vector<char> data(capacity * block_bytes_, 0);
+	std::size_t used = 0;
+	for (std::size_t slot = 0; slot < shard.used; ++slot)
+	{
+		const auto it = shard.index.find(shard.keys[slot]);
+		if (it == shard.index.end() || it->second != slot)
+			continue;
+
+		keys[used] = it->first;
+		pins[used] = shard.pins[slot];
+		unread[used].store(shard.unread[slot].load(std::memory_order_relaxed), std::memory_order_relaxed);
+		memcpy(data.data() + used * block_bytes_, shard.data.data() + slot * block_bytes_, block_bytes_);
+		policy->insert(it->first, used);
+		if (shard.policy->referenced(slot))
+			policy->touch(used);
+		it->second = used++;
+	}
+
+	shard.capacity = capacity;
+	shard.keys.swap(keys);
+	shard.pins.swap(pins);
+	shard.unread.swap(unread);
+	shard.data.swap(data);
+	shard.policy.swap(policy);
+	shard.free.clear();
+	shard.victims.clear();
+	shard.used = used;
+}
+
+std::size_t block_cache::take_slot(cache_shard_t& shard)
+{
+	if (shard.used < shard.capacity)
+		return shard.used++;
+	if (!shard.free.empty())
+	{
+		const auto slot = shard.free.back();
+		shard.free.pop_back();
+		return slot;
+	}
+
+	std::size_t slot;
+	// a victim slot may have been reused or read since, it is only taken if still unused
+	while (!shard.victims.empty())
+	{
+		slot = shard.victims.back();
+		shard.victims.pop_back();
+		const auto it = shard.index.find(shard.keys[slot]);
+		if (it == shard.index.end() || it->second != slot)
+			continue;
+		if (shard.pins[slot] != 0 || shard.policy->referenced(slot))
+			continue;
+
+		shard.policy->remove(slot);
+		shard.index.erase(it);
+		shard.evictions.fetch_add(1, std::memory_order_relaxed);
+		return slot;
+	}
+
+	slot = shard.policy->victim(shard.pins);
+	const auto it = shard.index.find(shard.keys[slot]);
+	if (it != shard.index.end() && it->second == slot)
+	{
+		shard.tier.put(it->first, shard.data.data() + slot * block_bytes_);
+		shard.index.erase(it);
+	}
+	shard.evictions.fetch_add(1, std::memory_order_relaxed);
+	return slot;
+}
@@ -0,0 +1,186 @@
+#ifndef BLOCKCACHE_H_GUARD
+#define BLOCKCACHE_H_GUARD
+
+#include <cstdint>
+#include <cstdlib>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+
+#include "policy.h"
+#include "compressedtier.h"
+#include "../sync/rwlock.h"
+
+// blocks are spread over at most this many independently locked shards
+#define CACHE_SHARDS_MAX	(16)
+
+typedef struct cache_stats_struct
+{
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	// misses found in the compressed tier
+	uint64_t compressed_hits;
+	uint64_t compressed_blocks;
+	uint64_t compressed_bytes;
+} cache_stats_t;
+
+// one slice of the cache, with its own replacement policy
+typedef struct cache_shard_struct
+{
+	rw_lock lock;
+	// bumped by every write, fills that started earlier are dropped
+	std::atomic<uint64_t> epoch{0};
+	std::unordered_map<uint32_t, std::size_t> index;
+	std::vector<uint32_t> keys;
+	std::unique_ptr<replacement_policy> policy;
+	// prefetched and not read yet, the first read is the first use
+	std::unique_ptr<std::atomic<bool>[]> unread;
+	// pinned slots are never victims, at least one slot always stays free of pins
+	std::vector<uint16_t> pins;
+	std::size_t pinned{0};
+	// slots emptied by evict, reused first
+	std::vector<std::size_t> free;
+	// demoted slots, reused before the policy is asked
+	std::vector<std::size_t> victims;
+	// blocks the policy evicted, demoted ones are not worth keeping
+	compressed_tier tier;
+	std::vector<char> data;
+	std::size_t capacity{0};
+	std::size_t used{0};
+
+	std::atomic<uint64_t> hits{0};
+	std::atomic<uint64_t> misses{0};
+	std::atomic<uint64_t> evictions{0};
+	std::atomic<uint64_t> compressed_hits{0};
+} cache_shard_t;
+
+/**
+ * \brief write-through block cache, safe to use from several threads.
+ * Hits only take their shard shared; a miss is read without any lock
+ * and cached afterwards unless the shard was written meanwhile.
+ * Evicted blocks fall back to a compressed tier with its own budget
+ */
+class block_cache
+{
+public:
+	// budgets are in bytes, the blocks the first holds are counted at reset
+	explicit block_cache(std::size_t budget, cache_policy policy = cache_policy::clock,
+	                     std::size_t compressed_budget = 0);
+
+	block_cache(const block_cache& that);
+	block_cache(block_cache&& that) noexcept;
+	// copies start out empty
+	block_cache& operator=(const block_cache& that);
+	block_cache& operator=(block_cache&& that) noexcept;
+
+	~block_cache() = default;
+
+	// drops everything, later blocks are block_bytes long
+	void reset(std::size_t block_bytes);
+	/**
+	 * \brief changes the budget while the cache is in use, evicting down to it when it shrinks.
+	 * A shard keeps room for its pinned blocks, the shard count only changes at the next reset
+	 */
+	void resize(std::size_t budget);
+	std::size_t get_budget() const { return budget_; }
+	// for the compressed tier, shrinking it drops its oldest blocks
+	void resize_compressed(std::size_t budget);
+	std::size_t get_compressed_budget() const { return compressed_budget_; }
+	void clear() { reset(block_bytes_); }
+	// drops everything as well
+	void set_policy(cache_policy policy);
+	cache_policy get_policy() const { return policy_; }
+
+	// copies a cached block out, false on a miss; a compressed block is moved back first
+	bool read(uint32_t block, char* buffer);
+	// compressed blocks count
+	bool contains(uint32_t block) const;
+	// in blocks
+	std::size_t get_capacity() const { return capacity_; }
+
+	// keeps a cached block from being evicted, false if it is not cached, its shard is full of pins
+	// or its pin count would overflow; a compressed block is moved back first
+	bool pin(uint32_t block);
+	void unpin(uint32_t block);
+	// makes a block the next to be evicted, without aging the rest of the cache
+	void demote(uint32_t block);
+	// forgets a block unless it is pinned
+	void drop(uint32_t block);
+	// forgets a block even if it is pinned, fills that started earlier are dropped
+	void invalidate(uint32_t block);
+
+	// taken before a block is read from disk, see fill
+	uint64_t epoch(uint32_t block) const;
+	// caches a block read from disk, unless it is cached or was written since epoch
+	void fill(uint32_t block, const char* buffer, uint64_t epoch, bool prefetch = false);
+
+	/**
+	 * \brief runs write_disk with the shards of count blocks from first held,
+	 * then caches the blocks if it succeeded
+	 * \return whatever write_disk returned
+	 */
+	template <typename F>
+	int write(uint32_t first, std::size_t count, const char* buffer, F write_disk);
+
+	// the cached blocks, those used since the policy last looked first; prefetched and unread ones are left out
+	std::vector<uint32_t> hot_blocks() const;
+
+	// counted since the last reset_stats, misses are lookups that failed
+	cache_stats_t get_stats() const;
+	void reset_stats();
+private:
+	std::atomic<std::size_t> budget_;
+	std::atomic<std::size_t> compressed_budget_;
+	std::atomic<std::size_t> capacity_{0};
+	cache_policy policy_;
+	std::size_t shards_count_{0};
+	std::size_t block_bytes_{0};
+	std::unique_ptr<cache_shard_t[]> shards_;
+
+	cache_shard_t& shard_of(const uint32_t block) const { return shards_[block % shards_count_]; }
+	// shard lock must be held exclusively
+	void store(cache_shard_t& shard, uint32_t block, const char* buffer, bool prefetch = false);
+	void evict(cache_shard_t& shard, uint32_t block);
+	void resize_shard(cache_shard_t& shard, std::size_t capacity);
+	std::size_t take_slot(cache_shard_t& shard);
+};
+
+template <typename F>
+int block_cache::write(const uint32_t first, const std::size_t count, const char* buffer, F write_disk)
+{
+	if (shards_count_ == 0)
+		return write_disk();
+
+	// shards in ascending order, so that two writers can never wait on each other
+	std::vector<std::size_t> held;
+	for (std::size_t i = 0; i < shards_count_; ++i)
+	{
+		const auto offset = (i + shards_count_ - first % shards_count_) % shards_count_;
+		if (offset < count)
+			held.push_back(i);
+	}
+	for (const auto index : held)
+		shards_[index].lock.lock();
+
+	const auto ret = write_disk();
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		auto& shard = shard_of(first + i);
+		// a failed write leaves the disk contents unknown
+		if (ret < 0)
+			evict(shard, first + i);
+		else
+			store(shard, first + i, buffer + i * block_bytes_);
+	}
+
+	for (auto it = held.rbegin(); it != held.rend(); ++it)
+	{
+		++shards_[*it].epoch;
+		shards_[*it].lock.unlock();
+	}
+	return ret;
+}
+
+#endif
@@ -0,0 +1,68 @@
+#include "compressedtier.h"
+
+#include "lz.h"
+
+void compressed_tier::reset(const std::size_t budget, const std::size_t block_bytes)
+{
+	budget_ = budget;
+	block_bytes_ = block_bytes;
+	bytes_ = 0;
+	index_.clear();
+	order_.clear();
+	scratch_.assign(block_bytes, 0);
+}
+
+void compressed_tier::resize(const std::size_t budget)
+{
+	budget_ = budget;
+	while (bytes_ > budget_)
+		pop_oldest();
+}
+
+bool compressed_tier::put(const uint32_t block, const char* buffer)
+{
+	if (budget_ == 0 || block_bytes_ == 0)
+		return false;
+
+	erase(block);
+	// a block that doesn't shrink is cheaper to read from disk again
+	const auto size = lz_compress(buffer, block_bytes_, scratch_.data(), block_bytes_ - 1);
+	if (size == 0 || size > budget_)
+		return false;
+
+	while (bytes_ + size > budget_)
+		pop_oldest();
+	order_.push_front(block);
+	auto& entry = index_[block];
+	entry.data.assign(scratch_.data(), scratch_.data() + size);
+	entry.age = order_.begin();
+	bytes_ += size;
+	return true;
+}
+
+bool compressed_tier::take(const uint32_t block, char* buffer)
+{
+	const auto it = index_.find(block);
+	if (it == index_.end())
+		return false;
+
+	const auto ok = lz_decompress(it->second.data.data(), it->second.data.size(), buffer, block_bytes_);
+	erase(block);
+	return ok;
+}
+
+void compressed_tier::erase(const uint32_t block)
+{
+	const auto it = index_.find(block);
+	if (it == index_.end())
+		return;
+	bytes_ -= it->second.data.size();
+	order_.erase(it->second.age);
+	index_.erase(it);
+}
+
+void compressed_tier::pop_oldest()
+{
+	if (!order_.empty())
+		erase(order_.back());
+}
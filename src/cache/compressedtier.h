@@ -0,0 +1,50 @@
+#ifndef COMPRESSEDTIER_H_GUARD
+#define COMPRESSEDTIER_H_GUARD
+
+#include <cstdint>
+#include <cstdlib>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * \brief blocks evicted from a cache shard, kept compressed with lz_compress.
+ * A block is either in the shard or here, never both. The oldest blocks go first
+ * once the budget is used up. Not locked, its shard's lock covers it
+ */
+class compressed_tier
+{
+public:
+	// drops everything, budget is in compressed bytes
+	void reset(std::size_t budget, std::size_t block_bytes);
+	// drops the oldest blocks down to the new budget
+	void resize(std::size_t budget);
+
+	// keeps a copy of the block, unless it doesn't get any smaller
+	bool put(uint32_t block, const char* buffer);
+	// decompresses the block into buffer and forgets it, false if it is not kept
+	bool take(uint32_t block, char* buffer);
+	bool contains(const uint32_t block) const { return index_.count(block) != 0; }
+	void erase(uint32_t block);
+
+	std::size_t get_blocks() const { return index_.size(); }
+	std::size_t get_bytes() const { return bytes_; }
+private:
+	typedef struct entry_struct
+	{
+		std::vector<char> data;
+		std::list<uint32_t>::iterator age;
+	} entry_t;
+
+	std::size_t budget_{0};
+	std::size_t block_bytes_{0};
+	std::size_t bytes_{0};
+	std::unordered_map<uint32_t, entry_t> index_;
+	// newest first
+	std::list<uint32_t> order_;
+	std::vector<char> scratch_;
+
+	void pop_oldest();
+};
+
+#endif
@@ -0,0 +1,154 @@
+#include "lz.h"
+
+#include <cstring>
+
+static uint32_t read32(const uint8_t* pos)
+{
+	uint32_t value;
+	memcpy(&value, pos, sizeof(value));
+	return value;
+}
+
+static uint32_t lz_hash(const uint32_t sequence)
+{
+	return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// a length field past its four token bits, false if it doesn't fit
+static bool put_length(uint8_t* dst, std::size_t capacity, std::size_t* out, std::size_t length)
+{
+	for (; length >= 255; length -= 255)
+	{
+		if (*out >= capacity)
+			return false;
+		dst[(*out)++] = 255;
+	}
+	if (*out >= capacity)
+		return false;
+	dst[(*out)++] = static_cast<uint8_t>(length);
+	return true;
+}
+
+static bool get_length(const uint8_t* src, std::size_t src_size, std::size_t* in, std::size_t* length)
+{
+	uint8_t byte;
+	do
+	{
+		if (*in >= src_size)
+			return false;
+		byte = src[(*in)++];
+		*length += byte;
+	}
+	while (byte == 255);
+	return true;
+}
+
+// literals_count literals then, unless match_length is 0, a match
+static bool put_sequence(uint8_t* dst, const std::size_t capacity, std::size_t* out, const uint8_t* literals,
+                         const std::size_t literals_count, const std::size_t offset, const std::size_t match_length)
+{
+	if (*out >= capacity)
+		return false;
+	const auto match_code = match_length != 0 ? match_length - LZ_MIN_MATCH : 0;
+	auto& token = dst[(*out)++];
+	token = static_cast<uint8_t>((literals_count < 15 ? literals_count : 15) << 4 | (match_code < 15 ? match_code : 15));
+
+	if (literals_count >= 15 && !put_length(dst, capacity, out, literals_count - 15))
+		return false;
+	if (capacity - *out < literals_count)
+		return false;
+	memcpy(dst + *out, literals, literals_count);
+	*out += literals_count;
+
+	if (match_length == 0)
+		return true;
+	if (capacity - *out < 2)
+		return false;
+	dst[(*out)++] = static_cast<uint8_t>(offset);
+	dst[(*out)++] = static_cast<uint8_t>(offset >> 8);
+	return match_code < 15 || put_length(dst, capacity, out, match_code - 15);
+}
+
+std::size_t lz_compress(const char* src, const std::size_t size, char* dst, const std::size_t capacity)
+{
+	const auto in = reinterpret_cast<const uint8_t*>(src);
+	const auto out_buf = reinterpret_cast<uint8_t*>(dst);
+	// positions + 1, 0 is empty
+	uint32_t table[1 << LZ_HASH_BITS] = {};
+
+	std::size_t pos = 0;
+	std::size_t anchor = 0;
+	std::size_t out = 0;
+	while (pos + LZ_MIN_MATCH <= size)
+	{
+		const auto sequence = read32(in + pos);
+		auto& slot = table[lz_hash(sequence)];
+		const std::size_t candidate = slot;
+		slot = static_cast<uint32_t>(pos + 1);
+		if (candidate == 0 || pos - (candidate - 1) > LZ_WINDOW || read32(in + candidate - 1) != sequence)
+		{
+			++pos;
+			continue;
+		}
+
+		const auto match = candidate - 1;
+		auto length = static_cast<std::size_t>(LZ_MIN_MATCH);
+		while (pos + length < size && in[match + length] == in[pos + length])
+			++length;
+		if (!put_sequence(out_buf, capacity, &out, in + anchor, pos - anchor, pos - match, length))
+			return 0;
+		pos += length;
+		anchor = pos;
+	}
+
+	if (!put_sequence(out_buf, capacity, &out, in + anchor, size - anchor, 0, 0))
+		return 0;
+	return out;
+}
+
+bool lz_decompress(const char* src, const std::size_t src_size, char* dst, const std::size_t size)
+{
+	const auto in_buf = reinterpret_cast<const uint8_t*>(src);
+	const auto out_buf = reinterpret_cast<uint8_t*>(dst);
+
+	std::size_t in = 0;
+	std::size_t out = 0;
+	while (in < src_size)
+	{
+		const auto token = in_buf[in++];
+		std::size_t literals = token >> 4;
+		if (literals == 15 && !get_length(in_buf, src_size, &in, &literals))
+			return false;
+		if (src_size - in < literals || size - out < literals)
+			return false;
+		memcpy(out_buf + out, in_buf + in, literals);
+		in += literals;
+		out += literals;
+
+		// the last sequence ends with its literals
+		if (in == src_size)
+			break;
+
+		if (src_size - in < 2)
+			return false;
+		const std::size_t offset = in_buf[in] | in_buf[in + 1] << 8;
+		in += 2;
+		std::size_t length = token & 15;
+		if (length == 15 && !get_length(in_buf, src_size, &in, &length))
+			return false;
+		length += LZ_MIN_MATCH;
+		if (offset == 0 || offset > out || size - out < length)
+			return false;
+
+		// byte by byte when the match overlaps what it produces
+		if (offset >= length)
+		{
+			memcpy(out_buf + out, out_buf + out - offset, length);
+			out += length;
+			continue;
+		}
+		for (std::size_t i = 0; i < length; ++i, ++out)
+			out_buf[out] = out_buf[out - offset];
+	}
+	return out == size;
+}
@@ -0,0 +1,24 @@
+#ifndef LZ_H_GUARD
+#define LZ_H_GUARD
+
+#include <cstdint>
+#include <cstdlib>
+
+// shortest match worth encoding, and the bytes hashed to find one
+#define LZ_MIN_MATCH	(4)
+// matches are looked for at most this far back
+#define LZ_WINDOW		(65535)
+// entries of the match finder's hash table, a power of two
+#define LZ_HASH_BITS	(12)
+
+/**
+ * \brief LZ77 in the style of LZ4: a sequence is a token (literal count and match length - 4,
+ * four bits each, 15 continued by bytes of 255), the literals, a two byte offset and the rest
+ * of the match length. The last sequence has literals only
+ * \return bytes written to dst, 0 if they would not fit in capacity
+ */
+std::size_t lz_compress(const char* src, std::size_t size, char* dst, std::size_t capacity);
+// false unless src decodes to exactly size bytes
+bool lz_decompress(const char* src, std::size_t src_size, char* dst, std::size_t size);
+
+#endif
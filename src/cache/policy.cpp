@@ -0,0 +1,236 @@
+#include "policy.h"
+
+std::unique_ptr<replacement_policy> make_policy(const cache_policy policy)
+{
+	switch (policy)
+	{
+	case cache_policy::car:
+		return std::unique_ptr<replacement_policy>(new car_policy());
+	default:
+		return std::unique_ptr<replacement_policy>(new clock_policy());
+	}
+}
+
+void clock_policy::reset(const std::size_t capacity)
+{
+	capacity_ = capacity;
+	hand_ = 0;
+	referenced_.reset(new std::atomic<bool>[capacity]());
+}
+
+void clock_policy::touch(const std::size_t slot)
+{
+	referenced_[slot].store(true, std::memory_order_relaxed);
+}
+
+void clock_policy::insert(uint32_t, const std::size_t slot)
+{
+	touch(slot);
+}
+
+void clock_policy::remove(const std::size_t slot)
+{
+	// the slot goes around once more before reuse
+	demote(slot);
+}
+
+void clock_policy::demote(const std::size_t slot)
+{
+	referenced_[slot].store(false, std::memory_order_relaxed);
+}
+
+bool clock_policy::referenced(const std::size_t slot) const
+{
+	return referenced_[slot].load(std::memory_order_relaxed);
+}
+
+// the hand skips blocks used since it last passed them, clearing their mark
+std::size_t clock_policy::victim(const std::vector<uint16_t>& pins)
+{
+	for (;;)
+	{
+		const auto slot = hand_;
+		hand_ = (hand_ + 1) % capacity_;
+		if (pins[slot] != 0)
+			continue;
+		if (referenced_[slot].exchange(false, std::memory_order_relaxed))
+			continue;
+		return slot;
+	}
+}
+
+void ghost_list::clear()
+{
+	order_.clear();
+	index_.clear();
+}
+
+bool ghost_list::erase(const uint32_t block)
+{
+	const auto it = index_.find(block);
+	if (it == index_.end())
+		return false;
+	order_.erase(it->second);
+	index_.erase(it);
+	return true;
+}
+
+void ghost_list::push(const uint32_t block)
+{
+	erase(block);
+	order_.push_front(block);
+	index_[block] = order_.begin();
+}
+
+void ghost_list::pop_oldest()
+{
+	if (order_.empty())
+		return;
+	index_.erase(order_.back());
+	order_.pop_back();
+}
+
+void car_policy::reset(const std::size_t capacity)
+{
+	capacity_ = capacity;
+	target_t1_ = 0;
+	t1_.clear();
+	t2_.clear();
+	t1_size_ = 0;
+	t2_size_ = 0;
+	b1_.clear();
+	b2_.clear();
+	clock_of_.assign(capacity, clock_id::none);
+	generation_.assign(capacity, 0);
+	block_of_.assign(capacity, 0);
+	referenced_.reset(new std::atomic<bool>[capacity]());
+}
+
+void car_policy::touch(const std::size_t slot)
+{
+	referenced_[slot].store(true, std::memory_order_relaxed);
+}
+
+void car_policy::insert(const uint32_t block, const std::size_t slot)
+{
+	block_of_[slot] = block;
+	referenced_[slot].store(false, std::memory_order_relaxed);
+
+	// a ghost hit means the clock it was evicted from was too small
+	if (b1_.erase(block))
+	{
+		const auto step = b2_.size() > b1_.size() + 1 ? b2_.size() / (b1_.size() + 1) : 1;
+		target_t1_ = target_t1_ + step < capacity_ ? target_t1_ + step : capacity_;
+		place(slot, clock_id::t2);
+		return;
+	}
+	if (b2_.erase(block))
+	{
+		const auto step = b1_.size() > b2_.size() + 1 ? b1_.size() / (b2_.size() + 1) : 1;
+		target_t1_ = target_t1_ > step ? target_t1_ - step : 0;
+		place(slot, clock_id::t2);
+		return;
+	}
+
+	// keep the history at most as long as the cache itself
+	if (t1_size_ + b1_.size() >= capacity_)
+		b1_.pop_oldest();
+	else if (t1_size_ + t2_size_ + b1_.size() + b2_.size() >= 2 * capacity_)
+		b2_.pop_oldest();
+	place(slot, clock_id::t1);
+}
+
+void car_policy::remove(const std::size_t slot)
+{
+	unplace(slot);
+	referenced_[slot].store(false, std::memory_order_relaxed);
+}
+
+void car_policy::demote(const std::size_t slot)
+{
+	referenced_[slot].store(false, std::memory_order_relaxed);
+}
+
+bool car_policy::referenced(const std::size_t slot) const
+{
+	return referenced_[slot].load(std::memory_order_relaxed);
+}
+
+std::size_t car_policy::victim(const std::vector<uint16_t>& pins)
+{
+	// pinned blocks met in t2 in a row, once they fill it t1 has to give up a slot
+	std::size_t pinned_t2 = 0;
+	for (;;)
+	{
+		auto from_t1 = t2_size_ == 0 || (t1_size_ != 0 && t1_size_ >= (target_t1_ ? target_t1_ : 1));
+		if (!from_t1 && t1_size_ != 0 && pinned_t2 >= t2_size_)
+			from_t1 = true;
+		const auto slot = from_t1 ? head(t1_, clock_id::t1) : head(t2_, clock_id::t2);
+		if (!from_t1)
+			pinned_t2 = pins[slot] != 0 ? pinned_t2 + 1 : 0;
+		const auto keep = pins[slot] != 0 || referenced_[slot].exchange(false, std::memory_order_relaxed);
+
+		unplace(slot);
+		if (keep)
+		{
+			// referenced blocks of either clock continue in t2
+			place(slot, clock_id::t2);
+			continue;
+		}
+		if (from_t1)
+			b1_.push(block_of_[slot]);
+		else
+			b2_.push(block_of_[slot]);
+		return slot;
+	}
+}
+
+void car_policy::place(const std::size_t slot, const clock_id clock)
+{
+	clock_of_[slot] = clock;
+	if (clock == clock_id::t1)
+	{
+		t1_.emplace_back(slot, ++generation_[slot]);
+		++t1_size_;
+		compact(t1_, clock_id::t1);
+	}
+	else
+	{
+		t2_.emplace_back(slot, ++generation_[slot]);
+		++t2_size_;
+		compact(t2_, clock_id::t2);
+	}
+}
+
+void car_policy::compact(std::deque<entry_t>& clock, const clock_id id)
+{
+	if (clock.size() <= 2 * capacity_)
+		return;
+
+	std::deque<entry_t> live;
+	for (const auto& entry : clock)
+		if (generation_[entry.first] == entry.second && clock_of_[entry.first] == id)
+			live.push_back(entry);
+	clock.swap(live);
+}
+
+void car_policy::unplace(const std::size_t slot)
+{
+	if (clock_of_[slot] == clock_id::t1)
+		--t1_size_;
+	else if (clock_of_[slot] == clock_id::t2)
+		--t2_size_;
+	clock_of_[slot] = clock_id::none;
+	++generation_[slot];
+}
+
+std::size_t car_policy::head(std::deque<entry_t>& clock, const clock_id id)
+{
+	for (;;)
+	{
+		const auto entry = clock.front();
+		clock.pop_front();
+		if (generation_[entry.first] == entry.second && clock_of_[entry.first] == id)
+			return entry.first;
+	}
+}
@@ -0,0 +1,122 @@
+#ifndef POLICY_H_GUARD
+#define POLICY_H_GUARD
+
+#include <cstdint>
+#include <cstdlib>
+#include <atomic>
+#include <deque>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// which blocks a cache shard gives up when it is full
+enum class cache_policy
+{
+	// second chance: a block read since the hand last passed it stays
+	clock,
+	// clock with adaptive replacement: blocks seen once and blocks seen again get separate,
+	// self-tuning shares of the cache, so one long scan can't evict the blocks in use
+	car
+};
+
+/**
+ * \brief bookkeeping of one shard's slots for a replacement policy.
+ * Everything but touch is called with the shard locked exclusively
+ */
+class replacement_policy
+{
+public:
+	virtual ~replacement_policy() = default;
+
+	// forgets everything, the shard now has capacity slots
+	virtual void reset(std::size_t capacity) = 0;
+	// the block in slot was read; the shard may only be locked shared
+	virtual void touch(std::size_t slot) = 0;
+	// block was put in a free slot
+	virtual void insert(uint32_t block, std::size_t slot) = 0;
+	// the block in slot was dropped by the cache itself
+	virtual void remove(std::size_t slot) = 0;
+	// the block in slot should go before the others
+	virtual void demote(std::size_t slot) = 0;
+	virtual bool referenced(std::size_t slot) const = 0;
+	// frees and returns the slot to reuse, never a pinned one; one slot at least must be unpinned
+	virtual std::size_t victim(const std::vector<uint16_t>& pins) = 0;
+};
+
+std::unique_ptr<replacement_policy> make_policy(cache_policy policy);
+
+class clock_policy : public replacement_policy
+{
+public:
+	void reset(std::size_t capacity) override;
+	void touch(std::size_t slot) override;
+	void insert(uint32_t block, std::size_t slot) override;
+	void remove(std::size_t slot) override;
+	void demote(std::size_t slot) override;
+	bool referenced(std::size_t slot) const override;
+	std::size_t victim(const std::vector<uint16_t>& pins) override;
+private:
+	std::size_t capacity_{0};
+	std::size_t hand_{0};
+	std::unique_ptr<std::atomic<bool>[]> referenced_;
+};
+
+// blocks of slots that were evicted recently, most recent first
+class ghost_list
+{
+public:
+	void clear();
+	std::size_t size() const { return order_.size(); }
+	bool erase(uint32_t block);
+	void push(uint32_t block);
+	void pop_oldest();
+private:
+	std::list<uint32_t> order_;
+	std::unordered_map<uint32_t, std::list<uint32_t>::iterator> index_;
+};
+
+/**
+ * \brief CAR, Bansal and Modha 2004. Blocks enter the recency clock t1 and move to the
+ * frequency clock t2 once they are referenced again; the ghosts of evicted blocks steer
+ * the target size p of t1
+ */
+class car_policy : public replacement_policy
+{
+public:
+	void reset(std::size_t capacity) override;
+	void touch(std::size_t slot) override;
+	void insert(uint32_t block, std::size_t slot) override;
+	void remove(std::size_t slot) override;
+	void demote(std::size_t slot) override;
+	bool referenced(std::size_t slot) const override;
+	std::size_t victim(const std::vector<uint16_t>& pins) override;
+private:
+	enum class clock_id : uint8_t { none, t1, t2 };
+	// a slot that is taken out and put back gets a new generation, older queue entries are skipped
+	typedef std::pair<std::size_t, uint32_t> entry_t;
+
+	std::size_t capacity_{0};
+	std::size_t target_t1_{0};
+	std::deque<entry_t> t1_;
+	std::deque<entry_t> t2_;
+	std::size_t t1_size_{0};
+	std::size_t t2_size_{0};
+	ghost_list b1_;
+	ghost_list b2_;
+
+	std::vector<clock_id> clock_of_;
+	std::vector<uint32_t> generation_;
+	std::vector<uint32_t> block_of_;
+	std::unique_ptr<std::atomic<bool>[]> referenced_;
+
+	void place(std::size_t slot, clock_id clock);
+	// drops the skipped entries once they outnumber the live ones
+	void compact(std::deque<entry_t>& clock, clock_id id);
+	void unplace(std::size_t slot);
+	// pops the oldest live entry of a clock
+	std::size_t head(std::deque<entry_t>& clock, clock_id id);
+};
+
+#endif
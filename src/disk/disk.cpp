@@ -2,6 +2,8 @@
 
 #include "../errors.h"
 #include <iomanip>
+#include <fcntl.h>
+#include <unistd.h>
 
 disk::disk(const disk& that)
 {
@@ -19,12 +21,15 @@ disk::disk(disk&& that) noexcept
 
 	disk_file_ = that.disk_file_;
 	that.disk_file_ = nullptr;
+	sync_fd_ = that.sync_fd_;
+	that.sync_fd_ = -1;
 }
 
 disk& disk::operator=(const disk& that)
 {
 	if (this == &that) return *this;
 
+	this->unload();
 	if (that.disk_file_ && that.disk_file_->is_open())
 	{
 		load(that.filename_);
@@ -38,11 +43,14 @@ disk& disk::operator=(disk&& that) noexcept
 {
 	if (this == &that) return *this;
 
+	this->unload();
 	filename_ = that.filename_;
 	that.filename_ = {};
 
 	disk_file_ = that.disk_file_;
 	that.disk_file_ = nullptr;
+	sync_fd_ = that.sync_fd_;
+	that.sync_fd_ = -1;
 
 	return *this;
 }
@@ -73,7 +81,14 @@ int disk::create(const std::string& disk_name, std::size_t size)
 			return EP_WRFIL;
 	}
 
+	this->sync_fd_ = ::open(disk_name.c_str(), O_RDWR);
+	if (this->sync_fd_ < 0)
+	{
+		delete disk;
+		return EP_OPFIL;
+	}
 	this->disk_file_ = disk;
+	this->filename_ = disk_name;
 
 	disk->flush();
 	return 0;
@@ -93,7 +108,14 @@ int disk::load(const std::string& disk_name)
 	if (!(*disk))
 		return EP_OPFIL;
 
+	this->sync_fd_ = ::open(disk_name.c_str(), O_RDWR);
+	if (this->sync_fd_ < 0)
+	{
+		delete disk;
+		return EP_OPFIL;
+	}
 	this->disk_file_ = disk;
+	this->filename_ = disk_name;
 	return 0;
 }
 
@@ -105,6 +127,9 @@ int disk::unload()
 		this->disk_file_->close();
 		delete this->disk_file_;
 		this->disk_file_ = nullptr;
+		if (this->sync_fd_ >= 0)
+			::close(this->sync_fd_);
+		this->sync_fd_ = -1;
 		return 0;
 	}
 	return ED_NODISK;
@@ -112,6 +137,7 @@ int disk::unload()
 
 int disk::read_block(const uint32_t start_sector, char* buffer, const std::size_t size) const
 {
+	std::lock_guard<std::mutex> lock(lock_);
 	if (!(this->disk_file_) || !(this->disk_file_->is_open()))
 		return ED_NODISK;
 	this->disk_file_->seekg(start_sector * SECTOR_SIZE, std::fstream::beg);
@@ -124,6 +150,7 @@ int disk::read_block(const uint32_t start_sector, char* buffer, const std::size_
 
 int disk::write_block(uint32_t start_sector, const char* buffer, const std::size_t size) const
 {
+	std::lock_guard<std::mutex> lock(lock_);
 	if (!(this->disk_file_) || !(this->disk_file_->is_open()))
 		return ED_NODISK;
 	this->disk_file_->seekp(start_sector * SECTOR_SIZE, std::fstream::beg);
@@ -134,6 +161,19 @@ int disk::write_block(uint32_t start_sector, const char* buffer, const std::size
 	return EP_WRFIL;
 }
 
+int disk::flush(const bool data_only) const
+{
+	std::lock_guard<std::mutex> lock(lock_);
+	if (!(this->disk_file_) || !(this->disk_file_->is_open()))
+		return ED_NODISK;
+	this->disk_file_->flush();
+
+	if (this->disk_file_->bad() || this->sync_fd_ < 0)
+		return EP_WRFIL;
+	const auto ret = data_only ? ::fdatasync(this->sync_fd_) : ::fsync(this->sync_fd_);
+	return ret == 0 ? 0 : EP_WRFIL;
+}
+
 bool disk::is_open() const
 {
 	return this->disk_file_ && this->disk_file_->is_open();
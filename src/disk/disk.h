@@ -4,6 +4,7 @@
 #include <string>
 #include <fstream>
 #include <cstdint>
+#include <mutex>
 
 #define SECTOR_SIZE (512)
 
@@ -28,11 +29,18 @@ public:
 
 	int read_block(uint32_t start_sector, char* buffer, std::size_t size) const;
 	int write_block(uint32_t start_sector, const char* buffer, std::size_t size) const;
+	// hands what the stream still buffers to the system, then waits for it to reach the device;
+	// data_only leaves out the file metadata not needed to read the data back, see fdatasync(2)
+	int flush(bool data_only = false) const;
 
 	bool is_open() const;
 private:
 	std::string filename_{};
 	std::fstream* disk_file_{nullptr};
+	// the same file, for fsync, which the stream has no way to do
+	int sync_fd_{-1};
+	// one seek and transfer at a time on the shared stream
+	mutable std::mutex lock_;
 };
 
 #endif
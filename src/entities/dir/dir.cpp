@@ -6,6 +6,8 @@
 
 #include <cstring>
 
+#include "dirscan.h"
+
 directory::directory(directory&& that) noexcept
 {
 	file_ = that.file_;
@@ -54,44 +56,34 @@ void directory::reopen(uint32_t inode_n, file_system* fs) const
 		throw std::exception();
 }
 
-dirent_t directory::find(const std::string& filename) const
+bool directory::is_packed() const
 {
-	const int prev_pos = file_->get_curr_pos();
-	file_->seek(0);
+	return file_->fs_->has_feature(SB_FEAT_PACKED_DIRS);
+}
 
-	dirent_t dirent;
-	do
-	{
-		const auto ret = file_->read(reinterpret_cast<char *>(&dirent), sizeof(dirent_t));
-		if (ret < 0)
-			break;
-		const auto curr_filename = std::string(dirent.name);
-		if (curr_filename == filename)
-		{
-			file_->seek(prev_pos);
-			return dirent;
-		}
-	}
-	while (dirent.inode_n != INVALID_INODE);
+std::size_t directory::max_name_len() const
+{
+	return is_packed() ? DIRENT_LONG_NAME_MAX : DIRENT_NAME_MAX;
+}
 
-	dirent.inode_n = INVALID_INODE;
-	dirent.name[0] = '\0';
+bool directory::is_hashed() const
+{
+	inode_t inode;
+	return file_->get_inode(&inode) >= 0 && (inode.flags & INODE_FLAG_HASHED);
+}
 
-	file_->seek(prev_pos);
-	return dirent;
+dirent_t directory::find(const std::string& filename) const
+{
+	if (is_hashed())
+		return hashed_find(filename);
+	return is_packed() ? packed_find(filename) : fixed_find(filename);
 }
 
 dirent_t directory::read() const
 {
-	dirent_t dirent;
-	const auto ret = file_->read(reinterpret_cast<char *>(&dirent), sizeof(dirent_t));
-
-	if (ret < 0)
-		return INVALID_DIRENT;
-
-	if (dirent.inode_n == INVALID_INODE)
-		file_->seek(file_->get_curr_pos() - sizeof(dirent_t));
-	return dirent;
+	if (is_hashed())
+		return hashed_read();
+	return is_packed() ? packed_read(nullptr) : fixed_read();
 }
 
 void directory::rewind() const
@@ -111,43 +103,129 @@ directory& directory::operator=(const directory& that)
 
 int directory::add_entry(uint32_t inode_n, const std::string& filename) const
 {
-	auto dirent = find(filename);
+	if (filename.size() > max_name_len())
+		return EDIR_NAME_TOO_LONG;
+
+	const auto dirent = find(filename);
 
 	if (dirent.inode_n != INVALID_INODE)
 		return EDIR_FILE_EXISTS;
 
 	auto tmp = file(inode_n, file_->fs_);
 	inode_t inode;
-	auto ret = tmp.get_inode(&inode);
+	const auto ret = tmp.get_inode(&inode);
 
 	if (ret < 0)
 		return ret;
 
+	if (is_hashed())
+		return hashed_add_entry(inode_n, inode.f_type, filename);
+	if (is_packed())
+		return packed_add_entry(inode_n, inode.f_type, filename);
+	return fixed_add_entry(inode_n, inode.f_type, filename);
+}
+
+int directory::remove_entry(const std::string& filename) const
+{
+	if (is_hashed())
+		return hashed_remove_entry(filename);
+	return is_packed() ? packed_remove_entry(filename) : fixed_remove_entry(filename);
+}
+
+static dirent_t to_dirent(const fixed_dirent_t& fixed)
+{
+	dirent_t dirent;
+	dirent.inode_n = fixed.inode_n;
+	dirent.f_type = fixed.f_type;
+	// a name using the whole field has no terminator on disk
+	memcpy(dirent.name, fixed.name, DIRENT_NAME_MAX);
+	dirent.name[DIRENT_NAME_MAX] = '\0';
+	return dirent;
+}
+
+static bool fixed_name_equals(const fixed_dirent_t& fixed, const std::string& filename)
+{
+	return filename.size() <= DIRENT_NAME_MAX && strncmp(fixed.name, filename.c_str(), DIRENT_NAME_MAX) == 0;
+}
+
+dirent_t directory::fixed_find(const std::string& filename) const
+{
+	const auto prev_pos = file_->get_curr_pos();
+	file_->seek(0);
+
+	// scan the directory a block's worth of entries at a time, in place
+	const auto batch = file_->get_block_bytes() / sizeof(fixed_dirent_t);
+	scratch_block block(file_->fs_->scratch_);
+	const auto entries = reinterpret_cast<fixed_dirent_t *>(block.data());
+
+	auto found = INVALID_DIRENT;
+	while (true)
+	{
+		const auto ret = file_->read_partial(block.data(), batch * sizeof(fixed_dirent_t));
+		if (ret < static_cast<int>(sizeof(fixed_dirent_t)))
+			break;
+
+		// an entry cut by the end of the allocated blocks is re-read with the next batch
+		const auto count = ret / sizeof(fixed_dirent_t);
+		file_->seek(file_->get_curr_pos() - ret % sizeof(fixed_dirent_t));
+
+		const auto index = dirent_scan(entries, count, filename.data(), filename.size());
+		if (index < count)
+		{
+			if (entries[index].inode_n != INVALID_INODE)
+				found = to_dirent(entries[index]);
+			break;
+		}
+	}
+
+	file_->seek(prev_pos);
+	return found;
+}
+
+dirent_t directory::fixed_read() const
+{
+	fixed_dirent_t dirent;
+	const auto ret = file_->read(reinterpret_cast<char *>(&dirent), sizeof(fixed_dirent_t));
+
+	if (ret < 0)
+		return INVALID_DIRENT;
+
+	if (dirent.inode_n == INVALID_INODE)
+		file_->seek(file_->get_curr_pos() - sizeof(fixed_dirent_t));
+	return to_dirent(dirent);
+}
+
+int directory::fixed_add_entry(uint32_t inode_n, file_type f_type, const std::string& filename) const
+{
+	fixed_dirent_t dirent;
+	int ret;
+
 	const auto prev_pos = file_->get_curr_pos();
 
 	do
 	{
-		ret = file_->read(reinterpret_cast<char *>(&dirent), sizeof(dirent_t));
+		ret = file_->read(reinterpret_cast<char *>(&dirent), sizeof(fixed_dirent_t));
 	}
 	while (dirent.inode_n != INVALID_INODE && ret >= 0);
 
 	dirent.inode_n = inode_n;
-	dirent.f_type = inode.f_type;
-	strcpy(dirent.name, filename.c_str());
+	dirent.f_type = f_type;
+	memset(dirent.name, 0, DIRENT_NAME_MAX);
+	memcpy(dirent.name, filename.data(), filename.size());
 
-	if (file_->get_curr_pos() >= sizeof(dirent_t))
-		file_->seek(file_->get_curr_pos() - sizeof(dirent_t));
+	if (file_->get_curr_pos() >= sizeof(fixed_dirent_t))
+		file_->seek(file_->get_curr_pos() - sizeof(fixed_dirent_t));
 	else
 		file_->seek(0);
 
-	ret = file_->write(reinterpret_cast<char *>(&dirent), sizeof(dirent_t));
+	ret = file_->write(reinterpret_cast<char *>(&dirent), sizeof(fixed_dirent_t));
 	if (ret < 0)
 		return ret;
 
 	dirent.inode_n = INVALID_INODE;
 	dirent.name[0] = '\0';
 
-	ret = file_->write(reinterpret_cast<char *>(&dirent), sizeof(dirent_t));
+	ret = file_->write(reinterpret_cast<char *>(&dirent), sizeof(fixed_dirent_t));
 	if (ret < 0)
 		return ret;
 
@@ -156,17 +234,16 @@ int directory::add_entry(uint32_t inode_n, const std::string& filename) const
 	return 0;
 }
 
-int directory::remove_entry(const std::string& filename) const
+int directory::fixed_remove_entry(const std::string& filename) const
 {
 	const auto prev_pos = file_->get_curr_pos();
 
-	dirent_t dirent;
+	fixed_dirent_t dirent;
 
 	do
 	{
-		file_->read(reinterpret_cast<char *>(&dirent), sizeof(dirent_t));
-		const auto curr_filename = std::string(dirent.name);
-		if (curr_filename == filename)
+		file_->read(reinterpret_cast<char *>(&dirent), sizeof(fixed_dirent_t));
+		if (fixed_name_equals(dirent, filename))
 			break;
 	}
 	while (dirent.inode_n != INVALID_INODE);
@@ -174,34 +251,787 @@ int directory::remove_entry(const std::string& filename) const
 	if (dirent.inode_n == INVALID_INODE)
 		return EDIR_FILE_NOT_FOUND;
 
-	const auto deleted_pos = file_->get_curr_pos() - sizeof(dirent_t);
+	const auto deleted_pos = file_->get_curr_pos() - sizeof(fixed_dirent_t);
 
 	do
 	{
-		file_->read(reinterpret_cast<char *>(&dirent), sizeof(dirent_t));
+		file_->read(reinterpret_cast<char *>(&dirent), sizeof(fixed_dirent_t));
 	}
 	while (dirent.inode_n != INVALID_INODE);
-	const auto end_pos = file_->get_curr_pos() - sizeof(dirent_t);
+	const auto end_pos = file_->get_curr_pos() - sizeof(fixed_dirent_t);
 
-	char* buffer = new char[end_pos - deleted_pos];
-
-	file_->seek(deleted_pos + sizeof(dirent_t));
-	file_->read(buffer, end_pos - deleted_pos - sizeof(dirent_t));
+	// shift the following entries down one slot, a block at a time
+	scratch_block chunk(file_->fs_->scratch_);
+	const auto chunk_bytes = file_->get_block_bytes() / sizeof(fixed_dirent_t) * sizeof(fixed_dirent_t);
+	for (auto from = deleted_pos + sizeof(fixed_dirent_t); from < end_pos; from += chunk_bytes)
+	{
+		const auto size = (end_pos - from < chunk_bytes) ? end_pos - from : chunk_bytes;
+		file_->seek(from);
+		file_->read(chunk.data(), size);
+		file_->seek(from - sizeof(fixed_dirent_t));
+		file_->write(chunk.data(), size);
+	}
 
 	dirent.inode_n = -1;
 	dirent.name[0] = '\0';
 
-	reinterpret_cast<dirent_t *>(buffer)
-		[(end_pos - deleted_pos) / sizeof(dirent_t) - 1] = dirent;
-
-	file_->seek(deleted_pos);
-	file_->write(buffer, end_pos - deleted_pos);
+	file_->seek(end_pos - sizeof(fixed_dirent_t));
+	file_->write(reinterpret_cast<const char *>(&dirent), sizeof(fixed_dirent_t));
 
 	file_->trunc(end_pos);
-	delete[] buffer;
 
 	if (prev_pos > deleted_pos)
 		file_->seek(0);
 
 	return 0;
 }
+
+static std::size_t packed_rec_size(const std::size_t name_len)
+{
+	const auto size = sizeof(packed_dirent_t) + name_len;
+	return (size + PACKED_DIRENT_ALIGN - 1) / PACKED_DIRENT_ALIGN * PACKED_DIRENT_ALIGN;
+}
+
+static void put_packed(char* at, const uint32_t inode_n, const std::size_t rec_len, const file_type f_type,
+                       const std::string& filename)
+{
+	auto rec = reinterpret_cast<packed_dirent_t *>(at);
+	rec->inode_n = inode_n;
+	rec->rec_len = static_cast<uint16_t>(rec_len);
+	rec->name_len = static_cast<uint8_t>(filename.size());
+	rec->f_type = f_type;
+	memcpy(at + sizeof(packed_dirent_t), filename.data(), filename.size());
+}
+
+static bool packed_name_equals(const packed_dirent_t* rec, const std::string& filename)
+{
+	return rec->name_len == filename.size()
+		&& memcmp(reinterpret_cast<const char *>(rec) + sizeof(packed_dirent_t), filename.data(), filename.size()) == 0;
+}
+
+static dirent_t packed_to_dirent(const packed_dirent_t* rec)
+{
+	dirent_t dirent;
+	dirent.inode_n = rec->inode_n;
+	dirent.f_type = rec->f_type;
+	memcpy(dirent.name, reinterpret_cast<const char *>(rec) + sizeof(packed_dirent_t), rec->name_len);
+	dirent.name[rec->name_len] = '\0';
+	return dirent;
+}
+
+/**
+ * \brief looks a name up inside one directory block
+ * \param prev_out offset of the record before the match, block_bytes for the first one
+ * \return offset of the live record named filename, block_bytes if there is none
+ */
+static std::size_t packed_lookup(const char* block, const std::size_t block_bytes, const std::string& filename,
+                                 std::size_t* prev_out)
+{
+	auto prev = block_bytes;
+	std::size_t offset = 0;
+	while (offset < block_bytes)
+	{
+		const auto rec = reinterpret_cast<const packed_dirent_t *>(block + offset);
+		if (rec->rec_len == 0)
+			break;
+		if (rec->inode_n != INVALID_INODE && packed_name_equals(rec, filename))
+		{
+			if (prev_out != nullptr)
+				*prev_out = prev;
+			return offset;
+		}
+		prev = offset;
+		offset += rec->rec_len;
+	}
+	return block_bytes;
+}
+
+// offset of the first record with room for need more bytes, block_bytes if the block is full
+static std::size_t packed_room(const char* block, const std::size_t block_bytes, const std::size_t need)
+{
+	std::size_t offset = 0;
+	while (offset < block_bytes)
+	{
+		const auto rec = reinterpret_cast<const packed_dirent_t *>(block + offset);
+		if (rec->rec_len == 0)
+			break;
+		// either reuse a free record or split the slack off a used one
+		const auto used = rec->inode_n == INVALID_INODE ? 0 : packed_rec_size(rec->name_len);
+		if (rec->rec_len - used >= need)
+			return offset;
+		offset += rec->rec_len;
+	}
+	return block_bytes;
+}
+
+// places an entry into the record at offset, found by packed_room
+static void packed_insert(char* block, const std::size_t offset, const uint32_t inode_n, const file_type f_type,
+                          const std::string& filename)
+{
+	const auto rec = reinterpret_cast<packed_dirent_t *>(block + offset);
+	const auto used = rec->inode_n == INVALID_INODE ? 0 : packed_rec_size(rec->name_len);
+	const auto free_len = rec->rec_len - used;
+	if (used != 0)
+		rec->rec_len = static_cast<uint16_t>(used);
+	put_packed(block + offset + used, inode_n, free_len, f_type, filename);
+}
+
+// a block holding a single free record
+static void packed_clear(char* block, const std::size_t block_bytes)
+{
+	memset(block, 0, block_bytes);
+	const auto rec = reinterpret_cast<packed_dirent_t *>(block);
+	rec->inode_n = INVALID_INODE;
+	rec->rec_len = static_cast<uint16_t>(block_bytes);
+}
+
+// FNV-1a, then mixed down since buckets are picked by the low bits,
+// which alone only depend on the low bits of every character
+static uint32_t name_hash(const std::string& filename)
+{
+	uint32_t hash = 2166136261u;
+	for (const auto c : filename)
+	{
+		hash ^= static_cast<uint8_t>(c);
+		hash *= 16777619u;
+	}
+	hash ^= hash >> 16;
+	hash *= 0x85EBCA6Bu;
+	hash ^= hash >> 13;
+	hash *= 0xC2B2AE35u;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+// an inline directory is a single block the size of the inline area
+std::size_t directory::dir_block_bytes() const
+{
+	inode_t inode;
+	if (file_->get_inode(&inode) >= 0 && (inode.flags & INODE_FLAG_INLINE))
+		return INODE_INLINE_MAX;
+	return file_->get_block_bytes();
+}
+
+int directory::grow_inline_block() const
+{
+	const auto prev_pos = file_->get_curr_pos();
+	const auto block_bytes = file_->get_block_bytes();
+	scratch_block block(file_->fs_->scratch_);
+	memset(block.data(), 0, block_bytes);
+
+	auto ret = read_dir_block(0, block.data());
+	if (ret < 0)
+		return ret;
+
+	// the last record takes over the new space
+	std::size_t offset = 0;
+	auto rec = reinterpret_cast<packed_dirent_t *>(block.data());
+	while (offset + rec->rec_len < INODE_INLINE_MAX)
+	{
+		offset += rec->rec_len;
+		rec = reinterpret_cast<packed_dirent_t *>(block.data() + offset);
+	}
+	rec->rec_len = static_cast<uint16_t>(rec->rec_len + block_bytes - INODE_INLINE_MAX);
+
+	file_->seek(0);
+	ret = file_->write(block.data(), block_bytes);
+	file_->seek(prev_pos);
+	return ret < 0 ? ret : 0;
+}
+
+int directory::read_dir_block(const uint32_t index, char* buffer) const
+{
+	const auto block_bytes = dir_block_bytes();
+	const auto prev_pos = file_->get_curr_pos();
+
+	file_->seek(index * block_bytes);
+	const auto ret = file_->read(buffer, block_bytes);
+	file_->seek(prev_pos);
+
+	return ret < 0 ? ret : 0;
+}
+
+int directory::write_dir_block(const uint32_t index, const char* buffer) const
+{
+	const auto block_bytes = dir_block_bytes();
+	const auto prev_pos = file_->get_curr_pos();
+
+	file_->seek(index * block_bytes);
+	const auto ret = file_->write(buffer, block_bytes);
+	file_->seek(prev_pos);
+
+	return ret < 0 ? ret : 0;
+}
+
+dirent_t directory::packed_find(const std::string& filename) const
+{
+	const auto block_bytes = dir_block_bytes();
+	scratch_block block(file_->fs_->scratch_);
+
+	for (uint32_t index = 0; read_dir_block(index, block.data()) >= 0; ++index)
+	{
+		const auto offset = packed_lookup(block.data(), block_bytes, filename, nullptr);
+		if (offset < block_bytes)
+			return packed_to_dirent(reinterpret_cast<const packed_dirent_t *>(block.data() + offset));
+	}
+	return INVALID_DIRENT;
+}
+
+dirent_t directory::packed_read(const hash_header_t* table) const
+{
+	const auto block_bytes = dir_block_bytes();
+	const auto records = table ? bucket_records() : block_bytes;
+	scratch_block block(file_->fs_->scratch_);
+	auto pos = file_->get_curr_pos();
+
+	while (true)
+	{
+		const auto index = static_cast<uint32_t>(pos / block_bytes);
+		if (table && is_table_block(*table, index))
+		{
+			pos = (index + 1) * block_bytes;
+			continue;
+		}
+		if (read_dir_block(index, block.data()) < 0)
+			return INVALID_DIRENT;
+
+		auto offset = pos % block_bytes;
+		while (offset < records)
+		{
+			const auto rec = reinterpret_cast<const packed_dirent_t *>(block.data() + offset);
+			if (rec->rec_len == 0)
+				break;
+			offset += rec->rec_len;
+			if (rec->inode_n != INVALID_INODE)
+			{
+				file_->seek(index * block_bytes + offset);
+				return packed_to_dirent(rec);
+			}
+		}
+
+		pos = (index + 1) * block_bytes;
+		file_->seek(pos);
+	}
+}
+
+int directory::packed_add_entry(uint32_t inode_n, file_type f_type, const std::string& filename) const
+{
+	const auto block_bytes = dir_block_bytes();
+	const auto need = packed_rec_size(filename.size());
+	scratch_block block(file_->fs_->scratch_);
+
+	uint32_t index = 0;
+	for (; read_dir_block(index, block.data()) >= 0; ++index)
+	{
+		const auto offset = packed_room(block.data(), block_bytes, need);
+		if (offset < block_bytes)
+		{
+			packed_insert(block.data(), offset, inode_n, f_type, filename);
+			return write_dir_block(index, block.data());
+		}
+	}
+
+	// the inode is full, move out to a real block and retry
+	if (index > 0 && block_bytes == INODE_INLINE_MAX && block_bytes != file_->get_block_bytes())
+	{
+		const auto ret = grow_inline_block();
+		if (ret < 0)
+			return ret;
+		return packed_add_entry(inode_n, f_type, filename);
+	}
+
+	// every block is full, start a new one
+	memset(block.data(), 0, block_bytes);
+	put_packed(block.data(), inode_n, block_bytes, f_type, filename);
+	return write_dir_block(index, block.data());
+}
+
+int directory::packed_remove_entry(const std::string& filename) const
+{
+	const auto block_bytes = dir_block_bytes();
+	scratch_block block(file_->fs_->scratch_);
+
+	for (uint32_t index = 0; read_dir_block(index, block.data()) >= 0; ++index)
+	{
+		std::size_t prev;
+		const auto offset = packed_lookup(block.data(), block_bytes, filename, &prev);
+		if (offset == block_bytes)
+			continue;
+
+		// give the space to the previous record, the first one is only marked free
+		const auto rec = reinterpret_cast<packed_dirent_t *>(block.data() + offset);
+		const auto rec_pos = index * block_bytes + offset;
+		const auto rec_len = rec->rec_len;
+		if (prev != block_bytes)
+			reinterpret_cast<packed_dirent_t *>(block.data() + prev)->rec_len += rec_len;
+		else
+			rec->inode_n = INVALID_INODE;
+
+		auto ret = write_dir_block(index, block.data());
+		if (ret < 0)
+			return ret;
+
+		// a record must not be left under the cursor
+		if (file_->get_curr_pos() == rec_pos)
+			file_->seek(rec_pos + rec_len);
+
+		// drop the last block once it holds nothing
+		if (prev == block_bytes && rec_len == block_bytes && read_dir_block(index + 1, block.data()) < 0)
+		{
+			const auto prev_pos = file_->get_curr_pos();
+			ret = file_->trunc(index * block_bytes);
+			if (ret < 0)
+				return ret;
+			file_->seek(prev_pos < index * block_bytes ? prev_pos : index * block_bytes);
+		}
+		return 0;
+	}
+	return EDIR_FILE_NOT_FOUND;
+}
+
+// records end before the chain link
+std::size_t directory::bucket_records() const
+{
+	return dir_block_bytes() - sizeof(uint32_t);
+}
+
+static uint32_t get_next(const char* block, const std::size_t records)
+{
+	uint32_t next;
+	memcpy(&next, block + records, sizeof(next));
+	return next;
+}
+
+static void set_next(char* block, const std::size_t records, const uint32_t next)
+{
+	memcpy(block + records, &next, sizeof(next));
+}
+
+static uint32_t chunk_slots(const uint32_t k)
+{
+	return 1u << (k + HASH_BASE_DEPTH);
+}
+
+// a new directory has no table yet, EFIL_INVALID_SECTOR
+int directory::read_hash_header(hash_header_t* header_out) const
+{
+	const auto ret = file_->pread(reinterpret_cast<char *>(header_out), sizeof(hash_header_t), 0);
+	return ret < 0 ? ret : 0;
+}
+
+int directory::write_hash_header(const hash_header_t& header) const
+{
+	const auto ret = file_->pwrite(reinterpret_cast<const char *>(&header), sizeof(hash_header_t), 0);
+	return ret < 0 ? ret : 0;
+}
+
+std::size_t directory::slot_pos(const hash_header_t& header, const uint32_t index) const
+{
+	if (index < HASH_BASE_SLOTS)
+		return sizeof(hash_header_t) + index * sizeof(hash_slot_t);
+	uint32_t k = 0;
+	while (index >= chunk_slots(k + 1))
+		++k;
+	return header.chunks[k] * dir_block_bytes() + (index - chunk_slots(k)) * sizeof(hash_slot_t);
+}
+
+bool directory::is_table_block(const hash_header_t& header, const uint32_t index) const
+{
+	if (index == 0)
+		return true;
+	const auto block_bytes = dir_block_bytes();
+	for (uint32_t k = 0; k + HASH_BASE_DEPTH < header.depth; ++k)
+	{
+		const auto count = (chunk_slots(k) * sizeof(hash_slot_t) + block_bytes - 1) / block_bytes;
+		if (index >= header.chunks[k] && index < header.chunks[k] + count)
+			return true;
+	}
+	return false;
+}
+
+int directory::read_slot(const hash_header_t& header, const uint32_t index, hash_slot_t* slot_out) const
+{
+	const auto ret = file_->pread(reinterpret_cast<char *>(slot_out), sizeof(hash_slot_t), slot_pos(header, index));
+	return ret < 0 ? ret : 0;
+}
+
+int directory::write_slot(const hash_header_t& header, const uint32_t index, const hash_slot_t& slot) const
+{
+	const auto ret = file_->pwrite(reinterpret_cast<const char *>(&slot), sizeof(hash_slot_t), slot_pos(header, index));
+	return ret < 0 ? ret : 0;
+}
+
+int directory::find_bucket(const std::string& filename, hash_slot_t* slot_out) const
+{
+	hash_header_t header;
+	const auto ret = read_hash_header(&header);
+	if (ret < 0)
+		return ret;
+	return read_slot(header, name_hash(filename) & ((1u << header.depth) - 1), slot_out);
+}
+
+int directory::walk_bucket(uint32_t head, char* block, const std::function<bool(uint32_t)>& fn) const
+{
+	const auto records = bucket_records();
+	while (head != 0)
+	{
+		const auto ret = read_dir_block(head, block);
+		if (ret < 0)
+			return ret;
+		if (fn(head))
+			return 0;
+		head = get_next(block, records);
+	}
+	return 0;
+}
+
+uint32_t directory::bucket_of(const std::string& filename) const
+{
+	hash_slot_t slot;
+	if (!is_hashed() || find_bucket(filename, &slot) < 0)
+		return 0;
+	return slot.bucket;
+}
+
+bool directory::has_room(const std::string& filename) const
+{
+	if (!is_hashed())
+		return true;
+	const auto records = bucket_records();
+	const auto need = packed_rec_size(filename.size());
+	scratch_block block(file_->fs_->scratch_);
+	hash_slot_t slot;
+	auto found = false;
+	return find_bucket(filename, &slot) >= 0
+		&& walk_bucket(slot.bucket, block.data(), [&](uint32_t)
+		{
+			return found = packed_room(block.data(), records, need) < records;
+		}) >= 0 && found;
+}
+
+dirent_t directory::hashed_find(const std::string& filename) const
+{
+	const auto records = bucket_records();
+	scratch_block block(file_->fs_->scratch_);
+	hash_slot_t slot;
+	if (find_bucket(filename, &slot) < 0)
+		return INVALID_DIRENT;
+
+	auto dirent = INVALID_DIRENT;
+	walk_bucket(slot.bucket, block.data(), [&](uint32_t)
+	{
+		const auto offset = packed_lookup(block.data(), records, filename, nullptr);
+		if (offset == records)
+			return false;
+		dirent = packed_to_dirent(reinterpret_cast<const packed_dirent_t *>(block.data() + offset));
+		return true;
+	});
+	return dirent;
+}
+
+dirent_t directory::hashed_read() const
+{
+	hash_header_t header;
+	if (read_hash_header(&header) < 0)
+		return INVALID_DIRENT;
+	return packed_read(&header);
+}
+
+int directory::hashed_add_entry(uint32_t inode_n, file_type f_type, const std::string& filename) const
+{
+	const auto records = bucket_records();
+	const auto need = packed_rec_size(filename.size());
+	scratch_block block(file_->fs_->scratch_);
+
+	for (;;)
+	{
+		hash_slot_t slot;
+		auto ret = find_bucket(filename, &slot);
+		uint32_t index = 0;
+		std::size_t offset = records;
+		if (ret >= 0)
+			ret = walk_bucket(slot.bucket, block.data(), [&](const uint32_t at)
+			{
+				index = at;
+				offset = packed_room(block.data(), records, need);
+				return offset < records;
+			});
+		if (ret < 0 && ret != EFIL_INVALID_SECTOR)
+			return ret;
+		if (offset < records)
+		{
+			packed_insert(block.data(), offset, inode_n, f_type, filename);
+			return write_dir_block(index, block.data());
+		}
+
+		ret = split_bucket(filename);
+		if (ret < 0)
+			return ret;
+	}
+}
+
+// buckets are never merged nor their chains shortened, an emptied block keeps a single free record
+int directory::hashed_remove_entry(const std::string& filename) const
+{
+	const auto block_bytes = dir_block_bytes();
+	const auto records = bucket_records();
+	scratch_block block(file_->fs_->scratch_);
+
+	hash_slot_t slot;
+	auto ret = find_bucket(filename, &slot);
+	if (ret == EFIL_INVALID_SECTOR)
+		return EDIR_FILE_NOT_FOUND;
+	uint32_t index = 0;
+	std::size_t offset = records;
+	std::size_t prev = records;
+	if (ret >= 0)
+		ret = walk_bucket(slot.bucket, block.data(), [&](const uint32_t at)
+		{
+			index = at;
+			offset = packed_lookup(block.data(), records, filename, &prev);
+			return offset < records;
+		});
+	if (ret < 0)
+		return ret;
+	if (offset == records)
+		return EDIR_FILE_NOT_FOUND;
+
+	const auto rec = reinterpret_cast<packed_dirent_t *>(block.data() + offset);
+	const auto rec_pos = index * block_bytes + offset;
+	const auto rec_len = rec->rec_len;
+	if (prev != records)
+		reinterpret_cast<packed_dirent_t *>(block.data() + prev)->rec_len += rec_len;
+	else
+		rec->inode_n = INVALID_INODE;
+
+	ret = write_dir_block(index, block.data());
+	if (ret < 0)
+		return ret;
+
+	if (file_->get_curr_pos() == rec_pos)
+		file_->seek(rec_pos + rec_len);
+	return 0;
+}
+
+// a table of one slot and its empty bucket
+int directory::init_hash_table() const
+{
+	const auto block_bytes = dir_block_bytes();
+	scratch_block block(file_->fs_->scratch_);
+
+	memset(block.data(), 0, block_bytes);
+	hash_header_t header{};
+	header.blocks = 2;
+	const hash_slot_t slot{1, 0};
+	memcpy(block.data(), &header, sizeof(header));
+	memcpy(block.data() + sizeof(header), &slot, sizeof(slot));
+	auto ret = write_dir_block(0, block.data());
+	if (ret < 0)
+		return ret;
+
+	memset(block.data(), 0, block_bytes);
+	packed_clear(block.data(), bucket_records());
+	ret = write_dir_block(1, block.data());
+	if (ret < 0)
+		file_->trunc(0);
+	return ret;
+}
+
+/**
+ * \brief doubles the slots, each new slot points where its lower twin does.
+ * Past HASH_BASE_SLOTS the new half is a chunk appended to the directory
+ */
+int directory::grow_hash_table(hash_header_t* header) const
+{
+	const auto block_bytes = dir_block_bytes();
+	const uint32_t count = 1u << header->depth;
+	std::vector<hash_slot_t> slots(count);
+	for (uint32_t index = 0; index < count; ++index)
+	{
+		const auto ret = read_slot(*header, index, &slots[index]);
+		if (ret < 0)
+			return ret;
+	}
+
+	auto grown = *header;
+	grown.depth += 1;
+	std::size_t pos = slot_pos(*header, count - 1) + sizeof(hash_slot_t);
+	if (count >= HASH_BASE_SLOTS)
+	{
+		const auto k = header->depth - HASH_BASE_DEPTH;
+		grown.chunks[k] = header->blocks;
+		grown.blocks += static_cast<uint32_t>((count * sizeof(hash_slot_t) + block_bytes - 1) / block_bytes);
+		pos = grown.chunks[k] * block_bytes;
+	}
+
+	const auto ret = file_->pwrite(reinterpret_cast<const char *>(slots.data()), count * sizeof(hash_slot_t), pos);
+	if (ret < 0)
+	{
+		file_->trunc(header->blocks * block_bytes);
+		return ret;
+	}
+
+	*header = grown;
+	return write_hash_header(grown);
+}
+
+// appends an empty block to the chain of head
+int directory::chain_bucket(hash_header_t* header, const uint32_t head) const
+{
+	const auto block_bytes = dir_block_bytes();
+	const auto records = bucket_records();
+	scratch_block block(file_->fs_->scratch_);
+	uint32_t last = head;
+	auto ret = walk_bucket(head, block.data(), [&](const uint32_t at)
+	{
+		last = at;
+		return false;
+	});
+	if (ret < 0)
+		return ret;
+
+	scratch_block new_block(file_->fs_->scratch_);
+	memset(new_block.data(), 0, block_bytes);
+	packed_clear(new_block.data(), records);
+	const auto index = header->blocks;
+	ret = write_dir_block(index, new_block.data());
+	if (ret < 0)
+	{
+		file_->trunc(index * block_bytes);
+		return ret;
+	}
+	header->blocks += 1;
+	ret = write_hash_header(*header);
+	if (ret < 0)
+		return ret;
+
+	set_next(block.data(), records, index);
+	return write_dir_block(last, block.data());
+}
+
+/**
+ * \brief makes room in the bucket of filename by splitting it in two on the next bit of
+ * the name hashes, doubling the table first while it has fewer slots than blocks.
+ * A bucket the table can't tell apart any further gets an overflow block instead.
+ * New blocks are written out first, so running out of them leaves the directory as it was
+ */
+int directory::split_bucket(const std::string& filename) const
+{
+	hash_header_t header;
+	auto ret = read_hash_header(&header);
+	if (ret == EFIL_INVALID_SECTOR)
+		return init_hash_table();
+	if (ret < 0)
+		return ret;
+
+	const auto hash = name_hash(filename);
+	hash_slot_t slot;
+	ret = read_slot(header, hash & ((1u << header.depth) - 1), &slot);
+	if (ret < 0)
+		return ret;
+	if (slot.depth == header.depth)
+	{
+		if (header.depth == HASH_DEPTH_MAX || (1u << header.depth) >= header.blocks)
+			return chain_bucket(&header, slot.bucket);
+		ret = grow_hash_table(&header);
+		if (ret < 0)
+			return ret;
+	}
+
+	// take the records out of the whole chain, then pack each half into blocks of its own
+	const auto block_bytes = dir_block_bytes();
+	const auto records = bucket_records();
+	scratch_block block(file_->fs_->scratch_);
+	std::vector<uint32_t> chain;
+	std::vector<std::vector<char>> halves[2];
+	ret = walk_bucket(slot.bucket, block.data(), [&](const uint32_t at)
+	{
+		chain.push_back(at);
+		for (std::size_t offset = 0; offset < records;)
+		{
+			const auto rec = reinterpret_cast<const packed_dirent_t *>(block.data() + offset);
+			if (rec->rec_len == 0)
+				break;
+			offset += rec->rec_len;
+			if (rec->inode_n == INVALID_INODE)
+				continue;
+
+			const auto name = std::string(reinterpret_cast<const char *>(rec) + sizeof(packed_dirent_t), rec->name_len);
+			auto& half = halves[(name_hash(name) >> slot.depth) & 1];
+			const auto need = packed_rec_size(rec->name_len);
+			if (half.empty() || packed_room(half.back().data(), records, need) == records)
+			{
+				half.emplace_back(block_bytes, 0);
+				packed_clear(half.back().data(), records);
+			}
+			auto target = half.back().data();
+			packed_insert(target, packed_room(target, records, need), rec->inode_n, rec->f_type, name);
+		}
+		return false;
+	});
+	if (ret < 0)
+		return ret;
+
+	// the old blocks are reused in chain order, the high half keeps any left over
+	for (auto& half : halves)
+		if (half.empty())
+		{
+			half.emplace_back(block_bytes, 0);
+			packed_clear(half.back().data(), records);
+		}
+	while (halves[0].size() + halves[1].size() < chain.size())
+	{
+		halves[1].emplace_back(block_bytes, 0);
+		packed_clear(halves[1].back().data(), records);
+	}
+	const auto old_blocks = header.blocks;
+	while (chain.size() < halves[0].size() + halves[1].size())
+		chain.push_back(header.blocks++);
+
+	std::size_t next = 0;
+	for (auto& half : halves)
+		for (std::size_t i = 0; i < half.size(); ++i, ++next)
+			set_next(half[i].data(), records, i + 1 < half.size() ? chain[next + 1] : 0);
+
+	const auto block_at = [&](const std::size_t i) -> const char*
+	{
+		return i < halves[0].size() ? halves[0][i].data() : halves[1][i - halves[0].size()].data();
+	};
+	for (std::size_t i = 0; i < chain.size(); ++i)
+	{
+		if (chain[i] < old_blocks)
+			continue;
+		ret = write_dir_block(chain[i], block_at(i));
+		if (ret < 0)
+		{
+			file_->trunc(old_blocks * block_bytes);
+			return ret;
+		}
+	}
+	if (header.blocks != old_blocks)
+	{
+		ret = write_hash_header(header);
+		if (ret < 0)
+			return ret;
+	}
+
+	// the slots of the bucket are the ones sharing its low slot.depth bits
+	const uint32_t high = chain[halves[0].size()];
+	const uint32_t step = 1u << slot.depth;
+	for (auto index = hash & (step - 1); index < (1u << header.depth); index += step)
+	{
+		ret = write_slot(header, index, hash_slot_t{((index >> slot.depth) & 1) ? high : slot.bucket, slot.depth + 1});
+		if (ret < 0)
+			return ret;
+	}
+
+	for (std::size_t i = 0; i < chain.size(); ++i)
+	{
+		if (chain[i] >= old_blocks)
+			continue;
+		ret = write_dir_block(chain[i], block_at(i));
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
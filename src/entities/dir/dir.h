@@ -3,6 +3,8 @@
 
 #include <string>
 #include <cstdint>
+#include <functional>
+#include <vector>
 
 #include "../file/file.h"
 #include "dirent.h"
@@ -27,6 +29,14 @@ public:
 	int remove_entry(const std::string& filename) const;
 
 	dirent_t find(const std::string& filename) const;
+
+	// block of the hash bucket the name belongs to, 0 unless the directory is hashed
+	uint32_t bucket_of(const std::string& filename) const;
+	// whether the bucket of filename can take it without a split
+	bool has_room(const std::string& filename) const;
+	// splits the bucket of filename, the caller must hold the directory exclusively
+	int split_bucket(const std::string& filename) const;
+	bool is_hashed() const;
 	dirent_t read() const;
 	void rewind() const;
 
@@ -38,6 +48,46 @@ public:
 	file* get_file() const { return file_; }
 private:
 	file* file_{nullptr};
+
+	bool is_packed() const;
+	std::size_t max_name_len() const;
+
+	// fixed_dirent_t stream, ended by an entry with an invalid inode
+	dirent_t fixed_find(const std::string& filename) const;
+	dirent_t fixed_read() const;
+	int fixed_add_entry(uint32_t inode_n, file_type f_type, const std::string& filename) const;
+	int fixed_remove_entry(const std::string& filename) const;
+
+	// blocks of packed_dirent_t records, see dirent.h
+	dirent_t packed_find(const std::string& filename) const;
+	// a hashed directory passes its table, whose blocks are skipped
+	dirent_t packed_read(const hash_header_t* table) const;
+	int packed_add_entry(uint32_t inode_n, file_type f_type, const std::string& filename) const;
+	int packed_remove_entry(const std::string& filename) const;
+
+	// extendible hash table of bucket chains, see hash_header_t
+	dirent_t hashed_find(const std::string& filename) const;
+	dirent_t hashed_read() const;
+	int hashed_add_entry(uint32_t inode_n, file_type f_type, const std::string& filename) const;
+	int hashed_remove_entry(const std::string& filename) const;
+	int read_hash_header(hash_header_t* header_out) const;
+	int write_hash_header(const hash_header_t& header) const;
+	std::size_t slot_pos(const hash_header_t& header, uint32_t index) const;
+	bool is_table_block(const hash_header_t& header, uint32_t index) const;
+	int read_slot(const hash_header_t& header, uint32_t index, hash_slot_t* slot_out) const;
+	int write_slot(const hash_header_t& header, uint32_t index, const hash_slot_t& slot) const;
+	int find_bucket(const std::string& filename, hash_slot_t* slot_out) const;
+	// walks the chain from head until fn returns true for a block
+	int walk_bucket(uint32_t head, char* block, const std::function<bool(uint32_t)>& fn) const;
+	std::size_t bucket_records() const;
+	int init_hash_table() const;
+	int grow_hash_table(hash_header_t* header) const;
+	int chain_bucket(hash_header_t* header, uint32_t head) const;
+
+	std::size_t dir_block_bytes() const;
+	int grow_inline_block() const;
+	int read_dir_block(uint32_t index, char* buffer) const;
+	int write_dir_block(uint32_t index, const char* buffer) const;
 };
 
 #endif
@@ -1,15 +1,66 @@
 #ifndef DIRENT_H_GUARD
 #define DIRENT_H_GUARD
 
+// name field of a fixed-size on-disk entry
 #define DIRENT_NAME_MAX (32)
+// longest name a packed on-disk entry can hold
+#define DIRENT_LONG_NAME_MAX (255)
 
 #include "../../inode/inode.h"
 
-typedef struct dirent_struct
+// fixed-size on-disk directory entry
+typedef struct fixed_dirent_struct
 {
 	uint32_t inode_n;
 	file_type f_type;
 	char name[DIRENT_NAME_MAX];
+} fixed_dirent_t;
+
+// header of a variable-length on-disk directory entry, the name follows it.
+// records are PACKED_DIRENT_ALIGN aligned and never cross a directory block,
+// rec_len also covers the free space left after the record
+typedef struct packed_dirent_struct
+{
+	uint32_t inode_n;
+	uint16_t rec_len;
+	uint8_t name_len;
+	file_type f_type;
+} packed_dirent_t;
+
+#define PACKED_DIRENT_ALIGN (4)
+
+// SB_FEAT_HASHED_DIRS: block 0 of a hashed directory holds this header and the first
+// HASH_BASE_SLOTS of its 2^depth hash_slot_t, the rest are in chunks appended as the table doubles.
+// A name goes to the bucket of slot (hash & (2^depth - 1)), the slots agreeing on the low bits
+// a bucket was split on share it, so a full bucket is split alone. Bucket blocks hold packed
+// records and end in the uint32_t block of the next one in the bucket's overflow chain, 0 at the end
+#define HASH_BASE_DEPTH (4)
+#define HASH_BASE_SLOTS (1u << HASH_BASE_DEPTH)
+#define HASH_DEPTH_MAX (16)
+
+typedef struct hash_header_struct
+{
+	uint32_t depth;
+	// table and bucket blocks in use
+	uint32_t blocks;
+	// first block of chunk k, the slots [2^(k + HASH_BASE_DEPTH); 2^(k + HASH_BASE_DEPTH + 1))
+	uint32_t chunks[HASH_DEPTH_MAX - HASH_BASE_DEPTH];
+} hash_header_t;
+
+typedef struct hash_slot_struct
+{
+	// first block of the bucket
+	uint32_t bucket;
+	// hash bits all names in the bucket agree on
+	uint32_t depth;
+} hash_slot_t;
+
+// directory entry as returned to the user, regardless of the on-disk format
+typedef struct dirent_struct
+{
+	uint32_t inode_n;
+	file_type f_type;
+	char name[DIRENT_LONG_NAME_MAX + 1];
 } dirent_t;
 
 inline std::ostream& operator<<(std::ostream& os, dirent_struct d)
@@ -19,4 +70,11 @@ inline std::ostream& operator<<(std::ostream& os, dirent_struct d)
 
 #define INVALID_DIRENT (dirent_t{INVALID_INODE, file_type::other, ""})
 
+// directory entry paired with the inode it points to (see file_system::readdirplus)
+typedef struct direntplus_struct
+{
+	dirent_t dirent;
+	inode_t inode;
+} direntplus_t;
+
 #endif
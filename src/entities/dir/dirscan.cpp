@@ -0,0 +1,110 @@
+#include "dirscan.h"
+
+#include <cstring>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIRSCAN_X86
+#endif
+
+static_assert(DIRENT_NAME_MAX == 32, "scan kernels compare the name field as one 32-byte vector");
+
+// the target name padded to the on-disk name field, plus the bytes that have to match:
+// the name itself and its terminating null (if there is room for one)
+struct scan_pattern
+{
+	alignas(32) char name[DIRENT_NAME_MAX];
+	std::size_t cmp_len;
+	uint32_t cmp_mask;
+};
+
+typedef std::size_t (*scan_fn)(const fixed_dirent_t*, std::size_t, const scan_pattern&);
+
+static std::size_t scan_scalar(const fixed_dirent_t* entries, const std::size_t count, const scan_pattern& pattern)
+{
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		if (entries[i].inode_n == INVALID_INODE || memcmp(entries[i].name, pattern.name, pattern.cmp_len) == 0)
+			return i;
+	}
+	return count;
+}
+
+#ifdef DIRSCAN_X86
+
+#ifdef __SSE2__
+static std::size_t scan_sse2(const fixed_dirent_t* entries, const std::size_t count, const scan_pattern& pattern)
+{
+	const auto lo = _mm_load_si128(reinterpret_cast<const __m128i *>(pattern.name));
+	const auto hi = _mm_load_si128(reinterpret_cast<const __m128i *>(pattern.name + 16));
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		if (entries[i].inode_n == INVALID_INODE)
+			return i;
+		const auto name = entries[i].name;
+		const auto eq_lo = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(name)), lo);
+		const auto eq_hi = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(name + 16)), hi);
+		const auto eq = static_cast<uint32_t>(_mm_movemask_epi8(eq_lo))
+			| (static_cast<uint32_t>(_mm_movemask_epi8(eq_hi)) << 16);
+		if ((eq & pattern.cmp_mask) == pattern.cmp_mask)
+			return i;
+	}
+	return count;
+}
+#endif
+
+__attribute__((target("avx2")))
+static std::size_t scan_avx2(const fixed_dirent_t* entries, const std::size_t count, const scan_pattern& pattern)
+{
+	const auto target = _mm256_load_si256(reinterpret_cast<const __m256i *>(pattern.name));
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		if (entries[i].inode_n == INVALID_INODE)
+			return i;
+		const auto name = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(entries[i].name));
+		const auto eq = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(name, target)));
+		if ((eq & pattern.cmp_mask) == pattern.cmp_mask)
+			return i;
+	}
+	return count;
+}
+
+#endif
+
+static scan_fn resolve_scan()
+{
+#ifdef DIRSCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return scan_avx2;
+#ifdef __SSE2__
+	return scan_sse2;
+#endif
+#endif
+	return scan_scalar;
+}
+
+static const scan_fn scan_impl = resolve_scan();
+
+std::size_t dirent_scan(const fixed_dirent_t* entries, const std::size_t count, const char* name, const std::size_t name_len)
+{
+	// such a name could never have been stored, only the terminator can be found
+	if (name_len > DIRENT_NAME_MAX)
+	{
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			if (entries[i].inode_n == INVALID_INODE)
+				return i;
+		}
+		return count;
+	}
+
+	scan_pattern pattern;
+	memset(pattern.name, 0, DIRENT_NAME_MAX);
+	memcpy(pattern.name, name, name_len);
+	pattern.cmp_len = name_len < DIRENT_NAME_MAX ? name_len + 1 : DIRENT_NAME_MAX;
+	pattern.cmp_mask = pattern.cmp_len == DIRENT_NAME_MAX ? 0xFFFFFFFFu : (1u << pattern.cmp_len) - 1;
+
+	return scan_impl(entries, count, pattern);
+}
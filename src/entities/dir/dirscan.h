@@ -0,0 +1,19 @@
+#ifndef DIRSCAN_H_GUARD
+#define DIRSCAN_H_GUARD
+
+#include <cstdlib>
+
+#include "dirent.h"
+
+/**
+ * \brief scans a run of directory entries for a name, without copying them
+ * \param entries entries laid out back to back, as stored in the directory file
+ * \param count number of entries in the run
+ * \param name name to look for (not necessarily null terminated)
+ * \param name_len length of name
+ * \return index of the first entry named name or of the terminating entry,
+ *         whichever comes first; count if the run holds neither
+ */
+std::size_t dirent_scan(const fixed_dirent_t* entries, std::size_t count, const char* name, std::size_t name_len);
+
+#endif
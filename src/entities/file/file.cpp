@@ -4,6 +4,21 @@
 #include "../../errors.h"
 
 #include <cstring>
+#include <iterator>
+#include <limits>
+#include <vector>
+
+// sectors taken by size bytes of fragment data
+static uint32_t frag_count(const std::size_t size)
+{
+	return size / SECTOR_SIZE + (size % SECTOR_SIZE != 0);
+}
+
+// directory contents are cached with the metadata
+static block_kind content_kind(const inode_t& inode)
+{
+	return inode.f_type == file_type::dir ? block_kind::dir : block_kind::data;
+}
 
 file::file(const std::string& filename, file_system* fs)
 {
@@ -29,6 +44,9 @@ void file::reopen(const uint32_t inode_n, file_system* file_sys)
 {
 	fs_ = file_sys;
 	curr_pos_ = 0;
+	ra_pos_ = 0;
+	ra_window_ = 0;
+	ra_end_ = 0;
 	inode_n_ = inode_n;
 	fs_->read_inode(inode_n, &inode_);
 }
@@ -38,27 +56,103 @@ int file::get_inode(inode_t* inode_out) const
 	return fs_->read_inode(inode_n_, inode_out);
 }
 
+std::size_t file::get_block_bytes() const
+{
+	return fs_->super_block_.block_size * SECTOR_SIZE;
+}
+
 int file::read(char* buffer, std::size_t size)
+{
+	const auto ret = pread(buffer, size, curr_pos_);
+
+	if (ret < 0)
+		return ret;
+
+	if (hint_ == access_hint::noreuse && size != 0)
+	{
+		uint32_t first, last;
+		block_range(curr_pos_, size, &first, &last);
+		for_each_run(first, last, [this](const uint32_t start, const uint32_t count)
+		{
+			fs_->demote_data_block(start, count, content_kind(inode_));
+			return 0;
+		});
+	}
+	readahead(curr_pos_, size);
+	return curr_pos_ += size;
+}
+
+int file::pread(char* buffer, std::size_t size, const std::size_t pos)
 {
 	const auto block_size_bytes = fs_->super_block_.block_size * SECTOR_SIZE;
-	const auto curr_block = curr_pos_ / block_size_bytes;
-	const auto curr_block_offset = curr_pos_ % block_size_bytes;
 
-	const auto ret = read_unaligned(curr_block, curr_block_offset, size, buffer);
+	const auto ret = read_unaligned(pos / block_size_bytes, pos % block_size_bytes, size, buffer);
 
 	if (ret < 0)
 		return ret;
 
-	return curr_pos_ += size;
+	return size;
+}
+
+/**
+ * \brief reads up to size bytes, stopping at the first unallocated block
+ * \return number of bytes read, or error code if nothing could be read
+ */
+int file::read_partial(char* buffer, std::size_t size)
+{
+	const auto block_size_bytes = get_block_bytes();
+	std::size_t done = 0;
+
+	const auto ret = fs_->read_inode(inode_n_, &inode_);
+	if (ret < 0)
+		return ret;
+	if (inode_.flags & (INODE_FLAG_INLINE | INODE_FLAG_FRAGMENT))
+	{
+		if (curr_pos_ >= inode_.data_size)
+			return EFIL_INVALID_SECTOR;
+		if (size > inode_.data_size - curr_pos_)
+			size = inode_.data_size - curr_pos_;
+	}
+
+	while (done < size)
+	{
+		const auto offset = curr_pos_ % block_size_bytes;
+		const auto chunk = (size - done < block_size_bytes - offset) ? size - done : block_size_bytes - offset;
+
+		const auto ret = read_unaligned(curr_pos_ / block_size_bytes, offset, chunk, buffer + done);
+		if (ret < 0)
+		{
+			if (done == 0)
+				return ret;
+			break;
+		}
+		done += chunk;
+		curr_pos_ += chunk;
+	}
+	return done;
 }
 
 int file::write(const char* buffer, std::size_t size)
+{
+	const auto ret = inode_.f_type == file_type::regular && size <= WRITE_BUFFER_MAX
+		                 ? buffer_write(buffer, size, curr_pos_)
+		                 : pwrite(buffer, size, curr_pos_);
+
+	if (ret < 0)
+		return ret;
+
+	return (curr_pos_ += size);
+}
+
+int file::pwrite(const char* buffer, std::size_t size, const std::size_t pos)
 {
 	const auto block_size_bytes = fs_->super_block_.block_size * SECTOR_SIZE;
-	const auto curr_block = curr_pos_ / block_size_bytes;
-	const auto curr_block_offset = curr_pos_ % block_size_bytes;
 
-	const auto ret = write_unaligned(curr_block, curr_block_offset, size, buffer);
+	auto ret = flush_overlap(pos, size);
+	if (ret < 0)
+		return ret;
+
+	ret = write_unaligned(pos / block_size_bytes, pos % block_size_bytes, size, buffer);
 
 	if (ret < 0)
 		return ret;
@@ -67,7 +161,184 @@ int file::write(const char* buffer, std::size_t size)
 	inode_.modify_time = time(nullptr);
 	fs_->write_inode(inode_n_, &inode_);
 
-	return (curr_pos_ += size);
+	return size;
+}
+
+int file::buffer_write(const char* buffer, const std::size_t size, const std::size_t pos)
+{
+	const auto block_size_bytes = get_block_bytes();
+	auto& buf = fs_->get_buffer(inode_n_);
+	auto& blocks = buf.blocks;
+	std::size_t done = 0;
+
+	while (done < size)
+	{
+		const uint32_t index = (pos + done) / block_size_bytes;
+		const auto offset = (pos + done) % block_size_bytes;
+		const auto copy_size = (size - done < block_size_bytes - offset) ? size - done : block_size_bytes - offset;
+
+		auto it = blocks.find(index);
+		// one dirty range per block, a write that leaves a gap pushes the old one out first
+		if (it != blocks.end() && (offset > it->second.hi || offset + copy_size < it->second.lo))
+		{
+			const auto ret = flush_block(buf, it);
+			if (ret < 0)
+				return ret;
+			it = blocks.end();
+		}
+		if (it == blocks.end())
+		{
+			it = blocks.emplace(index, dirty_block_t{std::vector<char>(block_size_bytes), offset, offset}).first;
+			fs_->dirty_bytes_ += block_size_bytes;
+		}
+
+		auto& dirty = it->second;
+		memcpy(dirty.data.data() + offset, buffer + done, copy_size);
+		buf.time_dirty = true;
+		if (offset < dirty.lo)
+			dirty.lo = offset;
+		if (offset + copy_size > dirty.hi)
+			dirty.hi = offset + copy_size;
+		done += copy_size;
+	}
+
+	if (blocks.size() * block_size_bytes <= WRITE_BUFFER_MAX)
+		return 0;
+	// complete blocks first, so that an append keeps its partial tail
+	for (auto it = blocks.begin(); it != blocks.end();)
+	{
+		const auto next = std::next(it);
+		if (it->second.lo == 0 && it->second.hi == block_size_bytes)
+		{
+			const auto ret = flush_block(buf, it);
+			if (ret < 0)
+				return ret;
+		}
+		it = next;
+	}
+	if (blocks.size() * block_size_bytes <= WRITE_BUFFER_MAX)
+		return 0;
+	return flush();
+}
+
+int file::flush_block(write_buffer_t& buf, const std::map<uint32_t, dirty_block_t>::iterator it)
+{
+	const auto& dirty = it->second;
+	const auto ret = write_unaligned(it->first, dirty.lo, dirty.hi - dirty.lo, dirty.data.data() + dirty.lo);
+	if (ret < 0)
+		return ret;
+	fs_->dirty_bytes_ -= dirty.data.size();
+	buf.blocks.erase(it);
+	return 0;
+}
+
+int file::flush_overlap(const std::size_t pos, const std::size_t size)
+{
+	const auto buf = fs_->find_buffer(inode_n_);
+	if (buf == nullptr || size == 0)
+		return 0;
+
+	uint32_t first_block, last_block;
+	block_range(pos, size, &first_block, &last_block);
+	for (auto it = buf->blocks.lower_bound(first_block); it != buf->blocks.end() && it->first < last_block;)
+	{
+		const auto next = std::next(it);
+		const auto ret = flush_block(*buf, it);
+		if (ret < 0)
+			return ret;
+		it = next;
+	}
+	return 0;
+}
+
+void file::drop_buffered(const std::size_t pos)
+{
+	const auto buf = fs_->find_buffer(inode_n_);
+	if (buf == nullptr)
+		return;
+
+	const auto block_size_bytes = get_block_bytes();
+	for (auto it = buf->blocks.lower_bound(pos / block_size_bytes); it != buf->blocks.end();)
+	{
+		auto& dirty = it->second;
+		const std::size_t start = static_cast<std::size_t>(it->first) * block_size_bytes;
+		if (pos > start && pos - start < dirty.hi)
+			dirty.hi = pos - start;
+		if (pos > start && dirty.lo < dirty.hi)
+		{
+			++it;
+			continue;
+		}
+		fs_->dirty_bytes_ -= dirty.data.size();
+		it = buf->blocks.erase(it);
+	}
+}
+
+int file::flush(const bool data_only)
+{
+	const auto buf = fs_->find_buffer(inode_n_);
+	if (buf == nullptr)
+		return 0;
+
+	while (!buf->blocks.empty())
+	{
+		const auto ret = flush_block(*buf, buf->blocks.begin());
+		if (ret < 0)
+			return ret;
+	}
+	if (data_only && buf->time_dirty)
+		return 0;
+
+	const auto time_dirty = buf->time_dirty;
+	fs_->drop_buffer(inode_n_);
+	if (!time_dirty)
+		return 0;
+
+	auto ret = fs_->read_inode(inode_n_, &inode_);
+	if (ret < 0)
+		return ret;
+	inode_.modify_time = time(nullptr);
+	ret = fs_->write_inode(inode_n_, &inode_);
+	return ret < 0 ? ret : 0;
+}
+
+int file::readv(const io_vec_t* vec, const std::size_t count)
+{
+	if (count == 1)
+		return read(static_cast<char *>(vec[0].base), vec[0].length);
+
+	std::size_t size = 0;
+	for (std::size_t i = 0; i < count; ++i)
+		size += vec[i].length;
+
+	// one read of the whole range, then scattered from here
+	std::vector<char> buffer(size);
+	const auto ret = read(buffer.data(), size);
+	if (ret < 0)
+		return ret;
+
+	std::size_t done = 0;
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		memcpy(vec[i].base, buffer.data() + done, vec[i].length);
+		done += vec[i].length;
+	}
+	return ret;
+}
+
+int file::writev(const io_vec_t* vec, const std::size_t count)
+{
+	if (count == 1)
+		return write(static_cast<const char *>(vec[0].base), vec[0].length);
+
+	// gathered first, so that whole blocks are written as such and the inode once
+	std::vector<char> buffer;
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		const auto base = static_cast<const char *>(vec[i].base);
+		buffer.insert(buffer.end(), base, base + vec[i].length);
+	}
+	return write(buffer.data(), buffer.size());
 }
 
 int file::trunc(std::size_t new_size)
@@ -75,21 +346,56 @@ int file::trunc(std::size_t new_size)
 	// TODO: ASSERT MACRO CHECK 
 
 	const auto block_size_bytes = fs_->super_block_.block_size * SECTOR_SIZE;
+
+	// buffered bytes past the new end would grow the file back once flushed
+	drop_buffered(new_size);
+	fs_->read_inode(inode_n_, &inode_);
+	if (inode_.flags & INODE_FLAG_INLINE)
+	{
+		if (new_size < inode_.data_size)
+		{
+			memset(inode_.inline_data + new_size, 0, inode_.data_size - new_size);
+			inode_.data_size = new_size;
+		}
+		inode_.modify_time = time(nullptr);
+		fs_->write_inode(inode_n_, &inode_);
+		if (curr_pos_ >= new_size)
+			curr_pos_ = 0;
+		return 0;
+	}
+	if (inode_.flags & INODE_FLAG_FRAGMENT)
+	{
+		if (new_size < inode_.data_size)
+		{
+			const auto keep = frag_count(new_size);
+			release_fragments(inode_.fragment + keep, frag_count(inode_.data_size) - keep);
+			inode_.data_size = new_size;
+			if (new_size == 0)
+				inode_.fragment = 0;
+		}
+		inode_.modify_time = time(nullptr);
+		fs_->write_inode(inode_n_, &inode_);
+		if (curr_pos_ >= new_size)
+			curr_pos_ = 0;
+		return 0;
+	}
+
 	const auto free_blocks = new_size / block_size_bytes + (new_size % block_size_bytes != 0);
 
 	for (auto i = free_blocks; i < INODE_BLOCKS_MAX; ++i)
 	{
 		if (inode_.blocks[i] != 0)
 		{
-			fs_->set_block_status(inode_.blocks[i], false);
+			release_block(inode_.blocks[i]);
 			inode_.blocks[i] = 0;
 		}
 	}
 	uint32_t i;
 	if (inode_.indirect_block != 0)
 	{
-		uint32_t* buffer = reinterpret_cast<uint32_t *>(fs_->data_buffer_);
-		fs_->read_data_block(inode_.indirect_block, fs_->data_buffer_, 1);
+		scratch_block block(fs_->scratch_);
+		uint32_t* buffer = block.words();
+		fs_->read_data_block(inode_.indirect_block, block.data(), 1, block_kind::indirect);
 
 		if (free_blocks < INODE_BLOCKS_MAX)
 			i = 0;
@@ -100,23 +406,25 @@ int file::trunc(std::size_t new_size)
 		{
 			if (buffer[i] != 0)
 			{
-				fs_->set_block_status(buffer[i], false);
+				release_block(buffer[i]);
 				buffer[i] = 0;
 			}
 		}
-		fs_->write_data_block(inode_.indirect_block, fs_->data_buffer_, 1);
+		fs_->write_data_block(inode_.indirect_block, block.data(), 1, block_kind::indirect);
 		if (free_blocks <= INODE_BLOCKS_MAX)
 		{
-			fs_->set_block_status(inode_.indirect_block, false);
+			release_block(inode_.indirect_block);
 			inode_.indirect_block = 0;
 		}
 	}
 	if (inode_.double_indirect_block != 0)
 	{
-		uint32_t* buffer = reinterpret_cast<uint32_t *>(fs_->data_buffer_);
-		uint32_t* second_buffer = new uint32_t[block_size_bytes / sizeof(uint32_t)];
+		scratch_block block(fs_->scratch_);
+		scratch_block second_block(fs_->scratch_);
+		uint32_t* buffer = block.words();
+		uint32_t* second_buffer = second_block.words();
 
-		fs_->read_data_block(inode_.double_indirect_block, fs_->data_buffer_, 1);
+		fs_->read_data_block(inode_.double_indirect_block, block.data(), 1, block_kind::indirect);
 
 		if (free_blocks < INODE_BLOCKS_MAX + (block_size_bytes / sizeof(uint32_t)))
 			i = 0;
@@ -124,35 +432,48 @@ int file::trunc(std::size_t new_size)
 			i = (free_blocks - INODE_BLOCKS_MAX - (block_size_bytes / sizeof(uint32_t))) / (block_size_bytes / sizeof(uint32_t));
 
 		uint32_t j;
-		if (i == 0)
+		if (free_blocks < INODE_BLOCKS_MAX + (block_size_bytes / sizeof(uint32_t)))
 			j = 0;
 		else
 			j = (free_blocks - INODE_BLOCKS_MAX - (block_size_bytes / sizeof(uint32_t))) % (block_size_bytes / sizeof(uint32_t));
 
-		for (; i < block_size_bytes / sizeof(uint32_t); ++i)
+		// the first indirect block may keep its head, and the double one the indirect blocks before it
+		for (; i < block_size_bytes / sizeof(uint32_t); ++i, j = 0)
 		{
 			if (buffer[i] != 0)
 			{
-				fs_->read_data_block(buffer[i], reinterpret_cast<char *>(second_buffer), 1);
+				fs_->read_data_block(buffer[i], second_block.data(), 1, block_kind::indirect);
+				const auto keep = j;
 				for (; j < block_size_bytes / sizeof(uint32_t); ++j)
 				{
 					if (second_buffer[j] != 0)
 					{
-						fs_->set_block_status(second_buffer[j], false);
+						release_block(second_buffer[j]);
 						second_buffer[j] = 0;
 					}
 				}
-				fs_->write_data_block(buffer[i], reinterpret_cast<char *>(second_buffer), 1);
+				fs_->write_data_block(buffer[i], second_block.data(), 1, block_kind::indirect);
 
-				fs_->set_block_status(buffer[i], false);
-				buffer[i] = 0;
-				j = 0;
+				if (keep == 0)
+				{
+					release_block(buffer[i]);
+					buffer[i] = 0;
+				}
 			}
 		}
+		fs_->write_data_block(inode_.double_indirect_block, block.data(), 1, block_kind::indirect);
 
-		fs_->set_block_status(inode_.double_indirect_block, false);
-		inode_.double_indirect_block = 0;
-		delete[] second_buffer;
+		if (free_blocks <= INODE_BLOCKS_MAX + (block_size_bytes / sizeof(uint32_t)))
+		{
+			release_block(inode_.double_indirect_block);
+			inode_.double_indirect_block = 0;
+		}
+	}
+	// an emptied file starts over inline or in fragments
+	if (new_size == 0)
+	{
+		inode_.flags |= fs_->get_small_data_flag(inode_.f_type);
+		inode_.data_size = 0;
 	}
 	fs_->write_inode(inode_n_, &inode_);
 	if (curr_pos_ >= new_size)
@@ -170,6 +491,189 @@ int file::seek(const std::size_t pos)
 	return curr_pos_ = pos;
 }
 
+void file::readahead(const std::size_t pos, const std::size_t size)
+{
+	const auto block_size_bytes = get_block_bytes();
+
+	if (pos != ra_pos_ && hint_ != access_hint::sequential)
+	{
+		ra_window_ = 0;
+		ra_end_ = 0;
+	}
+	ra_pos_ = pos + size;
+	if (size == 0 || hint_ == access_hint::random || (inode_.flags & (INODE_FLAG_INLINE | INODE_FLAG_FRAGMENT)))
+		return;
+
+	const uint32_t next = (pos + size - 1) / block_size_bytes + 1;
+	// prefetch again once the reader is halfway into the last window
+	if (next + ra_window_ / 2 < ra_end_)
+		return;
+
+	auto window = ra_window_ ? ra_window_ * 2 : READAHEAD_MIN;
+	if (window > READAHEAD_MAX || hint_ == access_hint::sequential)
+		window = READAHEAD_MAX;
+	// leave room in the cache for what is being read now
+	const auto capacity = fs_->cache_of(content_kind(inode_)).get_capacity();
+	if (window > capacity / 2)
+		window = capacity / 2;
+	ra_window_ = window;
+	if (window == 0)
+		return;
+
+	prefetch(ra_end_ > next ? ra_end_ : next, next + window);
+	ra_end_ = next + window;
+}
+
+void file::prefetch(const uint32_t first_block, const uint32_t last_block)
+{
+	for_each_run(first_block, last_block, [this](const uint32_t start, const uint32_t count)
+	{
+		return fs_->prefetch_data_block(start, count, content_kind(inode_));
+	});
+}
+
+int file::for_each_run(const uint32_t first_block, const uint32_t last_block,
+                       const std::function<int(uint32_t, uint32_t)>& fn)
+{
+	uint32_t run_start = 0;
+	uint32_t run_length = 0;
+	int ret;
+
+	for (auto i = first_block; i < last_block; ++i)
+	{
+		uint32_t block;
+		if (get_sector(i, &block) < 0 || block == 0)
+			break;
+		if (run_length != 0 && block == run_start + run_length)
+		{
+			++run_length;
+			continue;
+		}
+		if (run_length != 0 && (ret = fn(run_start, run_length)) < 0)
+			return ret;
+		run_start = block;
+		run_length = 1;
+	}
+	if (run_length != 0 && (ret = fn(run_start, run_length)) < 0)
+		return ret;
+	return 0;
+}
+
+void file::block_range(const std::size_t pos, const std::size_t length, uint32_t* first_block_out,
+                       uint32_t* last_block_out) const
+{
+	const auto block_size_bytes = get_block_bytes();
+	*first_block_out = pos / block_size_bytes;
+	*last_block_out = length ? (pos + length - 1) / block_size_bytes + 1 : std::numeric_limits<uint32_t>::max();
+}
+
+int file::advise(const std::size_t pos, const std::size_t length, const access_hint hint)
+{
+	uint32_t first, last;
+	block_range(pos, length, &first, &last);
+
+	const auto ret = fs_->read_inode(inode_n_, &inode_);
+	if (ret < 0)
+		return ret;
+	// small files live in the inode or in fragments, which are cached along with their block
+	const auto has_blocks = !(inode_.flags & (INODE_FLAG_INLINE | INODE_FLAG_FRAGMENT));
+
+	switch (hint)
+	{
+	case access_hint::willneed:
+		if (has_blocks)
+			prefetch(first, last);
+		return 0;
+	case access_hint::dontneed:
+		if (!has_blocks)
+			return 0;
+		return for_each_run(first, last, [this](const uint32_t start, const uint32_t count)
+		{
+			fs_->drop_data_block(start, count, content_kind(inode_));
+			return 0;
+		});
+	default:
+		hint_ = hint;
+		ra_window_ = 0;
+		ra_end_ = 0;
+		return 0;
+	}
+}
+
+int file::pin(const std::size_t pos, const std::size_t length)
+{
+	uint32_t first, last;
+	block_range(pos, length, &first, &last);
+
+	const auto inode_ret = fs_->read_inode(inode_n_, &inode_);
+	if (inode_ret < 0)
+		return inode_ret;
+	if (inode_.flags & (INODE_FLAG_INLINE | INODE_FLAG_FRAGMENT))
+		return 0;
+
+	// runs pinned so far are released again if the cache runs out of room
+	std::vector<std::pair<uint32_t, uint32_t>> pinned;
+	const auto ret = for_each_run(first, last, [&](const uint32_t start, const uint32_t count)
+	{
+		const auto pin_ret = fs_->pin_data_block(start, count, content_kind(inode_));
+		if (pin_ret >= 0)
+			pinned.emplace_back(start, count);
+		return pin_ret;
+	});
+	if (ret < 0)
+	{
+		for (const auto& run : pinned)
+			fs_->unpin_data_block(run.first, run.second, content_kind(inode_));
+		return ret;
+	}
+	for (const auto& run : pinned)
+		for (uint32_t i = 0; i < run.second; ++i)
+			++pins_[run.first + i];
+	return 0;
+}
+
+int file::unpin(const std::size_t pos, const std::size_t length)
+{
+	uint32_t first, last;
+	block_range(pos, length, &first, &last);
+
+	const auto ret = fs_->read_inode(inode_n_, &inode_);
+	if (ret < 0)
+		return ret;
+	release_pins(first, last, false);
+	return 0;
+}
+
+void file::unpin_all()
+{
+	if (pins_.empty() || fs_->read_inode(inode_n_, &inode_) < 0)
+	{
+		pins_.clear();
+		return;
+	}
+	release_pins(0, std::numeric_limits<uint32_t>::max(), true);
+	pins_.clear();
+}
+
+void file::release_pins(const uint32_t first_block, const uint32_t last_block, const bool all)
+{
+	if (pins_.empty() || (inode_.flags & (INODE_FLAG_INLINE | INODE_FLAG_FRAGMENT)))
+		return;
+
+	for_each_run(first_block, last_block, [&](const uint32_t start, const uint32_t count)
+	{
+		for (auto it = pins_.lower_bound(start); it != pins_.end() && it->first < start + count;)
+		{
+			const auto times = all ? it->second : 1;
+			for (uint32_t i = 0; i < times; ++i)
+				fs_->unpin_data_block(it->first, 1, content_kind(inode_));
+			it->second -= times;
+			it = it->second == 0 ? pins_.erase(it) : std::next(it);
+		}
+		return 0;
+	});
+}
+
 int file::read_unaligned(const uint32_t start_block, std::size_t offset, const std::size_t obj_size, void* buffer)
 {
 	const auto block_size_bytes = fs_->super_block_.block_size * SECTOR_SIZE;
@@ -177,6 +681,28 @@ int file::read_unaligned(const uint32_t start_block, std::size_t offset, const s
 	uint32_t i = start_block;
 	uint32_t curr_block;
 
+	const auto inode_ret = fs_->read_inode(inode_n_, &inode_);
+	if (inode_ret < 0)
+		return inode_ret;
+	if (inode_.flags & INODE_FLAG_INLINE)
+	{
+		const auto pos = start_block * block_size_bytes + offset;
+		if (pos + obj_size > inode_.data_size)
+			return EFIL_INVALID_SECTOR;
+		memcpy(buffer, inode_.inline_data + pos, obj_size);
+		return obj_size;
+	}
+	if (inode_.flags & INODE_FLAG_FRAGMENT)
+	{
+		const auto pos = start_block * block_size_bytes + offset;
+		if (pos + obj_size > inode_.data_size)
+			return EFIL_INVALID_SECTOR;
+		const auto frags = fs_->super_block_.block_size;
+		const auto ret = fs_->read_data_object(inode_.fragment / frags, (inode_.fragment % frags) * SECTOR_SIZE + pos,
+		                                       obj_size, buffer, content_kind(inode_));
+		return ret < 0 ? ret : obj_size;
+	}
+
 	while (obj_pos < obj_size)
 	{
 		auto ret = get_sector(i, &curr_block);
@@ -185,14 +711,14 @@ int file::read_unaligned(const uint32_t start_block, std::size_t offset, const s
 		if (curr_block == 0)
 			return EFIL_INVALID_SECTOR;
 
-		ret = fs_->read_data_block(curr_block, fs_->data_buffer_, 1);
-		if (ret < 0)
-			return ret;
-
 		const auto copy_size = ((obj_size - obj_pos < block_size_bytes - offset)
 			                        ? obj_size - obj_pos
 			                        : block_size_bytes - offset);
-		memcpy(reinterpret_cast<char *>(buffer) + obj_pos, fs_->data_buffer_ + offset, copy_size);
+		ret = fs_->read_data_object(curr_block, offset, copy_size, reinterpret_cast<char *>(buffer) + obj_pos,
+		                            content_kind(inode_));
+		if (ret < 0)
+			return ret;
+
 		obj_pos += copy_size;
 		offset = 0;
 		++i;
@@ -208,6 +734,37 @@ int file::write_unaligned(const uint32_t start_block, std::size_t offset, const
 	uint32_t i = start_block;
 	uint32_t curr_block;
 
+	auto inode_ret = fs_->read_inode(inode_n_, &inode_);
+	if (inode_ret < 0)
+		return inode_ret;
+	if (inode_.flags & INODE_FLAG_INLINE)
+	{
+		const auto pos = start_block * block_size_bytes + offset;
+		if (pos + obj_size <= INODE_INLINE_MAX)
+		{
+			memcpy(inode_.inline_data + pos, buffer, obj_size);
+			if (pos + obj_size > inode_.data_size)
+				inode_.data_size = pos + obj_size;
+			inode_ret = fs_->write_inode(inode_n_, &inode_);
+			return inode_ret < 0 ? inode_ret : 0;
+		}
+		inode_ret = spill_small_data();
+		if (inode_ret < 0)
+			return inode_ret;
+		return write_unaligned(start_block, offset, obj_size, buffer);
+	}
+	if (inode_.flags & INODE_FLAG_FRAGMENT)
+	{
+		const auto pos = start_block * block_size_bytes + offset;
+		// a tail that would fill the whole block gets a block of its own
+		if (pos + obj_size <= block_size_bytes - SECTOR_SIZE)
+			return write_fragment(pos, obj_size, buffer);
+		inode_ret = spill_small_data();
+		if (inode_ret < 0)
+			return inode_ret;
+		return write_unaligned(start_block, offset, obj_size, buffer);
+	}
+
 	while (obj_pos < obj_size)
 	{
 		auto ret = get_sector(i, &curr_block, true);
@@ -222,7 +779,8 @@ int file::write_unaligned(const uint32_t start_block, std::size_t offset, const
 
 		if (copy_size == block_size_bytes)
 		{
-			ret = fs_->write_data_block(curr_block, reinterpret_cast<const char *>(buffer) + obj_pos, 1);
+			ret = fs_->write_data_block(curr_block, reinterpret_cast<const char *>(buffer) + obj_pos, 1,
+			                            content_kind(inode_));
 
 			if (ret < 0)
 				return ret;
@@ -232,12 +790,10 @@ int file::write_unaligned(const uint32_t start_block, std::size_t offset, const
 			continue;
 		}
 
-		ret = fs_->read_data_block(curr_block, fs_->data_buffer_, 1);
+		ret = fs_->write_data_object(curr_block, offset, copy_size, reinterpret_cast<const char *>(buffer) + obj_pos,
+		                             content_kind(inode_));
 		if (ret < 0)
 			return ret;
-
-		memcpy(fs_->data_buffer_ + offset, reinterpret_cast<const char *>(buffer) + obj_pos, copy_size);
-		fs_->write_data_block(curr_block, fs_->data_buffer_, 1);
 		obj_pos += copy_size;
 		offset = 0;
 		++i;
@@ -245,6 +801,91 @@ int file::write_unaligned(const uint32_t start_block, std::size_t offset, const
 	return 0;
 }
 
+int file::write_fragment(const std::size_t pos, const std::size_t obj_size, const void* buffer)
+{
+	const auto frags = fs_->super_block_.block_size;
+	const auto old_size = inode_.data_size;
+	const auto new_size = (pos + obj_size > old_size) ? pos + obj_size : old_size;
+	const auto have = frag_count(old_size);
+	const auto need = frag_count(new_size);
+	int ret;
+
+	if (need > have && (have == 0 || !fs_->extend_fragments(inode_.fragment, have, need)))
+	{
+		// no room after the run, move it somewhere that fits
+		const auto first = fs_->get_free_fragments(need, inode_n_);
+		if (first == INVALID_FRAGMENT)
+			return ED_OUT_OF_BLOCKS;
+		if (old_size != 0)
+		{
+			scratch_block content(fs_->scratch_);
+			ret = fs_->read_data_object(inode_.fragment / frags, (inode_.fragment % frags) * SECTOR_SIZE, old_size,
+			                            content.data(), content_kind(inode_));
+			if (ret < 0)
+				return ret;
+			ret = fs_->write_data_object(first / frags, (first % frags) * SECTOR_SIZE, old_size, content.data(),
+			                             content_kind(inode_));
+			if (ret < 0)
+				return ret;
+			release_fragments(inode_.fragment, have);
+		}
+		inode_.fragment = first;
+	}
+	if (need > have)
+		fs_->touch_fragments(inode_n_, inode_.fragment, need);
+
+	const auto base = (inode_.fragment % frags) * SECTOR_SIZE;
+	// freed fragments keep their old bytes, so zero any hole
+	if (pos > old_size)
+	{
+		scratch_block zeros(fs_->scratch_);
+		memset(zeros.data(), 0, pos - old_size);
+		ret = fs_->write_data_object(inode_.fragment / frags, base + old_size, pos - old_size, zeros.data(),
+		                             content_kind(inode_));
+		if (ret < 0)
+			return ret;
+	}
+	ret = fs_->write_data_object(inode_.fragment / frags, base + pos, obj_size, buffer, content_kind(inode_));
+	if (ret < 0)
+		return ret;
+
+	inode_.data_size = new_size;
+	ret = fs_->write_inode(inode_n_, &inode_);
+	return ret < 0 ? ret : 0;
+}
+
+int file::spill_small_data()
+{
+	const auto size = inode_.data_size;
+	// small data never fills a whole block
+	scratch_block content(fs_->scratch_);
+	if (size != 0)
+	{
+		const auto ret = read_unaligned(0, 0, size, content.data());
+		if (ret < 0)
+			return ret;
+	}
+
+	// inline content may still fit in fragments, fragments go to blocks
+	uint8_t flags = 0;
+	if (inode_.flags & INODE_FLAG_FRAGMENT)
+		release_fragments(inode_.fragment, frag_count(size));
+	else if (fs_->has_feature(SB_FEAT_FRAGMENTS) && inode_.f_type == file_type::regular)
+		flags = INODE_FLAG_FRAGMENT;
+
+	inode_.flags = (inode_.flags & ~(INODE_FLAG_INLINE | INODE_FLAG_FRAGMENT)) | flags;
+	inode_.data_size = 0;
+	inode_.fragment = 0;
+	memset(inode_.inline_data, 0, INODE_INLINE_MAX);
+	const auto ret = fs_->write_inode(inode_n_, &inode_);
+	if (ret < 0)
+		return ret;
+
+	if (size == 0)
+		return 0;
+	return write_unaligned(0, 0, size, content.data());
+}
+
 int file::get_sector(const uint32_t i, uint32_t* sector_out, const bool do_allocate)
 {
 	int ret;
@@ -270,27 +911,28 @@ int file::get_sector(const uint32_t i, uint32_t* sector_out, const bool do_alloc
 		if (inode_.indirect_block == 0)
 			return EFIL_INVALID_SECTOR;
 		ret = fs_->read_data_object(inode_.indirect_block, (i - INODE_BLOCKS_MAX) * sizeof(uint32_t), sizeof(uint32_t),
-		                            sector_out);
+		                            sector_out, block_kind::indirect);
 		return ret;
 	}
 		// double indirect
 	else if (i < INODE_BLOCKS_MAX + indirect_max + double_indirect_max)
 	{
-		const auto index_level_1 = (i - INODE_BLOCKS_MAX - indirect_max) / block_size_bytes;
-		const auto index_level_2 = (i - INODE_BLOCKS_MAX - indirect_max) % block_size_bytes;
+		const auto index_level_1 = (i - INODE_BLOCKS_MAX - indirect_max) / indirect_max;
+		const auto index_level_2 = (i - INODE_BLOCKS_MAX - indirect_max) % indirect_max;
 		uint32_t pointer;
 
 		if (inode_.double_indirect_block == 0)
 			return EFIL_INVALID_SECTOR;
 
 		ret = fs_->read_data_object(inode_.double_indirect_block, index_level_1 * sizeof(uint32_t), sizeof(uint32_t),
-		                            &pointer);
+		                            &pointer, block_kind::indirect);
 		if (ret < 0)
 			return ret;
 		if (pointer == 0)
 			return EFIL_INVALID_SECTOR;
 
-		ret = fs_->read_data_object(pointer, index_level_2 * sizeof(uint32_t), sizeof(uint32_t), sector_out);
+		ret = fs_->read_data_object(pointer, index_level_2 * sizeof(uint32_t), sizeof(uint32_t), sector_out,
+		                            block_kind::indirect);
 		return ret;
 	}
 		// out of bounds for sure
@@ -299,6 +941,29 @@ int file::get_sector(const uint32_t i, uint32_t* sector_out, const bool do_alloc
 	return 0;
 }
 
+uint32_t file::claim_block()
+{
+	const auto block = fs_->alloc_block(inode_n_);
+	if (block != INVALID_BLOCK)
+		fs_->touch_block(inode_n_, block);
+	return block;
+}
+
+void file::release_block(const uint32_t block)
+{
+	fs_->touch_block(inode_n_, block);
+	fs_->set_block_status(block, false);
+	// pins included, whoever gets the block next starts clean
+	fs_->forget_data_block(block);
+	pins_.erase(block);
+}
+
+void file::release_fragments(const uint32_t first, const uint32_t count)
+{
+	fs_->touch_fragments(inode_n_, first, count);
+	fs_->free_fragments(first, count);
+}
+
 int file::allocate_block(const uint32_t block_index)
 {
 	int ret;
@@ -314,11 +979,10 @@ int file::allocate_block(const uint32_t block_index)
 	{
 		if (inode_.blocks[block_index] == 0)
 		{
-			free_block = fs_->get_free_block();
+			free_block = claim_block();
 			if (free_block == INVALID_BLOCK)
 				return ED_OUT_OF_BLOCKS;
 
-			fs_->set_block_status(free_block, true);
 			inode_.blocks[block_index] = free_block;
 			fs_->write_inode(inode_n_, &inode_);
 			return 0;
@@ -329,40 +993,38 @@ int file::allocate_block(const uint32_t block_index)
 	{
 		if (inode_.indirect_block == 0)
 		{
-			free_block = fs_->get_free_block();
+			free_block = claim_block();
 			if (free_block == INVALID_BLOCK)
 				return ED_OUT_OF_BLOCKS;
 
-			fs_->set_block_status(free_block, true);
 			inode_.indirect_block = free_block;
 			ret = fs_->write_inode(inode_n_, &inode_);
 			if (ret < 0)
 				return ret;
 
 			// set mem to 0
-			ret = fs_->read_data_block(inode_.indirect_block, fs_->data_buffer_, 1);
-			if (ret < 0)
-				return ret;
-			memset(fs_->data_buffer_, 0, block_size_bytes);
-			ret = fs_->write_data_block(inode_.indirect_block, fs_->data_buffer_, 1);
+			{
+				scratch_block zeros(fs_->scratch_);
+				memset(zeros.data(), 0, block_size_bytes);
+				ret = fs_->write_data_block(inode_.indirect_block, zeros.data(), 1, block_kind::indirect);
+			}
 			if (ret < 0)
 				return ret;
 		}
 		ret = fs_->read_data_object(inode_.indirect_block, (block_index - INODE_BLOCKS_MAX) * sizeof(uint32_t),
-		                            sizeof(uint32_t), &temp);
+		                            sizeof(uint32_t), &temp, block_kind::indirect);
 		if (ret < 0)
 			return ret;
 
 		if (temp == 0)
 		{
-			free_block = fs_->get_free_block();
+			free_block = claim_block();
 			if (free_block == INVALID_BLOCK)
 				return ED_OUT_OF_BLOCKS;
 
-			fs_->set_block_status(free_block, true);
 
 			ret = fs_->write_data_object(inode_.indirect_block, (block_index - INODE_BLOCKS_MAX) * sizeof(uint32_t),
-			                             sizeof(uint32_t), &free_block);
+			                             sizeof(uint32_t), &free_block, block_kind::indirect);
 			if (ret < 0)
 				return ret;
 
@@ -376,75 +1038,70 @@ int file::allocate_block(const uint32_t block_index)
 		// double indirect
 	else if (block_index < INODE_BLOCKS_MAX + indirect_max + double_indirect_max)
 	{
-		const auto index_level_1 = (block_index - INODE_BLOCKS_MAX - indirect_max) / block_size_bytes;
-		const auto index_level_2 = (block_index - INODE_BLOCKS_MAX - indirect_max) % block_size_bytes;
+		const auto index_level_1 = (block_index - INODE_BLOCKS_MAX - indirect_max) / indirect_max;
+		const auto index_level_2 = (block_index - INODE_BLOCKS_MAX - indirect_max) % indirect_max;
 		uint32_t pointer;
 
 		if (inode_.double_indirect_block == 0)
 		{
-			free_block = fs_->get_free_block();
+			free_block = claim_block();
 			if (free_block == INVALID_BLOCK)
 				return ED_OUT_OF_BLOCKS;
 
-			fs_->set_block_status(free_block, true);
 			inode_.double_indirect_block = free_block;
 			ret = fs_->write_inode(inode_n_, &inode_);
 			if (ret < 0)
 				return ret;
 
 			// set mem to 0
-			ret = fs_->read_data_block(inode_.double_indirect_block, fs_->data_buffer_, 1);
-			if (ret < 0)
-				return ret;
-
-			memset(fs_->data_buffer_, 0, block_size_bytes);
-
-			ret = fs_->write_data_block(inode_.double_indirect_block, fs_->data_buffer_, 1);
+			{
+				scratch_block zeros(fs_->scratch_);
+				memset(zeros.data(), 0, block_size_bytes);
+				ret = fs_->write_data_block(inode_.double_indirect_block, zeros.data(), 1, block_kind::indirect);
+			}
 			if (ret < 0)
 				return ret;
 		}
 
 		ret = fs_->read_data_object(inode_.double_indirect_block, index_level_1 * sizeof(uint32_t), sizeof(uint32_t),
-		                            &pointer);
+		                            &pointer, block_kind::indirect);
 		if (ret < 0)
 			return ret;
 
 		if (pointer == 0)
 		{
-			free_block = fs_->get_free_block();
+			free_block = claim_block();
 			if (free_block == INVALID_BLOCK)
 				return ED_OUT_OF_BLOCKS;
 
-			fs_->set_block_status(free_block, true);
 			ret = fs_->write_data_object(inode_.double_indirect_block, index_level_1 * sizeof(uint32_t), sizeof(uint32_t),
-			                             &free_block);
+			                             &free_block, block_kind::indirect);
 			if (ret < 0)
 				return ret;
 			pointer = free_block;
 
 			// set mem to 0
-			ret = fs_->read_data_block(free_block, fs_->data_buffer_, 1);
-			if (ret < 0)
-				return ret;
-
-			memset(fs_->data_buffer_, 0, block_size_bytes);
-
-			ret = fs_->write_data_block(free_block, fs_->data_buffer_, 1);
+			{
+				scratch_block zeros(fs_->scratch_);
+				memset(zeros.data(), 0, block_size_bytes);
+				ret = fs_->write_data_block(free_block, zeros.data(), 1, block_kind::indirect);
+			}
 			if (ret < 0)
 				return ret;
 		}
 
-		ret = fs_->read_data_object(pointer, index_level_2 * sizeof(uint32_t), sizeof(uint32_t), &temp);
+		ret = fs_->read_data_object(pointer, index_level_2 * sizeof(uint32_t), sizeof(uint32_t), &temp,
+		                            block_kind::indirect);
 		if (ret < 0)
 			return ret;
 		if (temp == 0)
 		{
-			free_block = fs_->get_free_block();
+			free_block = claim_block();
 			if (free_block == INVALID_BLOCK)
 				return ED_OUT_OF_BLOCKS;
 
-			fs_->set_block_status(free_block, true);
-			ret = fs_->write_data_object(pointer, index_level_2 * sizeof(uint32_t), sizeof(uint32_t), &free_block);
+			ret = fs_->write_data_object(pointer, index_level_2 * sizeof(uint32_t), sizeof(uint32_t), &free_block,
+			                             block_kind::indirect);
 			if (ret < 0)
 				return ret;
 			return 0;
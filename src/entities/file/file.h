@@ -2,13 +2,66 @@
 #define FILE_H_GUARD
 
 #include <cstdlib>
+#include <chrono>
 #include <string>
+#include <functional>
+#include <map>
+#include <vector>
 
 #include "../../inode/inode.h"
 
+// readahead window in blocks, doubled on every sequential read up to the max
+#define READAHEAD_MIN	(4)
+#define READAHEAD_MAX	(64)
+// bytes of blocks an inode may hold back in its write buffer before complete ones go out,
+// then all of them; larger writes skip the buffer
+#define WRITE_BUFFER_MAX	(32 * 1024)
+
+// how a file is going to be accessed, see file_system::advise
+enum class access_hint
+{
+	normal,
+	// read ahead with the largest window from the start
+	sequential,
+	// no readahead at all
+	random,
+	// the range is loaded into the cache now
+	willneed,
+	// the range is dropped from the cache now
+	dontneed,
+	// blocks read are evicted first, so that a scan doesn't push out the working set
+	noreuse
+};
+
 class file_system;
 class directory;
 
+// one piece of a scattered buffer, see readv and writev
+typedef struct io_vec_struct
+{
+	void* base;
+	std::size_t length;
+} io_vec_t;
+
+// bytes [lo; hi) of data are waiting to be written to the block
+typedef struct dirty_block_struct
+{
+	std::vector<char> data;
+	std::size_t lo;
+	std::size_t hi;
+} dirty_block_t;
+
+// buffered writes to one inode, shared by every handle of it, see file_system::buffers_
+typedef struct write_buffer_struct
+{
+	// by block index in the file
+	std::map<uint32_t, dirty_block_t> blocks;
+	// buffered writes went out without updating the modify time
+	bool time_dirty{false};
+	// when the buffer went from clean to dirty, set by file_system::get_buffer
+	std::chrono::steady_clock::time_point since;
+} write_buffer_t;
+
 class file
 {
 public:
@@ -27,12 +80,31 @@ public:
 	void reopen(uint32_t inode_n, file_system* file_sys);
 
 	int read(char* buffer, std::size_t size);
+	// like read, but stops early at the end of the allocated blocks
+	int read_partial(char* buffer, std::size_t size);
+	// regular files go through the write buffer, see flush
 	int write(const char* buffer, std::size_t size);
+	// read and write at pos, the cursor is left alone; return the bytes transferred
+	int pread(char* buffer, std::size_t size, std::size_t pos);
+	int pwrite(const char* buffer, std::size_t size, std::size_t pos);
+	// read and write the pieces as one contiguous transfer at the cursor
+	int readv(const io_vec_t* vec, std::size_t count);
+	int writev(const io_vec_t* vec, std::size_t count);
 
 	int seek(std::size_t pos);
 
 	int trunc(std::size_t new_size);
 
+	// length 0 means up to the end of the file
+	int advise(std::size_t pos, std::size_t length, access_hint hint);
+	int pin(std::size_t pos, std::size_t length);
+	int unpin(std::size_t pos, std::size_t length);
+	// drops every pin taken through this handle, see file_system::close
+	void unpin_all();
+
+	// writes the buffered blocks of the inode, then the inode once unless data_only; what fails stays buffered
+	int flush(bool data_only = false);
+
 	std::size_t get_curr_pos() const { return curr_pos_; }
 	uint32_t get_inode_n() const { return inode_n_; }
 private:
@@ -40,11 +112,46 @@ private:
 	inode_t inode_{};
 	uint32_t inode_n_{INVALID_INODE};
 	std::size_t curr_pos_{0};
+	access_hint hint_{access_hint::normal};
+	// where the last read ended, the next one is sequential if it starts there
+	std::size_t ra_pos_{0};
+	uint32_t ra_window_{0};
+	// first block not prefetched yet
+	uint32_t ra_end_{0};
+	// data blocks pinned through this handle and how many times, a block the file
+	// no longer holds was freed and so unpinned already
+	std::map<uint32_t, uint32_t> pins_;
 
 	int get_inode(inode_t* inode_out) const;
+	std::size_t get_block_bytes() const;
 
 	int get_sector(uint32_t i, uint32_t* sector_out, bool do_allocate = false);
 	int allocate_block(uint32_t block_index);
+	// alloc_block, set_block_status and free_fragments, noting the map blocks changed for fsync
+	uint32_t claim_block();
+	void release_block(uint32_t block);
+	void release_fragments(uint32_t first, uint32_t count);
+	// move inline content to fragments or a data block, fragments to a data block
+	int spill_small_data();
+	// write into the fragment run, growing or moving it as needed
+	int write_fragment(std::size_t pos, std::size_t obj_size, const void* buffer);
+
+	// grows the window and prefetches past a sequential read, or resets it
+	void readahead(std::size_t pos, std::size_t size);
+	void prefetch(uint32_t first_block, uint32_t last_block);
+	// unpins the blocks of [first_block; last_block) this handle pinned, once or every time
+	void release_pins(uint32_t first_block, uint32_t last_block, bool all);
+	// calls fn(first data block, count) for the runs of contiguous blocks backing [first_block; last_block),
+	// stopping at the first hole, at the first error fn returns
+	int for_each_run(uint32_t first_block, uint32_t last_block, const std::function<int(uint32_t, uint32_t)>& fn);
+	// merges the write into the buffered blocks, flushing on a gap or past WRITE_BUFFER_MAX
+	int buffer_write(const char* buffer, std::size_t size, std::size_t pos);
+	int flush_block(write_buffer_t& buf, std::map<uint32_t, dirty_block_t>::iterator it);
+	// writes the buffered blocks [pos; pos + size) overlaps, so that they don't land on a write that skips the buffer
+	int flush_overlap(std::size_t pos, std::size_t size);
+	// forgets the buffered bytes from pos on
+	void drop_buffered(std::size_t pos);
+	void block_range(std::size_t pos, std::size_t length, uint32_t* first_block_out, uint32_t* last_block_out) const;
 
 	int read_unaligned(uint32_t start_block, std::size_t offset, std::size_t obj_size, void* buffer);
 	int write_unaligned(uint32_t start_block, std::size_t offset, std::size_t obj_size, const void* buffer);
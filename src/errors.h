@@ -29,6 +29,11 @@
 #define EIND_INVALID_INODE  -15
 #define EIND_OUT_OF_INODES	-16
 
+#define EDIR_NAME_TOO_LONG	-20
+#define ESB_BAD_FEATURES	-21
+
+#define ECACHE_PIN_FULL		-22
+
 inline std::string err_to_string(const int err)
 {
 	if (err >= 0)
@@ -54,6 +59,9 @@ inline std::string err_to_string(const int err)
 	case EFID_INVALID_ID: return "No such id";
 	case EIND_INVALID_INODE: return "Inode was invalid";
 	case EIND_OUT_OF_INODES: return "Disk is out of free inodes";
+	case EDIR_NAME_TOO_LONG: return "File name is too long";
+	case ESB_BAD_FEATURES: return "Unsupported feature set";
+	case ECACHE_PIN_FULL: return "Too many blocks pinned in cache";
 	default: return "Unkown error";
 	}
 }
@@ -1,11 +1,14 @@
 #include "fs.h"
 
 #include <iostream>
+#include <fstream>
 #include <vector>
+#include <cstdio>
 #include <ctime>
 #include <cstring>
 #include <limits>
-#include <tuple>
+#include <algorithm>
+#include <chrono>
 
 #include "../inode/inode.h"
 #include "../spacemap/spacemap.h"
@@ -38,6 +41,46 @@ inline static uint32_t bits_to_blocks(uint32_t x, uint32_t bl_size)
 	return bytes_to_blocks((x >> 3) + (x % 8 != 0), bl_size);
 }
 
+// spreads the buckets of one directory over consecutive stripes
+inline static uint32_t bucket_key(uint32_t dir_inode, uint32_t bucket)
+{
+	return dir_inode * 0x9E3779B1u + bucket;
+}
+
+// ESB_BAD_FEATURES for unknown bits and for combinations the on-disk layout can't hold
+static int check_features(uint16_t features, uint32_t block_size)
+{
+	if (features & ~SB_FEAT_ALL)
+		return ESB_BAD_FEATURES;
+	// packed entries store their length in 16 bits
+	if ((features & SB_FEAT_PACKED_DIRS) && block_size * SECTOR_SIZE > UINT16_MAX)
+		return ESB_BAD_FEATURES;
+	// a single-sector block has nothing to split
+	if ((features & SB_FEAT_FRAGMENTS) && block_size < 2)
+		return ESB_BAD_FEATURES;
+	// buckets hold packed entries
+	if ((features & SB_FEAT_HASHED_DIRS) && !(features & SB_FEAT_PACKED_DIRS))
+		return ESB_BAD_FEATURES;
+	return 0;
+}
+
+/**
+ * \brief allocation state of the calling thread, shared by all file systems
+ * hints only say where to start looking, any value is valid
+ */
+static thread_alloc_t& thread_alloc()
+{
+	static std::atomic<std::size_t> threads{0};
+	static thread_local thread_alloc_t state = []
+	{
+		const auto n = threads++;
+		// spread the starting points of new threads over the maps
+		const auto spread = static_cast<std::size_t>(n * 0x9E3779B97F4A7C15ULL >> 16);
+		return thread_alloc_t{n % COUNTER_SHARDS, spread, spread};
+	}();
+	return state;
+}
+
 int file_system::load(const std::string& disk_file)
 {
 	if (this->disk_.is_open())
@@ -52,37 +95,88 @@ int file_system::load(const std::string& disk_file)
 	if (ret < 0)
 		return ret;
 
-	// init data buffer
-	this->data_buffer_ = new char[DATABUFFER_SIZE * super_block_.block_size * SECTOR_SIZE];
+	// refuse images this build cannot read rather than misparse them
+	if (super_block_.magic != SB_MAGIC || super_block_.block_size == 0)
+		ret = ESB_BAD_FEATURES;
+	else
+		ret = check_features(super_block_.features, super_block_.block_size);
+	if (ret < 0)
+	{
+		this->disk_.unload();
+		return ret;
+	}
+
+	// init scratch buffers
+	this->scratch_.reset(super_block_.block_size * SECTOR_SIZE);
+	this->cache_.reset(super_block_.block_size * SECTOR_SIZE);
+	this->meta_cache_.reset(super_block_.block_size * SECTOR_SIZE);
+	reset_free_counts();
+
+	// older images allocate from one group spanning both maps
+	if (!has_feature(SB_FEAT_ALLOC_GROUPS))
+	{
+		super_block_.groups_count = 1;
+		super_block_.blocks_per_group = super_block_.blocks_count;
+		super_block_.inodes_per_group = super_block_.inodes_count;
+	}
 
 	// init inode map
 	this->inode_map_ = new space_map(super_block_.inodes_count);
-	read_object(super_block_.inodemap_first_block, 0, inode_map_->get_bytes_count(), inode_map_->bits_arr);
+	read_object(super_block_.inodemap_first_block, 0, inode_map_->get_bytes_count(), inode_map_->bits_arr, block_kind::map);
 
 	// init space map
 	this->space_map_ = new space_map(super_block_.blocks_count);
-	read_object(super_block_.spacemap_first_block, 0, space_map_->get_bytes_count(), space_map_->bits_arr);
+	read_object(super_block_.spacemap_first_block, 0, space_map_->get_bytes_count(), space_map_->bits_arr, block_kind::map);
+
+	// init fragment map
+	if (has_feature(SB_FEAT_FRAGMENTS))
+	{
+		this->frag_map_ = new frag_map(super_block_.blocks_count, super_block_.block_size);
+		auto map = frag_map_->get_map();
+		read_object(super_block_.fragmap_first_block, 0, map->get_bytes_count(), map->bits_arr, block_kind::map);
+		frag_map_->rebuild();
+	}
+
+	reset_groups();
 
 	std::cout << super_block_;
 
 	// init cwd
 	cwd_ = directory(INODE_ROOT_ID, this);
 
+	hot_set_file_ = disk_file + HOT_SET_EXT;
+	if (hot_set_)
+		load_hot_set();
+	if (writeback_)
+		start_writeback();
+
 	return 0;
 }
 
 void file_system::unload()
 {
+	stop_writeback();
+	stop_warming();
 	sync();
+	// what sync could not write goes with the disk
+	buffers_.clear();
+	buffer_errors_.clear();
+	dirty_bytes_ = 0;
+
+	if (hot_set_)
+		save_hot_set();
 
 	cache_.clear();
+	meta_cache_.clear();
 
-	delete[] data_buffer_;
-	data_buffer_ = nullptr;
+	scratch_.reset(0);
 
 	delete this->space_map_;
 	this->space_map_ = nullptr;
 
+	delete this->frag_map_;
+	this->frag_map_ = nullptr;
+
 	delete this->inode_map_;
 	this->inode_map_ = nullptr;
 
@@ -90,32 +184,152 @@ void file_system::unload()
 }
 
 int file_system::sync()
+{
+	// nothing is buffered on an unloaded or moved from file system
+	for (const auto inode : buffered_inodes())
+	{
+		const auto ret = flush_inode(inode);
+		if (ret < 0)
+			return ret;
+	}
+	const auto ret = sync_maps();
+	if (ret < 0)
+		return ret;
+
+	// reports the errors of the writeback thread, on the maps first
+	auto error = writeback_error_.exchange(0);
+	std::lock_guard<std::mutex> lock(buffers_lock_);
+	for (const auto& inode_error : buffer_errors_)
+		if (error == 0)
+			error = inode_error.second;
+	buffer_errors_.clear();
+	return error;
+}
+
+int file_system::sync_maps()
+{
+	// every map block goes out, later allocations are left to the next fsync
+	std::unordered_map<uint32_t, map_pages_t> touched;
+	{
+		std::lock_guard<std::mutex> lock(touched_lock_);
+		touched.swap(touched_pages_);
+	}
+	const auto ret = write_maps();
+	if (ret < 0)
+	{
+		for (const auto& pages : touched)
+			retouch(pages.first, pages.second);
+		return ret;
+	}
+	return disk_.is_open() ? disk_.flush() : 0;
+}
+
+int file_system::write_maps()
 {
 	int ret;
-	if (sb_dirty_)
+	if (sb_dirty_.exchange(false))
 	{
-		ret = this->disk_.write_block(SUPERBLOCK_SECT, reinterpret_cast<char *>(&super_block_), 1);
+		auto sb = get_super_block();
+		ret = this->disk_.write_block(SUPERBLOCK_SECT, reinterpret_cast<char *>(&sb), 1);
 		if (ret < 0)
+		{
+			sb_dirty_ = true;
+			return ret;
+		}
+	}
+	if (im_dirty_.exchange(false))
+	{
+		ret = write_map(super_block_.inodemap_first_block, inode_map_);
+		if (ret < 0)
+		{
+			im_dirty_ = true;
+			return ret;
+		}
+	}
+	if (sm_dirty_.exchange(false))
+	{
+		ret = write_map(super_block_.spacemap_first_block, space_map_);
+		if (ret < 0)
+		{
+			sm_dirty_ = true;
 			return ret;
-		sb_dirty_ = false;
+		}
 	}
-	if (im_dirty_)
+
+	std::lock_guard<std::mutex> sm_lock(sm_lock_);
+	if (fm_dirty_)
 	{
-		ret = write_object(super_block_.inodemap_first_block, 0, inode_map_->get_bytes_count(), inode_map_->bits_arr);
+		ret = write_map(super_block_.fragmap_first_block, frag_map_->get_map());
 		if (ret < 0)
 			return ret;
-		im_dirty_ = false;
+		fm_dirty_ = false;
 	}
-	if (sm_dirty_)
+	return 0;
+}
+
+// bits may change while they are written, so a snapshot goes out
+int file_system::write_map(const uint32_t first_block, const space_map* map)
+{
+	std::vector<uint8_t> bits(map->get_bytes_count());
+	map->snapshot(bits.data());
+	const auto ret = write_object(first_block, 0, bits.size(), bits.data(), block_kind::map);
+	return ret < 0 ? ret : 0;
+}
+
+int file_system::write_map_pages(const uint32_t first_block, const space_map* map, const std::set<uint32_t>& pages)
+{
+	const auto block_size_bytes = super_block_.block_size * SECTOR_SIZE;
+	std::vector<uint8_t> bits(block_size_bytes);
+	for (const auto page : pages)
 	{
-		ret = write_object(super_block_.spacemap_first_block, 0, space_map_->get_bytes_count(), space_map_->bits_arr);
+		const auto first_byte = static_cast<std::size_t>(page) * block_size_bytes;
+		if (first_byte >= map->get_bytes_count())
+			continue;
+		const auto size = std::min<std::size_t>(block_size_bytes, map->get_bytes_count() - first_byte);
+		map->snapshot(bits.data(), first_byte, size);
+		const auto ret = write_object(first_block + page, 0, size, bits.data(), block_kind::map);
 		if (ret < 0)
 			return ret;
-		sm_dirty_ = false;
 	}
 	return 0;
 }
 
+void file_system::touch_inode(const uint32_t inode)
+{
+	const auto bits = super_block_.block_size * SECTOR_SIZE * 8;
+	std::lock_guard<std::mutex> lock(touched_lock_);
+	touched_pages_[inode].inode.insert(inode / bits);
+}
+
+void file_system::touch_block(const uint32_t inode, const uint32_t block)
+{
+	const auto bits = super_block_.block_size * SECTOR_SIZE * 8;
+	std::lock_guard<std::mutex> lock(touched_lock_);
+	touched_pages_[inode].space.insert(block / bits);
+}
+
+void file_system::retouch(const uint32_t inode, const map_pages_t& pages)
+{
+	std::lock_guard<std::mutex> lock(touched_lock_);
+	auto& kept = touched_pages_[inode];
+	kept.inode.insert(pages.inode.begin(), pages.inode.end());
+	kept.space.insert(pages.space.begin(), pages.space.end());
+	kept.frag.insert(pages.frag.begin(), pages.frag.end());
+}
+
+void file_system::touch_fragments(const uint32_t inode, const uint32_t first, const uint32_t count)
+{
+	if (count == 0)
+		return;
+	const auto bits = super_block_.block_size * SECTOR_SIZE * 8;
+	std::lock_guard<std::mutex> lock(touched_lock_);
+	auto& pages = touched_pages_[inode];
+	// the block holding them may have been taken or given back as well
+	pages.space.insert(first / super_block_.block_size / bits);
+	for (auto page = first / bits; page <= (first + count - 1) / bits; ++page)
+		pages.frag.insert(page);
+}
+
 void file_system::trace()
 {
 	using std::cout;
@@ -147,95 +361,161 @@ void file_system::traceblock(uint32_t block)
 	using std::endl;
 	using std::dec;
 
-	read_data_block(block, data_buffer_, 1);
-	// DATABUFFER_SIZE * super_block_.block_size * SECTOR_SIZE
+	scratch_block buffer(scratch_);
+	read_data_block(block, buffer.data(), 1, block_kind::data);
 	for (uint32_t i = 0; i < 64; ++i)
 	{
 		if (i % 16 == 0)
 			cout << endl << setw(4) << setfill('0') << std::hex << static_cast<int>(i << 4) << dec << ": ";
-		cout << hex(data_buffer_[i]);
+		cout << hex(buffer.data()[i]);
 	}
 	cout << std::dec;
 	cout << endl;
 }
 
-file_system::file_system(const file_system& that) : super_block_(that.super_block_)
+file_system::file_system(const file_system& that) : super_block_(that.get_super_block())
 {
+	std::lock_guard<std::mutex> round_lock(that.writeback_round_lock_);
 	disk_ = that.disk_;
 
-	sb_dirty_ = that.sb_dirty_;
-	im_dirty_ = that.im_dirty_;
-	sm_dirty_ = that.sm_dirty_;
+	sb_dirty_ = that.sb_dirty_.load();
+	im_dirty_ = that.im_dirty_.load();
+	sm_dirty_ = that.sm_dirty_.load();
+	fm_dirty_ = that.fm_dirty_;
+	touched_pages_ = that.touched_pages_;
+	dirty_bytes_ = that.dirty_bytes_.load();
+	buffers_ = that.buffers_;
+	buffer_errors_ = that.buffer_errors_;
+	writeback_ = that.writeback_.load();
+	writeback_age_ = that.writeback_age_.load();
+	dirty_ratio_ = that.dirty_ratio_.load();
+	dirty_limit_ = that.dirty_limit_.load();
+	writeback_error_ = that.writeback_error_.load();
 
 	cache_ = that.cache_;
+	meta_cache_ = that.meta_cache_;
+	hot_set_ = that.hot_set_;
+	hot_set_file_ = that.hot_set_file_;
 
 	files_ = that.files_;
 	dirs_ = that.dirs_;
 
 	cwd_ = that.cwd_;
 
-	data_buffer_ = new char[DATABUFFER_SIZE * super_block_.block_size * SECTOR_SIZE];
-	memcpy(data_buffer_, that.data_buffer_, DATABUFFER_SIZE * super_block_.block_size * SECTOR_SIZE);
+	scratch_.reset(that.scratch_.get_block_bytes());
 
 	inode_map_ = new space_map(*that.inode_map_);
 	space_map_ = new space_map(*that.space_map_);
+	frag_map_ = that.frag_map_ ? new frag_map(*that.frag_map_) : nullptr;
+	reset_groups();
+
+	if (writeback_ && disk_.is_open())
+		start_writeback();
 }
 
-file_system::file_system(file_system&& that) noexcept : super_block_(that.super_block_)
+file_system::file_system(file_system&& that) noexcept : super_block_(that.get_super_block())
 {
+	that.stop_writeback();
+	that.stop_warming();
 	disk_ = std::move(that.disk_);
 
-	sb_dirty_ = that.sb_dirty_;
+	sb_dirty_ = that.sb_dirty_.load();
 	that.sb_dirty_ = false;
-	im_dirty_ = that.im_dirty_;
+	im_dirty_ = that.im_dirty_.load();
 	that.im_dirty_ = false;
-	sm_dirty_ = that.sm_dirty_;
+	sm_dirty_ = that.sm_dirty_.load();
 	that.sm_dirty_ = false;
+	fm_dirty_ = that.fm_dirty_;
+	that.fm_dirty_ = false;
+	touched_pages_ = std::move(that.touched_pages_);
+	that.touched_pages_.clear();
+	dirty_bytes_ = that.dirty_bytes_.exchange(0);
+	buffers_ = std::move(that.buffers_);
+	that.buffers_.clear();
+	buffer_errors_ = std::move(that.buffer_errors_);
+	that.buffer_errors_.clear();
+	writeback_ = that.writeback_.load();
+	writeback_age_ = that.writeback_age_.load();
+	dirty_ratio_ = that.dirty_ratio_.load();
+	dirty_limit_ = that.dirty_limit_.load();
+	writeback_error_ = that.writeback_error_.exchange(0);
 
 	cache_ = std::move(that.cache_);
+	meta_cache_ = std::move(that.meta_cache_);
+	hot_set_ = that.hot_set_;
+	hot_set_file_ = std::move(that.hot_set_file_);
 
 	files_ = std::move(that.files_);
 	dirs_ = std::move(that.dirs_);
 
 	cwd_ = std::move(that.cwd_);
 
-	data_buffer_ = that.data_buffer_;
-	that.data_buffer_ = nullptr;
+	scratch_.reset(that.scratch_.get_block_bytes());
+	that.scratch_.reset(0);
 
 	inode_map_ = that.inode_map_;
 	that.inode_map_ = nullptr;
 	space_map_ = that.space_map_;
 	that.space_map_ = nullptr;
+	frag_map_ = that.frag_map_;
+	that.frag_map_ = nullptr;
+	groups_ = std::move(that.groups_);
+
+	if (writeback_ && disk_.is_open())
+		start_writeback();
 }
 
 file_system::~file_system()
 {
+	stop_writeback();
+	stop_warming();
 	sync();
-	delete[] data_buffer_;
 }
 
 file_system& file_system::operator=(const file_system& that)
 {
 	if (this == &that) return *this;
 
+	stop_writeback();
+	stop_warming();
+	std::lock_guard<std::mutex> round_lock(that.writeback_round_lock_);
+	super_block_ = that.get_super_block();
+	reset_free_counts();
 	disk_ = that.disk_;
 
-	sb_dirty_ = that.sb_dirty_;
-	im_dirty_ = that.im_dirty_;
-	sm_dirty_ = that.sm_dirty_;
+	sb_dirty_ = that.sb_dirty_.load();
+	im_dirty_ = that.im_dirty_.load();
+	sm_dirty_ = that.sm_dirty_.load();
+	fm_dirty_ = that.fm_dirty_;
+	touched_pages_ = that.touched_pages_;
+	dirty_bytes_ = that.dirty_bytes_.load();
+	buffers_ = that.buffers_;
+	buffer_errors_ = that.buffer_errors_;
+	writeback_ = that.writeback_.load();
+	writeback_age_ = that.writeback_age_.load();
+	dirty_ratio_ = that.dirty_ratio_.load();
+	dirty_limit_ = that.dirty_limit_.load();
+	writeback_error_ = that.writeback_error_.load();
 
 	cache_ = that.cache_;
+	meta_cache_ = that.meta_cache_;
+	hot_set_ = that.hot_set_;
+	hot_set_file_ = that.hot_set_file_;
 
 	files_ = that.files_;
 	dirs_ = that.dirs_;
 
 	cwd_ = that.cwd_;
 
-	data_buffer_ = new char[DATABUFFER_SIZE * super_block_.block_size * SECTOR_SIZE];
-	memcpy(data_buffer_, that.data_buffer_, DATABUFFER_SIZE * super_block_.block_size * SECTOR_SIZE);
+	scratch_.reset(that.scratch_.get_block_bytes());
 
 	inode_map_ = new space_map(*that.inode_map_);
 	space_map_ = new space_map(*that.space_map_);
+	frag_map_ = that.frag_map_ ? new frag_map(*that.frag_map_) : nullptr;
+	reset_groups();
+
+	if (writeback_ && disk_.is_open())
+		start_writeback();
 
 	return *this;
 }
@@ -244,49 +524,87 @@ file_system& file_system::operator=(file_system&& that) noexcept
 {
 	if (this == &that) return *this;
 
+	stop_writeback();
+	stop_warming();
+	that.stop_writeback();
+	that.stop_warming();
+	super_block_ = that.get_super_block();
+	reset_free_counts();
 	disk_ = std::move(that.disk_);
 
-	sb_dirty_ = that.sb_dirty_;
+	sb_dirty_ = that.sb_dirty_.load();
 	that.sb_dirty_ = false;
-	im_dirty_ = that.im_dirty_;
+	im_dirty_ = that.im_dirty_.load();
 	that.im_dirty_ = false;
-	sm_dirty_ = that.sm_dirty_;
+	sm_dirty_ = that.sm_dirty_.load();
 	that.sm_dirty_ = false;
+	fm_dirty_ = that.fm_dirty_;
+	that.fm_dirty_ = false;
+	touched_pages_ = std::move(that.touched_pages_);
+	that.touched_pages_.clear();
+	dirty_bytes_ = that.dirty_bytes_.exchange(0);
+	buffers_ = std::move(that.buffers_);
+	that.buffers_.clear();
+	buffer_errors_ = std::move(that.buffer_errors_);
+	that.buffer_errors_.clear();
+	writeback_ = that.writeback_.load();
+	writeback_age_ = that.writeback_age_.load();
+	dirty_ratio_ = that.dirty_ratio_.load();
+	dirty_limit_ = that.dirty_limit_.load();
+	writeback_error_ = that.writeback_error_.exchange(0);
 
 	cache_ = std::move(that.cache_);
+	meta_cache_ = std::move(that.meta_cache_);
+	hot_set_ = that.hot_set_;
+	hot_set_file_ = std::move(that.hot_set_file_);
 
 	files_ = std::move(that.files_);
 	dirs_ = std::move(that.dirs_);
 
 	cwd_ = std::move(that.cwd_);
 
-	data_buffer_ = that.data_buffer_;
-	that.data_buffer_ = nullptr;
+	scratch_.reset(that.scratch_.get_block_bytes());
+	that.scratch_.reset(0);
 
 	inode_map_ = that.inode_map_;
 	that.inode_map_ = nullptr;
 	space_map_ = that.space_map_;
 	that.space_map_ = nullptr;
+	frag_map_ = that.frag_map_;
+	that.frag_map_ = nullptr;
+	groups_ = std::move(that.groups_);
+
+	if (writeback_ && disk_.is_open())
+		start_writeback();
 
 	return *this;
 }
 
 int file_system::init(const std::string& disk_file, const uint32_t inodes_count,
-                      std::size_t disk_size, const uint32_t block_size)
+                      std::size_t disk_size, const uint32_t block_size, const uint16_t features)
 {
+	auto ret = check_features(features, block_size);
+	if (ret < 0)
+		return ret;
+
 	if (this->disk_.is_open())
 		this->unload();
 
-	auto ret = this->disk_.create(disk_file, disk_size);
+	ret = this->disk_.create(disk_file, disk_size);
 	if (ret < 0)
 		return ret;
 
+	// whatever was saved for an older image at the same path is of no use
+	hot_set_file_ = disk_file + HOT_SET_EXT;
+	std::remove(hot_set_file_.c_str());
+
 	// init the super_block struct
 	// total blocks we have = total disk size (in sectors)
 	//                      -1 sector for superblock
 	//                      - sectors required for inode map
 	//                      - sectors required for inodes
-	const auto inodes_size = bytes_to_blocks(sizeof(inode_t) * inodes_count, block_size);
+	const uint32_t inode_size = (features & SB_FEAT_INLINE_DATA) ? sizeof(inode_t) : INODE_BASE_SIZE;
+	const auto inodes_size = bytes_to_blocks(inode_size * inodes_count, block_size);
 
 	const auto inodemap_size = bits_to_blocks(inodes_count, block_size);
 
@@ -294,10 +612,29 @@ int file_system::init(const std::string& disk_file, const uint32_t inodes_count,
 
 	const auto spacemap_size = bits_to_blocks(blocks_count, block_size);
 
-	super_block_t sb;
+	const auto fragmap_size = (features & SB_FEAT_FRAGMENTS) ? bits_to_blocks(blocks_count * block_size, block_size) : 0;
+
+	// a group covers one block of the space map, smaller disks are split into
+	// ALLOC_GROUPS_MIN groups of whole map words
+	uint32_t groups_count = 1;
+	uint32_t blocks_per_group = blocks_count;
+	uint32_t inodes_per_group = inodes_count;
+	if ((features & SB_FEAT_ALLOC_GROUPS) && blocks_count > 0)
+	{
+		blocks_per_group = block_size * SECTOR_SIZE * 8;
+		if (blocks_count / blocks_per_group < ALLOC_GROUPS_MIN)
+		{
+			blocks_per_group = blocks_count / ALLOC_GROUPS_MIN + (blocks_count % ALLOC_GROUPS_MIN != 0);
+			blocks_per_group = std::max<uint32_t>((blocks_per_group + 63) / 64 * 64, 64);
+		}
+		groups_count = blocks_count / blocks_per_group + (blocks_count % blocks_per_group != 0);
+		inodes_per_group = inodes_count / groups_count + (inodes_count % groups_count != 0);
+	}
+
+	super_block_t sb{};
 	sb.inodes_count = inodes_count;
 	sb.inodes_free = inodes_count;
-	sb.inode_size = sizeof(inode_t);
+	sb.inode_size = inode_size;
 	sb.blocks_count = blocks_count;
 	sb.blocks_free = blocks_count;
 	sb.block_size = block_size;
@@ -309,7 +646,13 @@ int file_system::init(const std::string& disk_file, const uint32_t inodes_count,
 	sb.data_first_block = sb.spacemap_first_block;
 	sb.inodes_size = inodes_size;
 	sb.spacemap_size = spacemap_size;
-	sb.magic = 0xBEEF;
+	sb.fragmap_first_block = sb.spacemap_first_block + spacemap_size;
+	sb.fragmap_size = fragmap_size;
+	sb.magic = SB_MAGIC;
+	sb.features = features;
+	sb.groups_count = groups_count;
+	sb.blocks_per_group = blocks_per_group;
+	sb.inodes_per_group = inodes_per_group;
 
 	this->super_block_ = sb;
 
@@ -317,8 +660,11 @@ int file_system::init(const std::string& disk_file, const uint32_t inodes_count,
 
 	this->disk_.write_block(0, reinterpret_cast<char *>(&this->super_block_), 1);
 
-	// init data buffer
-	this->data_buffer_ = new char[DATABUFFER_SIZE * super_block_.block_size * SECTOR_SIZE];
+	// init scratch buffers
+	this->scratch_.reset(super_block_.block_size * SECTOR_SIZE);
+	this->cache_.reset(super_block_.block_size * SECTOR_SIZE);
+	this->meta_cache_.reset(super_block_.block_size * SECTOR_SIZE);
+	reset_free_counts();
 
 	// creating inode map
 
@@ -326,7 +672,7 @@ int file_system::init(const std::string& disk_file, const uint32_t inodes_count,
 
 	inode_map_->set(true, INODE_ROOT_ID);
 
-	this->write_object(sb.inodemap_first_block, 0, inode_map_->get_bytes_count(), inode_map_->bits_arr);
+	this->write_object(sb.inodemap_first_block, 0, inode_map_->get_bytes_count(), inode_map_->bits_arr, block_kind::map);
 
 	// create root inode
 	const auto curr_time = time(nullptr);
@@ -336,6 +682,7 @@ int file_system::init(const std::string& disk_file, const uint32_t inodes_count,
 	root.change_time = curr_time;
 	root.modify_time = curr_time;
 	root.links_count = 1;
+	root.flags = get_small_data_flag(file_type::dir);
 
 	ret = write_inode(INODE_ROOT_ID, &root);
 	if (ret < 0)
@@ -344,10 +691,20 @@ int file_system::init(const std::string& disk_file, const uint32_t inodes_count,
 	// creating the space mapping
 
 	this->space_map_ = new space_map(blocks_count);
-	for (uint32_t i = 0; i < spacemap_size; ++i)
+	for (uint32_t i = 0; i < spacemap_size + fragmap_size; ++i)
 		this->space_map_->set(true, i);
 
-	this->write_object(sb.spacemap_first_block, 0, space_map_->get_bytes_count(), space_map_->bits_arr);
+	this->write_object(sb.spacemap_first_block, 0, space_map_->get_bytes_count(), space_map_->bits_arr, block_kind::map);
+
+	// creating the fragment mapping
+	if (features & SB_FEAT_FRAGMENTS)
+	{
+		this->frag_map_ = new frag_map(blocks_count, block_size);
+		const auto map = frag_map_->get_map();
+		this->write_object(sb.fragmap_first_block, 0, map->get_bytes_count(), map->bits_arr, block_kind::map);
+	}
+
+	reset_groups();
 
 	// init cwd
 	cwd_ = directory(INODE_ROOT_ID, this);
@@ -358,11 +715,14 @@ int file_system::init(const std::string& disk_file, const uint32_t inodes_count,
 	if (ret < 0)
 		return ret;
 
+	if (writeback_)
+		start_writeback();
 	return 0;
 }
 
 int file_system::create(const std::string& file_name)
 {
+	shared_guard ns_lock(ns_lock_);
 	return do_create(file_name, file_type::regular);
 }
 
@@ -371,6 +731,8 @@ int file_system::link(const std::string& original_file, const std::string& new_f
 	if (original_file.empty() || new_file.empty())
 		return EDIR_INVALID_PATH;
 
+	shared_guard ns_lock(ns_lock_);
+
 	uint32_t orig_file_inode;
 	auto ret = get_inode_by_path(original_file, &orig_file_inode);
 	if (ret < 0)
@@ -387,6 +749,8 @@ int file_system::link(const std::string& original_file, const std::string& new_f
 
 	directory dir = directory(last_dir_inode, this);
 
+	table_guard inode_lock(inode_locks_, {last_dir_inode, orig_file_inode}, true);
+
 	// check if file exists
 	const auto dirent = dir.find(small_name);
 	if (dirent.inode_n != INVALID_INODE)
@@ -394,7 +758,7 @@ int file_system::link(const std::string& original_file, const std::string& new_f
 		return EDIR_FILE_EXISTS;
 	}
 
-	// up the counter
+	// up the counter, unless the original went away meanwhile
 	inode_t orig_file;
 	ret = read_inode(orig_file_inode, &orig_file);
 	if (ret < 0)
@@ -418,27 +782,48 @@ int file_system::link(const std::string& original_file, const std::string& new_f
 
 int file_system::unlink(const std::string& file_name)
 {
+	shared_guard ns_lock(ns_lock_);
 	return do_unlink(file_name, false);
 }
 
 fid_t file_system::open(const std::string& disk_file)
 {
+	shared_guard ns_lock(ns_lock_);
+
 	uint32_t inode;
 	const auto ret = get_inode_by_path(disk_file, &inode);
 	if (ret < 0)
 		return ret;
-	const auto fid = files_.insert(file(inode, this));
+	const auto opened = file(inode, this);
+
+	std::lock_guard<std::mutex> lock(handles_lock_);
+	const auto fid = files_.insert(opened);
 	if (fid == std::numeric_limits<std::size_t>::max())
 		return INVALID_FID;
 	return fid;
 }
 
-int file_system::close(fid_t fid) const
+int file_system::close(fid_t fid)
 {
+	if (fid >= STORAGE_SIZE)
+		return EFID_INVALID_ID;
+	std::lock_guard<std::mutex> fid_lock(fid_locks_[fid]);
 	try
 	{
+		auto& f = get_file(fid);
+		const auto inode = f.get_inode_n();
+		const auto ret = flush_inode(inode);
+		{
+			table_guard inode_lock(inode_locks_, {inode}, ret < 0);
+			// what could not be written is lost with the last handle of the inode
+			if (ret < 0 && !is_open(inode, fid))
+				drop_buffer(inode);
+			f.unpin_all();
+		}
+		const auto error = take_buffer_error(inode);
+		std::lock_guard<std::mutex> lock(handles_lock_);
 		files_.remove(fid);
-		return 0;
+		return ret < 0 ? ret : error;
 	}
 	catch (std::exception&)
 	{
@@ -448,9 +833,17 @@ int file_system::close(fid_t fid) const
 
 int file_system::read(fid_t fid, char* buffer, std::size_t size)
 {
+	if (fid >= STORAGE_SIZE)
+		return EFID_INVALID_ID;
+	std::lock_guard<std::mutex> fid_lock(fid_locks_[fid]);
 	try
 	{
-		return files_[fid].read(buffer, size);
+		auto& f = get_file(fid);
+		const auto ret = flush_inode(f.get_inode_n());
+		if (ret < 0)
+			return ret;
+		table_guard inode_lock(inode_locks_, {f.get_inode_n()}, false);
+		return f.read(buffer, size);
 	}
 	catch (std::exception&)
 	{
@@ -460,9 +853,53 @@ int file_system::read(fid_t fid, char* buffer, std::size_t size)
 
 int file_system::write(fid_t fid, const char* buffer, std::size_t size)
 {
+	if (fid >= STORAGE_SIZE)
+		return EFID_INVALID_ID;
+	throttle();
+	std::lock_guard<std::mutex> fid_lock(fid_locks_[fid]);
+	try
+	{
+		auto& f = get_file(fid);
+		table_guard inode_lock(inode_locks_, {f.get_inode_n()}, true);
+		return f.write(buffer, size);
+	}
+	catch (std::exception&)
+	{
+		return EFID_INVALID_ID;
+	}
+}
+
+int file_system::readv(fid_t fid, const io_vec_t* vec, std::size_t count)
+{
+	if (fid >= STORAGE_SIZE)
+		return EFID_INVALID_ID;
+	std::lock_guard<std::mutex> fid_lock(fid_locks_[fid]);
+	try
+	{
+		auto& f = get_file(fid);
+		const auto ret = flush_inode(f.get_inode_n());
+		if (ret < 0)
+			return ret;
+		table_guard inode_lock(inode_locks_, {f.get_inode_n()}, false);
+		return f.readv(vec, count);
+	}
+	catch (std::exception&)
+	{
+		return EFID_INVALID_ID;
+	}
+}
+
+int file_system::writev(fid_t fid, const io_vec_t* vec, std::size_t count)
+{
+	if (fid >= STORAGE_SIZE)
+		return EFID_INVALID_ID;
+	throttle();
+	std::lock_guard<std::mutex> fid_lock(fid_locks_[fid]);
 	try
 	{
-		return files_[fid].write(buffer, size);
+		auto& f = get_file(fid);
+		table_guard inode_lock(inode_locks_, {f.get_inode_n()}, true);
+		return f.writev(vec, count);
 	}
 	catch (std::exception&)
 	{
@@ -470,11 +907,36 @@ int file_system::write(fid_t fid, const char* buffer, std::size_t size)
 	}
 }
 
+int file_system::pread(fid_t fid, char* buffer, std::size_t size, std::size_t offset)
+{
+	file f;
+	const auto ret = copy_file(fid, &f);
+	if (ret < 0)
+		return ret;
+
+	table_guard inode_lock(inode_locks_, {f.get_inode_n()}, false);
+	return f.pread(buffer, size, offset);
+}
+
+int file_system::pwrite(fid_t fid, const char* buffer, std::size_t size, std::size_t offset)
+{
+	file f;
+	const auto ret = copy_file(fid, &f);
+	if (ret < 0)
+		return ret;
+
+	table_guard inode_lock(inode_locks_, {f.get_inode_n()}, true);
+	return f.pwrite(buffer, size, offset);
+}
+
 int file_system::seek(fid_t fid, std::size_t pos)
 {
+	if (fid >= STORAGE_SIZE)
+		return EFID_INVALID_ID;
+	std::lock_guard<std::mutex> fid_lock(fid_locks_[fid]);
 	try
 	{
-		return files_[fid].seek(pos);
+		return get_file(fid).seek(pos);
 	}
 	catch (std::exception&)
 	{
@@ -484,9 +946,74 @@ int file_system::seek(fid_t fid, std::size_t pos)
 
 int file_system::trunc(fid_t fid, std::size_t new_length)
 {
+	if (fid >= STORAGE_SIZE)
+		return EFID_INVALID_ID;
+	std::lock_guard<std::mutex> fid_lock(fid_locks_[fid]);
+	try
+	{
+		auto& f = get_file(fid);
+		table_guard inode_lock(inode_locks_, {f.get_inode_n()}, true);
+		return f.trunc(new_length);
+	}
+	catch (std::exception&)
+	{
+		return EFID_INVALID_ID;
+	}
+}
+
+int file_system::advise(fid_t fid, std::size_t offset, std::size_t length, access_hint hint)
+{
+	if (fid >= STORAGE_SIZE)
+		return EFID_INVALID_ID;
+	std::lock_guard<std::mutex> fid_lock(fid_locks_[fid]);
+	try
+	{
+		auto& f = get_file(fid);
+		const auto ret = flush_inode(f.get_inode_n());
+		if (ret < 0)
+			return ret;
+		table_guard inode_lock(inode_locks_, {f.get_inode_n()}, false);
+		return f.advise(offset, length, hint);
+	}
+	catch (std::exception&)
+	{
+		return EFID_INVALID_ID;
+	}
+}
+
+int file_system::pin(fid_t fid, std::size_t offset, std::size_t length)
+{
+	if (fid >= STORAGE_SIZE)
+		return EFID_INVALID_ID;
+	std::lock_guard<std::mutex> fid_lock(fid_locks_[fid]);
+	try
+	{
+		auto& f = get_file(fid);
+		const auto ret = flush_inode(f.get_inode_n());
+		if (ret < 0)
+			return ret;
+		table_guard inode_lock(inode_locks_, {f.get_inode_n()}, false);
+		return f.pin(offset, length);
+	}
+	catch (std::exception&)
+	{
+		return EFID_INVALID_ID;
+	}
+}
+
+int file_system::unpin(fid_t fid, std::size_t offset, std::size_t length)
+{
+	if (fid >= STORAGE_SIZE)
+		return EFID_INVALID_ID;
+	std::lock_guard<std::mutex> fid_lock(fid_locks_[fid]);
 	try
 	{
-		return files_[fid].trunc(new_length);
+		auto& f = get_file(fid);
+		const auto ret = flush_inode(f.get_inode_n());
+		if (ret < 0)
+			return ret;
+		table_guard inode_lock(inode_locks_, {f.get_inode_n()}, false);
+		return f.unpin(offset, length);
 	}
 	catch (std::exception&)
 	{
@@ -494,41 +1021,37 @@ int file_system::trunc(fid_t fid, std::size_t new_length)
 	}
 }
 
+int file_system::fsync(fid_t fid)
+{
+	return sync_file(fid, false);
+}
+
+int file_system::fdatasync(fid_t fid)
+{
+	return sync_file(fid, true);
+}
+
 int file_system::cd(const std::string& new_dir)
 {
 	if (new_dir.empty())
 		return EDIR_INVALID_PATH;
 	uint32_t new_inode_n;
 
+	shared_guard ns_lock(ns_lock_);
 	const auto ret = get_inode_by_path(new_dir, &new_inode_n);
 	if (ret < 0)
 		return ret;
 
-	cwd_ = directory(new_inode_n, this);
+	const auto dir = directory(new_inode_n, this);
+	std::lock_guard<std::mutex> lock(cwd_lock_);
+	cwd_ = dir;
 	return 0;
 }
 
 int file_system::mkdir(const std::string& dir_name)
 {
-	uint32_t prev_dir_inode;
-	uint32_t inode_out;
-	auto ret = do_create(dir_name, file_type::dir, &inode_out, &prev_dir_inode);
-	if (ret < 0)
-		return ret;
-	auto dir = directory(inode_out, this);
-	ret = dir.add_entry(inode_out, ".");
-	if (ret < 0)
-	{
-		do_unlink(dir_name, true);
-		return ret;
-	}
-	ret = dir.add_entry(prev_dir_inode, "..");
-	if (ret < 0)
-	{
-		do_unlink(dir_name, true);
-		return ret;
-	}
-	return 0;
+	shared_guard ns_lock(ns_lock_);
+	return do_create(dir_name, file_type::dir);
 }
 
 int file_system::rmdir(const std::string& dir_name)
@@ -536,6 +1059,9 @@ int file_system::rmdir(const std::string& dir_name)
 	if (dir_name.empty())
 		return EDIR_INVALID_PATH;
 
+	// keeps creates out of the directory until it is gone
+	unique_guard ns_lock(ns_lock_);
+
 	uint32_t dir_inode;
 	const auto ret = get_inode_by_path(dir_name, &dir_inode);
 	if (ret < 0)
@@ -544,14 +1070,13 @@ int file_system::rmdir(const std::string& dir_name)
 	if (dir_inode == INODE_ROOT_ID)
 		return EDIR_INVALID_PATH;
 
-	// check if dir is empty or not
+	// check if dir is empty or not, a hashed one keeps . and .. in any bucket
 	auto dir = directory(dir_inode, this);
-	dir.read(); // . dir
-	dir.read(); // .. dir
-	const auto dirent = dir.read(); // should be invalid 
-	if (dirent.inode_n != INVALID_INODE)
+	dirent_t dirent;
+	while ((dirent = dir.read()).inode_n != INVALID_INODE)
 	{
-		return EDIR_NOT_EMPTY;
+		if (strcmp(dirent.name, ".") != 0 && strcmp(dirent.name, "..") != 0)
+			return EDIR_NOT_EMPTY;
 	}
 
 	// todo: notify dirs that are opened that they are actually deleted
@@ -560,11 +1085,16 @@ int file_system::rmdir(const std::string& dir_name)
 
 did_t file_system::opendir(const std::string& dir_name)
 {
+	shared_guard ns_lock(ns_lock_);
+
 	uint32_t dir_inode;
 	const auto ret = get_inode_by_path(dir_name, &dir_inode);
 	if (ret < 0)
 		return ret;
-	const auto index = dirs_.insert(directory(dir_inode, this));
+	const auto opened = directory(dir_inode, this);
+
+	std::lock_guard<std::mutex> lock(handles_lock_);
+	const auto index = dirs_.insert(opened);
 	if (index == std::numeric_limits<std::size_t>::max())
 		return INVALID_FID;
 	return index;
@@ -572,6 +1102,10 @@ did_t file_system::opendir(const std::string& dir_name)
 
 int file_system::closedir(did_t dir_id) const
 {
+	if (dir_id >= STORAGE_SIZE)
+		return EDID_INVALID_ID;
+	std::lock_guard<std::mutex> did_lock(did_locks_[dir_id]);
+	std::lock_guard<std::mutex> lock(handles_lock_);
 	try
 	{
 		dirs_.remove(dir_id);
@@ -585,9 +1119,14 @@ int file_system::closedir(did_t dir_id) const
 
 dirent_t file_system::readdir(did_t dir_id)
 {
+	if (dir_id >= STORAGE_SIZE)
+		return INVALID_DIRENT;
+	std::lock_guard<std::mutex> did_lock(did_locks_[dir_id]);
 	try
 	{
-		return dirs_[dir_id].read();
+		auto& dir = get_dir(dir_id);
+		table_guard inode_lock(inode_locks_, {dir.get_file()->get_inode_n()}, false);
+		return dir.read();
 	}
 	catch (std::exception&)
 	{
@@ -595,57 +1134,297 @@ dirent_t file_system::readdir(did_t dir_id)
 	}
 }
 
-int file_system::rewind_dir(did_t dir_id)
+int file_system::readdirplus(did_t dir_id, std::vector<direntplus_t>* entries_out)
 {
+	if (dir_id >= STORAGE_SIZE)
+		return EDID_INVALID_ID;
+	std::lock_guard<std::mutex> did_lock(did_locks_[dir_id]);
+
+	directory* dir;
 	try
 	{
-		dirs_[dir_id].rewind();
-		return 0;
+		dir = &get_dir(dir_id);
 	}
 	catch (std::exception&)
 	{
 		return EDID_INVALID_ID;
 	}
-}
+	// entries cannot be unlinked before their inodes are read,
+	// which takes the whole of a hashed directory
+	const auto dir_inode = dir->get_file()->get_inode_n();
+	const auto hashed = dir->is_hashed();
+	std::unique_ptr<table_guard> inode_lock(new table_guard(inode_locks_, {dir_inode}, hashed));
+
+	std::vector<dirent_t> dirents;
+	std::vector<uint32_t> buffered;
+	dirent_t dirent;
+	while ((dirent = dir->read()).inode_n != INVALID_INODE)
+	{
+		dirents.push_back(dirent);
+		if (find_buffer(dirent.inode_n) != nullptr)
+			buffered.push_back(dirent.inode_n);
+	}
 
-std::string file_system::concat_paths(const std::string& path1, const std::string& path2)
-{
-	if (path1.empty())
-		return path2;
-	if (path2.empty())
-		return path1;
-	if (path1[path1.length() - 1] == '/' && path2[0] == '/')
-		return path1 + path2.substr(1);
-	if (path1[path1.length() - 1] == '/' || path2[0] == '/')
-		return path1 + path2;
-	return path1 + "/" + path2;
+	// buffered writes only reach the inode table once flushed. That needs the inodes exclusively,
+	// so the directory is let go meanwhile and the entries unlinked in between are left out
+	if (!buffered.empty())
+	{
+		inode_lock.reset();
+		for (const auto inode : buffered)
+		{
+			const auto ret = flush_inode(inode);
+			if (ret < 0)
+				return ret;
+		}
+		inode_lock.reset(new table_guard(inode_locks_, {dir_inode}, hashed));
+		dirents.erase(std::remove_if(dirents.begin(), dirents.end(), [dir](const dirent_t& entry)
+		{
+			return dir->find(entry.name).inode_n != entry.inode_n;
+		}), dirents.end());
+	}
+
+	std::vector<uint32_t> inode_ids(dirents.size());
+	for (std::size_t i = 0; i < dirents.size(); ++i)
+		inode_ids[i] = dirents[i].inode_n;
+
+	std::vector<inode_t> inodes;
+	const auto ret = read_inodes(inode_ids, &inodes);
+	if (ret < 0)
+		return ret;
+
+	entries_out->clear();
+	entries_out->reserve(dirents.size());
+	for (std::size_t i = 0; i < dirents.size(); ++i)
+		entries_out->push_back(direntplus_t{dirents[i], inodes[i]});
+
+	return dirents.size();
 }
 
-int file_system::get_inode_by_path(const std::string& path, uint32_t* inode_out)
+int file_system::rewind_dir(did_t dir_id)
 {
-	if (path == "/")
+	if (dir_id >= STORAGE_SIZE)
+		return EDID_INVALID_ID;
+	std::lock_guard<std::mutex> did_lock(did_locks_[dir_id]);
+	try
 	{
-		(*inode_out) = INODE_ROOT_ID;
+		get_dir(dir_id).rewind();
 		return 0;
 	}
-	if (path.length() == 0)
+	catch (std::exception&)
 	{
-		(*inode_out) = cwd_.get_file()->get_inode_n();
-		return 0;
+		return EDID_INVALID_ID;
+	}
+}
+
+file& file_system::get_file(const fid_t fid)
+{
+	std::lock_guard<std::mutex> lock(handles_lock_);
+	return files_[fid];
+}
+
+int file_system::copy_file(const fid_t fid, file* file_out)
+{
+	if (fid >= STORAGE_SIZE)
+		return EFID_INVALID_ID;
+	// only held for the copy, the fid stays usable by others during the i/o
+	std::lock_guard<std::mutex> fid_lock(fid_locks_[fid]);
+	try
+	{
+		// the copy bypasses the buffer, so what the inode holds goes out first
+		auto& f = get_file(fid);
+		const auto ret = flush_inode(f.get_inode_n());
+		if (ret < 0)
+			return ret;
+		*file_out = f;
+		return 0;
+	}
+	catch (std::exception&)
+	{
+		return EFID_INVALID_ID;
+	}
+}
+
+int file_system::sync_file(const fid_t fid, const bool data_only)
+{
+	if (fid >= STORAGE_SIZE)
+		return EFID_INVALID_ID;
+	uint32_t inode;
+	{
+		std::lock_guard<std::mutex> fid_lock(fid_locks_[fid]);
+		try
+		{
+			auto& f = get_file(fid);
+			inode = f.get_inode_n();
+			table_guard inode_lock(inode_locks_, {inode}, true);
+			const auto ret = f.flush(data_only);
+			if (ret < 0)
+				return ret;
+		}
+		catch (std::exception&)
+		{
+			return EFID_INVALID_ID;
+		}
+	}
+
+	map_pages_t pages;
+	{
+		std::lock_guard<std::mutex> lock(touched_lock_);
+		const auto it = touched_pages_.find(inode);
+		if (it != touched_pages_.end())
+		{
+			pages = std::move(it->second);
+			touched_pages_.erase(it);
+		}
+	}
+	auto ret = write_map_pages(super_block_.inodemap_first_block, inode_map_, pages.inode);
+	if (ret >= 0)
+		ret = write_map_pages(super_block_.spacemap_first_block, space_map_, pages.space);
+	if (ret >= 0 && !pages.frag.empty())
+	{
+		std::lock_guard<std::mutex> sm_lock(sm_lock_);
+		ret = write_map_pages(super_block_.fragmap_first_block, frag_map_->get_map(), pages.frag);
+	}
+	if (ret < 0)
+	{
+		retouch(inode, pages);
+		return ret;
+	}
+	ret = disk_.flush(data_only);
+	return ret < 0 ? ret : take_buffer_error(inode);
+}
+
+int file_system::flush_inode(const uint32_t inode, const bool data_only)
+{
+	if (find_buffer(inode) == nullptr)
+		return 0;
+	table_guard inode_lock(inode_locks_, {inode}, true);
+	file f;
+	f.reopen(inode, this);
+	return f.flush(data_only);
+}
+
+write_buffer_t& file_system::get_buffer(const uint32_t inode)
+{
+	std::lock_guard<std::mutex> lock(buffers_lock_);
+	auto it = buffers_.find(inode);
+	if (it == buffers_.end())
+	{
+		it = buffers_.emplace(inode, write_buffer_t()).first;
+		it->second.since = std::chrono::steady_clock::now();
+	}
+	return it->second;
+}
+
+write_buffer_t* file_system::find_buffer(const uint32_t inode)
+{
+	std::lock_guard<std::mutex> lock(buffers_lock_);
+	const auto it = buffers_.find(inode);
+	return it == buffers_.end() ? nullptr : &it->second;
+}
+
+void file_system::drop_buffer(const uint32_t inode)
+{
+	std::lock_guard<std::mutex> lock(buffers_lock_);
+	const auto it = buffers_.find(inode);
+	if (it == buffers_.end())
+		return;
+	for (const auto& block : it->second.blocks)
+		dirty_bytes_ -= block.second.data.size();
+	buffers_.erase(it);
+}
+
+std::vector<uint32_t> file_system::buffered_inodes(const std::chrono::steady_clock::time_point since)
+{
+	std::vector<uint32_t> inodes;
+	std::lock_guard<std::mutex> lock(buffers_lock_);
+	for (const auto& buf : buffers_)
+		if (buf.second.since <= since)
+			inodes.push_back(buf.first);
+	return inodes;
+}
+
+int file_system::take_buffer_error(const uint32_t inode)
+{
+	std::lock_guard<std::mutex> lock(buffers_lock_);
+	const auto it = buffer_errors_.find(inode);
+	if (it == buffer_errors_.end())
+		return 0;
+	const auto error = it->second;
+	buffer_errors_.erase(it);
+	return error;
+}
+
+bool file_system::is_open(const uint32_t inode, const fid_t except)
+{
+	std::lock_guard<std::mutex> lock(handles_lock_);
+	for (fid_t fid = 0; fid < STORAGE_SIZE; ++fid)
+	{
+		try
+		{
+			if (fid != except && files_[fid].get_inode_n() == inode)
+				return true;
+		}
+		catch (std::exception&)
+		{
+		}
+	}
+	return false;
+}
+
+directory& file_system::get_dir(const did_t did)
+{
+	std::lock_guard<std::mutex> lock(handles_lock_);
+	return dirs_[did];
+}
+
+directory file_system::get_cwd()
+{
+	std::lock_guard<std::mutex> lock(cwd_lock_);
+	return cwd_;
+}
+
+std::string file_system::concat_paths(const std::string& path1, const std::string& path2)
+{
+	if (path1.empty())
+		return path2;
+	if (path2.empty())
+		return path1;
+	if (path1[path1.length() - 1] == '/' && path2[0] == '/')
+		return path1 + path2.substr(1);
+	if (path1[path1.length() - 1] == '/' || path2[0] == '/')
+		return path1 + path2;
+	return path1 + "/" + path2;
+}
+
+int file_system::get_inode_by_path(const std::string& path, uint32_t* inode_out)
+{
+	if (path == "/")
+	{
+		(*inode_out) = INODE_ROOT_ID;
+		return 0;
+	}
+	if (path.length() == 0)
+	{
+		(*inode_out) = get_cwd().get_file()->get_inode_n();
+		return 0;
 	}
 
 	auto tokens = split(path, '/');
 	directory curr_dir;
 
 	if (tokens[0].length() != 0)
-		curr_dir = cwd_;
+		curr_dir = get_cwd();
 	else
 		curr_dir = directory(INODE_ROOT_ID, this);
 
 	uint32_t i = (tokens[0].length() != 0 ? 0 : 1);
 	for (; i < tokens.size() - 1; ++i)
 	{
-		const auto dirent = curr_dir.find(tokens[i]);
+		dirent_t dirent;
+		{
+			table_guard inode_lock(inode_locks_, {curr_dir.get_file()->get_inode_n()}, false);
+			dirent = curr_dir.find(tokens[i]);
+		}
 		// if a dir does not exist
 		if (dirent.inode_n == INVALID_INODE)
 		{
@@ -666,7 +1445,11 @@ int file_system::get_inode_by_path(const std::string& path, uint32_t* inode_out)
 
 	if (tokens[tokens.size() - 1].length() != 0)
 	{
-		const auto ret = curr_dir.find(tokens[tokens.size() - 1]);
+		dirent_t ret;
+		{
+			table_guard inode_lock(inode_locks_, {curr_dir.get_file()->get_inode_n()}, false);
+			ret = curr_dir.find(tokens[tokens.size() - 1]);
+		}
 		if (ret.inode_n == INVALID_INODE)
 		{
 			(*inode_out) = INVALID_INODE;
@@ -685,65 +1468,81 @@ int file_system::do_unlink(const std::string& file_name, bool force)
 	if (file_name.empty())
 		return EDIR_INVALID_PATH;
 
-	uint32_t file_inode;
 	uint32_t last_dir_inode;
 	auto vec = get_dir_and_file(file_name);
 	const auto dir_path = vec[0];
 	const auto small_name = vec[1];
 	// get dir inode
 	auto ret = get_inode_by_path(dir_path, &last_dir_inode);
-	if (ret < 0)
-		return ret;
-	// get file inode
-	ret = get_inode_by_path(file_name, &file_inode);
 	if (ret < 0)
 		return ret;
 
 	directory dir = directory(last_dir_inode, this);
 
-	// get the counter down
-	inode_t inode;
-	ret = read_inode(file_inode, &inode);
-	if (ret < 0)
-		return ret;
+	for (;;)
+	{
+		// get file inode
+		uint32_t file_inode;
+		{
+			table_guard inode_lock(inode_locks_, {last_dir_inode}, false);
+			file_inode = dir.find(small_name).inode_n;
+		}
+		if (file_inode == INVALID_INODE)
+			return EDIR_FILE_NOT_FOUND;
 
-	if (!force && inode.f_type == file_type::dir)
-		return EFIL_WRONG_TYPE;
+		// lock both in order, then make sure the entry did not change in between.
+		// a hashed directory is only held shared, a stripe it shares with the file is exclusive
+		const auto hashed = dir.is_hashed();
+		table_guard inode_lock(inode_locks_, {last_dir_inode}, {file_inode, hashed ? file_inode : last_dir_inode});
+		table_guard bucket_lock(bucket_locks_, {bucket_key(last_dir_inode, dir.bucket_of(small_name))}, true);
+		if (dir.find(small_name).inode_n != file_inode)
+			continue;
 
-	const auto curr_time = time(nullptr);
-	inode.access_time = curr_time;
-	inode.change_time = curr_time;
-	--inode.links_count;
+		// get the counter down
+		inode_t inode;
+		ret = read_inode(file_inode, &inode);
+		if (ret < 0)
+			return ret;
 
-	// check if links count is 0 (or somehow less than 0)
-	if (inode.links_count == 0)
-	{
-		if (inode.links_count > super_block_.inodes_count)
+		if (!force && inode.f_type == file_type::dir)
+			return EFIL_WRONG_TYPE;
+
+		const auto curr_time = time(nullptr);
+		inode.access_time = curr_time;
+		inode.change_time = curr_time;
+		--inode.links_count;
+
+		// check if links count is 0 (or somehow less than 0)
+		if (inode.links_count == 0)
 		{
-			std::cerr << "inode " << file_inode << " has link count: " << inode.links_count << std::endl;
+			if (inode.links_count > super_block_.inodes_count)
+			{
+				std::cerr << "inode " << file_inode << " has link count: " << inode.links_count << std::endl;
+			}
+			// clear the space, and the buffer so that it never reaches the next owner of the inode
+			file tmp = file(file_inode, this);
+			tmp.trunc(0);
+			drop_buffer(file_inode);
+			take_buffer_error(file_inode);
+			// clear the inode
+			set_inode_status(file_inode, false);
 		}
-		// clear the space
-		file tmp = file(file_inode, this);
-		tmp.trunc(0);
-		// clear the inode
-		set_inode_status(file_inode, false);
-	}
-	else
-	{
-		ret = write_inode(file_inode, &inode);
+		else
+		{
+			ret = write_inode(file_inode, &inode);
+			if (ret < 0)
+				return ret;
+		}
+		// remove file from directory
+		ret = dir.remove_entry(small_name);
 		if (ret < 0)
 			return ret;
-	}
-	// remove file from directory
-	ret = dir.remove_entry(small_name);
-	if (ret < 0)
-		return ret;
 
-	return 0;
+		return 0;
+	}
 }
 
-int file_system::do_create(const std::string& file_name, file_type f_type,
-                           uint32_t* inode_out, uint32_t* prev_dir_inode_out)
+int file_system::do_create(const std::string& file_name, file_type f_type)
 {
 	auto vec = get_dir_and_file(file_name);
 	const auto dir_path = vec[0];
@@ -764,6 +1563,11 @@ int file_system::do_create(const std::string& file_name, file_type f_type,
 		return EDIR_INVALID_PATH;
 	}
 
+	// a hashed directory is shared, the bucket of the name is what gets written
+	const auto hashed = dir.is_hashed();
+	table_guard inode_lock(inode_locks_, {last_dir_inode}, !hashed);
+	table_guard bucket_lock(bucket_locks_, {bucket_key(last_dir_inode, dir.bucket_of(small_name))}, true);
+
 	// check if file exists
 	const auto dirent = dir.find(small_name);
 	if (dirent.inode_n != INVALID_INODE)
@@ -771,25 +1575,52 @@ int file_system::do_create(const std::string& file_name, file_type f_type,
 		return EDIR_FILE_EXISTS;
 	}
 
-	const auto inode_num = get_free_inode();
+	// splitting moves entries between buckets and may grow the table
+	if (!dir.has_room(small_name))
+	{
+		bucket_lock.unlock();
+		inode_lock.unlock();
+		{
+			table_guard split_lock(inode_locks_, {last_dir_inode}, true);
+			if (!dir.has_room(small_name))
+			{
+				ret = dir.split_bucket(small_name);
+				if (ret < 0)
+					return ret;
+			}
+		}
+		return do_create(file_name, f_type);
+	}
+
+	const auto inode_num = alloc_inode(last_dir_inode, f_type);
 	if (inode_num == INVALID_INODE)
 		return EIND_OUT_OF_INODES;
 	auto inode = get_new_inode(f_type, 0755);
+	inode.flags = get_small_data_flag(f_type);
 
 	ret = write_inode(inode_num, &inode);
-
 	if (ret < 0)
+	{
+		set_inode_status(inode_num, false);
 		return ret;
+	}
 
-	set_inode_status(inode_num, true);
-	ret = dir.add_entry(inode_num, small_name);
+	// a new directory is complete before any other thread can reach it
+	if (f_type == file_type::dir)
+	{
+		auto new_dir = directory(inode_num, this);
+		ret = new_dir.add_entry(inode_num, ".");
+		if (ret >= 0)
+			ret = new_dir.add_entry(last_dir_inode, "..");
+	}
+	if (ret >= 0)
+		ret = dir.add_entry(inode_num, small_name);
 	if (ret < 0)
+	{
+		file(inode_num, this).trunc(0);
+		set_inode_status(inode_num, false);
 		return ret;
-
-	if (inode_out != nullptr)
-		(*inode_out) = inode_num;
-	if (prev_dir_inode_out != nullptr)
-		(*prev_dir_inode_out) = dir.get_file()->get_inode_n();
+	}
 
 	return 0;
 }
@@ -800,82 +1631,50 @@ int file_system::do_create(const std::string& file_name, file_type f_type,
  * \param start_block starting block
  * \param buffer buffer to read info into
  * \param size size in blocks
+ * \param kind what the blocks hold
  * \return error code
  */
-int file_system::read_block(uint32_t start_block, char* buffer, const std::size_t size)
+int file_system::read_block(uint32_t start_block, char* buffer, const std::size_t size, const block_kind kind,
+                            const bool prefetch)
 {
 	const auto block_bytes = super_block_.block_size * SECTOR_SIZE;
-	std::tuple<uint32_t, std::size_t> curr_read;
+	auto& cache = cache_of(kind);
 	int ret;
 
 	//std::cout << "r:" << start_block << ":" << size << std::endl;
 
-	// check through all the blocks and see if any of those are in cache
-	auto prev_push = static_cast<std::size_t>(-1);
-	for (std::size_t i = 0; i < size; ++i)
+	std::vector<uint64_t> epochs;
+	std::size_t i = 0;
+	while (i < size)
 	{
 		const auto offset = i * block_bytes;
-		if (cache_.contains(start_block + i))
-		{
-			// check if we need to read from mem
-			if (prev_push != static_cast<std::size_t>(-1))
-			{
-				const auto b_start = std::get<0>(curr_read);
-				const auto b_size = std::get<1>(curr_read);
-
-				const auto sector = super_block_.block_offset + b_start * super_block_.block_size;
-				const auto mem_offset = (b_start - start_block) * block_bytes;
-
-				ret = disk_.read_block(sector, buffer + mem_offset, b_size);
-				if (ret < 0)
-					return ret;
-				// place it in cache
-				for (std::size_t j = 0; j < b_size; ++j)
-				{
-					auto vec = std::vector<char>(block_bytes);
-					memcpy(vec.data(), buffer + (b_start - start_block + j) * block_bytes, block_bytes);
-					cache_.insert(b_start + j, vec);
-				}
-
-				prev_push = static_cast<std::size_t>(-1);
-			}
-			// if in cache, just copy it straight inwards
-			memcpy(buffer + offset, cache_.get(start_block + i).data(), block_bytes);
-		}
-		else
+		// if in cache, just copy it straight inwards
+		if (cache.read(start_block + i, buffer + offset))
 		{
-			if (i != 0 && i == prev_push + 1)
-				std::get<1>(curr_read)++;
-			else
-				curr_read = std::make_tuple(start_block + i, 1);
-			prev_push = i;
+			++i;
+			continue;
 		}
-	}
-
 
-	// check if we need to read from mem
-	if (prev_push != static_cast<std::size_t>(-1))
-	{
-		const auto b_start = std::get<0>(curr_read);
-		const auto b_size = std::get<1>(curr_read);
+		// read the whole run of missing blocks at once
+		std::size_t run = 1;
+		while (i + run < size && !cache.contains(start_block + i + run))
+			++run;
 
-		const auto sector = super_block_.block_offset + b_start * super_block_.block_size;
-		const auto mem_offset = (b_start - start_block) * block_bytes;
+		epochs.resize(run);
+		for (std::size_t j = 0; j < run; ++j)
+			epochs[j] = cache.epoch(start_block + i + j);
 
-		ret = disk_.read_block(sector, buffer + mem_offset, b_size * super_block_.block_size);
+		const auto sector = super_block_.block_offset + (start_block + i) * super_block_.block_size;
+		ret = disk_.read_block(sector, buffer + offset, run * super_block_.block_size);
 		if (ret < 0)
 			return ret;
+
 		// place it in cache
-		for (std::size_t j = 0; j < b_size; ++j)
-		{
-			auto vec = std::vector<char>(block_bytes);
-			memcpy(vec.data(), buffer + (b_start - start_block + j) * block_bytes, block_bytes);
-			cache_.insert(b_start + j, vec);
-		}
+		for (std::size_t j = 0; j < run; ++j)
+			cache.fill(start_block + i + j, buffer + offset + j * block_bytes, epochs[j], prefetch);
+		i += run;
 	}
 
-	disk_.read_block(super_block_.block_offset + start_block * super_block_.block_size, buffer,
-	                 size * super_block_.block_size);
 	return size * block_bytes;
 }
 
@@ -884,130 +1683,390 @@ int file_system::read_block(uint32_t start_block, char* buffer, const std::size_
 * \param start_block starting block
 * \param buffer buffer to write info from
 * \param size size in blocks
+* \param kind what the blocks hold
 * \return error code
 */
-int file_system::write_block(uint32_t start_block, const char* buffer, std::size_t size)
+int file_system::write_block(uint32_t start_block, const char* buffer, std::size_t size, const block_kind kind)
 {
-	const auto block_bytes = super_block_.block_size * SECTOR_SIZE;
-
 	//std::cout << "w:" << start_block << ":" << size << std::endl;
 
-	for (std::size_t i = 0; i < size; ++i)
+	const auto ret = cache_of(kind).write(start_block, size, buffer, [&]
 	{
-		auto vec = std::vector<char>(block_bytes);
-		memcpy(vec.data(), buffer + i * block_bytes, block_bytes);
-		cache_.insert(start_block + i, vec);
+		return disk_.write_block(super_block_.block_offset + start_block * super_block_.block_size,
+		                         buffer, size * super_block_.block_size);
+	});
+
+	// the inode table and the maps never hold anything else
+	if (kind != block_kind::inode && kind != block_kind::map)
+	{
+		auto& other = kind == block_kind::data ? meta_cache_ : cache_;
+		for (std::size_t i = 0; i < size; ++i)
+			other.invalidate(start_block + i);
 	}
+	return ret;
+}
 
-	return disk_.write_block(super_block_.block_offset + start_block * super_block_.block_size,
-	                         buffer, size * super_block_.block_size);
+int file_system::read_data_block(uint32_t start_block, char* buffer, std::size_t size, const block_kind kind)
+{
+	return read_block(super_block_.data_first_block + start_block, buffer, size, kind);
 }
 
-int file_system::read_data_block(uint32_t start_block, char* buffer, std::size_t size)
+int file_system::write_data_block(uint32_t start_block, const char* buffer, std::size_t size, const block_kind kind)
 {
-	return read_block(super_block_.data_first_block + start_block, buffer, size);
+	return write_block(super_block_.data_first_block + start_block, buffer, size, kind);
 }
 
-int file_system::write_data_block(uint32_t start_block, const char* buffer, std::size_t size)
+int file_system::prefetch_block(const uint32_t start_block, const std::size_t size, const block_kind kind)
 {
-	return write_block(super_block_.data_first_block + start_block, buffer, size);
+	const auto block_bytes = super_block_.block_size * SECTOR_SIZE;
+	auto& cache = cache_of(kind);
+	std::vector<char> buffer;
+
+	std::size_t i = 0;
+	while (i < size)
+	{
+		if (cache.contains(start_block + i))
+		{
+			++i;
+			continue;
+		}
+
+		std::size_t run = 1;
+		while (i + run < size && !cache.contains(start_block + i + run))
+			++run;
+
+		buffer.resize(run * block_bytes);
+		const auto ret = read_block(start_block + i, buffer.data(), run, kind, true);
+		if (ret < 0)
+			return ret;
+		i += run;
+	}
+	return 0;
 }
 
-int file_system::read_object(uint32_t start_block, std::size_t offset, std::size_t obj_size, void* buffer)
+int file_system::prefetch_data_block(const uint32_t start_block, const std::size_t size, const block_kind kind)
 {
-	auto curr_block = start_block;
-	const auto block_size_bytes = super_block_.block_size * SECTOR_SIZE;
-	int ret;
+	return prefetch_block(super_block_.data_first_block + start_block, size, kind);
+}
 
-	if (offset + obj_size <= (block_size_bytes * DATABUFFER_SIZE))
+int file_system::pin_data_block(const uint32_t start_block, const std::size_t size, const block_kind kind)
+{
+	auto& cache = cache_of(kind);
+	const auto first = super_block_.data_first_block + start_block;
+	for (std::size_t i = 0; i < size; ++i)
 	{
-		ret = read_block(curr_block, data_buffer_, DATABUFFER_SIZE);
+		// one at a time, a long run could evict its own start before it is pinned;
+		// another thread may evict it between the two steps as well, so that is retried
+		auto ret = ECACHE_PIN_FULL;
+		for (auto tries = 0; tries < 3 && ret == ECACHE_PIN_FULL; ++tries)
+		{
+			ret = prefetch_data_block(start_block + i, 1, kind);
+			if (ret >= 0)
+				ret = cache.pin(first + i) ? 0 : ECACHE_PIN_FULL;
+		}
 		if (ret < 0)
+		{
+			while (i-- > 0)
+				cache.unpin(first + i);
 			return ret;
-		memcpy(buffer, data_buffer_ + offset, obj_size);
-		return 0;
+		}
 	}
+	return 0;
+}
+
+void file_system::unpin_data_block(uint32_t start_block, const std::size_t size, const block_kind kind)
+{
+	auto& cache = cache_of(kind);
+	start_block += super_block_.data_first_block;
+	for (std::size_t i = 0; i < size; ++i)
+		cache.unpin(start_block + i);
+}
+
+void file_system::forget_data_block(uint32_t block)
+{
+	block += super_block_.data_first_block;
+	cache_.invalidate(block);
+	meta_cache_.invalidate(block);
+}
+
+void file_system::demote_data_block(uint32_t start_block, const std::size_t size, const block_kind kind)
+{
+	auto& cache = cache_of(kind);
+	start_block += super_block_.data_first_block;
+	for (std::size_t i = 0; i < size; ++i)
+		cache.demote(start_block + i);
+}
 
+void file_system::drop_data_block(uint32_t start_block, const std::size_t size, const block_kind kind)
+{
+	auto& cache = cache_of(kind);
+	start_block += super_block_.data_first_block;
+	for (std::size_t i = 0; i < size; ++i)
+		cache.drop(start_block + i);
+}
+
+int file_system::read_object(uint32_t start_block, std::size_t offset, std::size_t obj_size, void* buffer,
+                             const block_kind kind)
+{
+	const auto block_size_bytes = super_block_.block_size * SECTOR_SIZE;
+	auto curr_block = start_block;
+	int ret;
+
+	scratch_block block(scratch_);
 	std::size_t obj_pos = 0;
 	while (obj_pos < obj_size)
 	{
-		ret = read_block(curr_block, data_buffer_, DATABUFFER_SIZE);
+		// whole blocks go straight to the caller
+		if (offset == 0 && obj_size - obj_pos >= block_size_bytes)
+		{
+			const auto count = (obj_size - obj_pos) / block_size_bytes;
+			ret = read_block(curr_block, reinterpret_cast<char *>(buffer) + obj_pos, count, kind);
+			if (ret < 0)
+				return ret;
+			obj_pos += count * block_size_bytes;
+			curr_block += count;
+			continue;
+		}
+
+		ret = read_block(curr_block, block.data(), 1, kind);
 		if (ret < 0)
 			return ret;
 
-		const auto copy_size = ((obj_size - obj_pos < block_size_bytes * DATABUFFER_SIZE - offset)
+		const auto copy_size = ((obj_size - obj_pos < block_size_bytes - offset)
 			                        ? obj_size - obj_pos
-			                        : block_size_bytes * DATABUFFER_SIZE - offset);
-		memcpy(reinterpret_cast<char *>(buffer) + obj_pos, data_buffer_ + offset, copy_size);
+			                        : block_size_bytes - offset);
+		memcpy(reinterpret_cast<char *>(buffer) + obj_pos, block.data() + offset, copy_size);
 		obj_pos += copy_size;
 		offset = 0;
-		curr_block += DATABUFFER_SIZE;
+		++curr_block;
 	}
 	return 0;
 }
 
 int file_system::write_object(const uint32_t start_block, std::size_t offset, const std::size_t obj_size,
-                              const void* buffer)
+                              const void* buffer, const block_kind kind)
 {
-	auto curr_block = start_block;
 	const auto block_size_bytes = super_block_.block_size * SECTOR_SIZE;
+	auto curr_block = start_block;
 	int ret;
 
-	if (offset + obj_size <= block_size_bytes * DATABUFFER_SIZE)
-	{
-		ret = read_block(curr_block, data_buffer_, DATABUFFER_SIZE);
-		if (ret < 0)
-			return ret;
-		memcpy(data_buffer_ + offset, buffer, obj_size);
-		write_block(curr_block, data_buffer_, DATABUFFER_SIZE);
-		return obj_size;
-	}
-
+	scratch_block block(scratch_);
 	std::size_t obj_pos = 0;
 	while (obj_pos < obj_size)
 	{
-		const auto copy_size = ((obj_size - obj_pos < block_size_bytes * DATABUFFER_SIZE - offset)
-			                        ? obj_size - obj_pos
-			                        : block_size_bytes * DATABUFFER_SIZE - offset);
-
 		// if copy size is adjacent with block size, we dont have to read anything
-		if ((copy_size % (block_size_bytes * DATABUFFER_SIZE)) == 0)
+		if (offset == 0 && obj_size - obj_pos >= block_size_bytes)
 		{
-			ret = write_block(curr_block, reinterpret_cast<const char *>(buffer) + obj_pos, copy_size / block_size_bytes);
-
+			const auto count = (obj_size - obj_pos) / block_size_bytes;
+			ret = write_block(curr_block, reinterpret_cast<const char *>(buffer) + obj_pos, count, kind);
 			if (ret < 0)
 				return ret;
-
-			obj_pos += copy_size;
-			curr_block += copy_size / block_size_bytes;
+			obj_pos += count * block_size_bytes;
+			curr_block += count;
 			continue;
 		}
 
-		ret = read_block(curr_block, data_buffer_, DATABUFFER_SIZE);
+		const auto copy_size = ((obj_size - obj_pos < block_size_bytes - offset)
+			                        ? obj_size - obj_pos
+			                        : block_size_bytes - offset);
+
+		// objects of different owners can share a block, e.g. inodes
+		table_guard block_lock(block_locks_, {curr_block}, true);
+		ret = read_block(curr_block, block.data(), 1, kind);
 		if (ret < 0)
 			return ret;
 
-		memcpy(data_buffer_ + offset, reinterpret_cast<const char *>(buffer) + obj_pos, copy_size);
+		memcpy(block.data() + offset, reinterpret_cast<const char *>(buffer) + obj_pos, copy_size);
 
-		ret = write_block(curr_block, data_buffer_, DATABUFFER_SIZE);
+		ret = write_block(curr_block, block.data(), 1, kind);
 		if (ret < 0)
 			return ret;
 
 		obj_pos += copy_size;
 		offset = 0;
-		curr_block += DATABUFFER_SIZE;
+		++curr_block;
 	}
 	return obj_size;
 }
 
-int file_system::read_data_object(uint32_t start_block, std::size_t offset, std::size_t obj_size, void* buffer)
+int file_system::read_data_object(uint32_t start_block, std::size_t offset, std::size_t obj_size, void* buffer,
+                                  const block_kind kind)
+{
+	return read_object(super_block_.data_first_block + start_block, offset, obj_size, buffer, kind);
+}
+
+int file_system::write_data_object(uint32_t start_block, std::size_t offset, std::size_t obj_size, const void* buffer,
+                                   const block_kind kind)
+{
+	return write_object(super_block_.data_first_block + start_block, offset, obj_size, buffer, kind);
+}
+
+int file_system::save_hot_set() const
+{
+	const auto data = cache_.hot_blocks();
+	const auto meta = meta_cache_.hot_blocks();
+	const hot_set_header_t header{HOT_SET_MAGIC, super_block_.blocks_count, super_block_.block_size,
+	                              static_cast<uint32_t>(data.size()), static_cast<uint32_t>(meta.size())};
+
+	std::ofstream out(hot_set_file_, std::ofstream::binary | std::ofstream::trunc);
+	if (!out)
+		return EP_OPFIL;
+	out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char *>(data.data()), data.size() * sizeof(uint32_t));
+	out.write(reinterpret_cast<const char *>(meta.data()), meta.size() * sizeof(uint32_t));
+	return out ? 0 : EP_WRFIL;
+}
+
+void file_system::load_hot_set()
+{
+	std::ifstream in(hot_set_file_, std::ifstream::binary);
+	hot_set_header_t header{};
+	if (!in || !in.read(reinterpret_cast<char *>(&header), sizeof(header)))
+		return;
+
+	// a list saved for another image would only waste reads
+	const auto blocks_end = super_block_.data_first_block + super_block_.blocks_count;
+	if (header.magic != HOT_SET_MAGIC || header.blocks_count != super_block_.blocks_count ||
+		header.block_size != super_block_.block_size ||
+		header.data_count > blocks_end || header.meta_count > blocks_end)
+		return;
+
+	std::vector<uint32_t> data(header.data_count);
+	std::vector<uint32_t> meta(header.meta_count);
+	if (!in.read(reinterpret_cast<char *>(data.data()), data.size() * sizeof(uint32_t)) ||
+		!in.read(reinterpret_cast<char *>(meta.data()), meta.size() * sizeof(uint32_t)))
+		return;
+
+	// past what the cache holds now, the least used blocks would evict the rest
+	data.resize(std::min(data.size(), cache_.get_capacity()));
+	meta.resize(std::min(meta.size(), meta_cache_.get_capacity()));
+	const auto outside = [blocks_end](const uint32_t block) { return block >= blocks_end; };
+	data.erase(std::remove_if(data.begin(), data.end(), outside), data.end());
+	meta.erase(std::remove_if(meta.begin(), meta.end(), outside), meta.end());
+
+	warming_ = true;
+	warm_thread_ = std::thread([this, data, meta]
+	{
+		warm(data, block_kind::data);
+		// only the partition matters here
+		warm(meta, block_kind::inode);
+		warming_ = false;
+	});
+}
+
+// in ascending order, a single read for each run of adjacent blocks
+void file_system::warm(std::vector<uint32_t> blocks, const block_kind kind)
+{
+	std::sort(blocks.begin(), blocks.end());
+	std::size_t i = 0;
+	while (i < blocks.size() && !warm_stop_)
+	{
+		std::size_t run = 1;
+		while (i + run < blocks.size() && run < HOT_SET_BATCH_MAX && blocks[i + run] == blocks[i] + run)
+			++run;
+		if (prefetch_block(blocks[i], run, kind) < 0)
+			return;
+		i += run;
+	}
+}
+
+void file_system::stop_warming()
+{
+	warm_stop_ = true;
+	if (warm_thread_.joinable())
+		warm_thread_.join();
+	warm_stop_ = false;
+	warming_ = false;
+}
+
+void file_system::set_writeback(const bool enabled)
 {
-	return read_object(super_block_.data_first_block + start_block, offset, obj_size, buffer);
+	writeback_ = enabled;
+	if (!enabled)
+		stop_writeback();
+	else if (disk_.is_open())
+		start_writeback();
 }
 
-int file_system::write_data_object(uint32_t start_block, std::size_t offset, std::size_t obj_size, const void* buffer)
+void file_system::start_writeback()
 {
-	return write_object(super_block_.data_first_block + start_block, offset, obj_size, buffer);
+	std::lock_guard<std::mutex> lock(writeback_lock_);
+	if (!writeback_stop_)
+		return;
+	writeback_stop_ = false;
+	writeback_thread_ = std::thread([this] { writeback(); });
+}
+
+void file_system::stop_writeback()
+{
+	{
+		std::lock_guard<std::mutex> lock(writeback_lock_);
+		writeback_stop_ = true;
+		writeback_cv_.notify_all();
+	}
+	if (writeback_thread_.joinable())
+		writeback_thread_.join();
+}
+
+void file_system::writeback()
+{
+	auto maps_written = std::chrono::steady_clock::now();
+	std::unique_lock<std::mutex> lock(writeback_lock_);
+	while (!writeback_stop_)
+	{
+		writeback_cv_.wait_for(lock, std::chrono::milliseconds(WRITEBACK_INTERVAL), [this]
+		{
+			return writeback_stop_ || writeback_kick_;
+		});
+		if (writeback_stop_)
+			break;
+		writeback_kick_ = false;
+		lock.unlock();
+		std::unique_lock<std::mutex> round_lock(writeback_round_lock_);
+
+		const auto now = std::chrono::steady_clock::now();
+		const auto age = std::chrono::milliseconds(writeback_age_.load());
+		// past the ratio every buffer goes, otherwise only the old ones
+		const auto all = dirty_bytes_ > dirty_threshold(dirty_ratio_);
+		for (const auto inode : buffered_inodes(all ? now : now - age))
+		{
+			const auto ret = flush_inode(inode);
+			if (ret < 0)
+			{
+				std::lock_guard<std::mutex> errors_lock(buffers_lock_);
+				buffer_errors_[inode] = ret;
+			}
+		}
+		if (now - maps_written >= age)
+		{
+			const auto ret = sync_maps();
+			if (ret < 0)
+				writeback_error_ = ret;
+			maps_written = now;
+		}
+
+		round_lock.unlock();
+		lock.lock();
+		++writeback_rounds_;
+		writeback_cv_.notify_all();
+	}
+}
+
+void file_system::throttle()
+{
+	const auto dirty = dirty_bytes_.load();
+	if (dirty <= dirty_threshold(dirty_ratio_))
+		return;
+
+	std::unique_lock<std::mutex> lock(writeback_lock_);
+	if (writeback_stop_)
+		return;
+	writeback_kick_ = true;
+	writeback_cv_.notify_all();
+	if (dirty <= dirty_threshold(dirty_limit_))
+		return;
+	const auto round = writeback_rounds_;
+	writeback_cv_.wait(lock, [this, round] { return writeback_stop_ || writeback_rounds_ != round; });
 }
 
 int file_system::write_inode(uint32_t inode_id, const inode_t* inode)
@@ -1016,10 +2075,10 @@ int file_system::write_inode(uint32_t inode_id, const inode_t* inode)
 	inode->access_time = t;
 	inode->change_time = t;
 
-	const auto block = super_block_.inode_first_block + inode_id * sizeof(inode_t) / (super_block_.block_size * SECTOR_SIZE
-	);
-	return write_object(block, (inode_id * sizeof(inode_t)) % (super_block_.block_size * SECTOR_SIZE), sizeof(inode_t),
-	                    inode);
+	const auto block_bytes = super_block_.block_size * SECTOR_SIZE;
+	const auto pos = static_cast<std::size_t>(inode_id) * super_block_.inode_size;
+	return write_object(super_block_.inode_first_block + pos / block_bytes, pos % block_bytes,
+	                    super_block_.inode_size, inode, block_kind::inode);
 }
 
 int file_system::read_inode(uint32_t inode_id, inode_t* inode)
@@ -1028,16 +2087,103 @@ int file_system::read_inode(uint32_t inode_id, inode_t* inode)
 	{
 		return EIND_INVALID_INODE;
 	}
-	const auto sector = super_block_.inode_first_block + inode_id * sizeof(inode_t) / (super_block_.block_size *
-		SECTOR_SIZE);
-	const auto ret = read_object(sector, (inode_id * sizeof(inode_t)) % (super_block_.block_size * SECTOR_SIZE), sizeof(inode_t),
-	                   inode);
+	const auto block_bytes = super_block_.block_size * SECTOR_SIZE;
+	const auto pos = static_cast<std::size_t>(inode_id) * super_block_.inode_size;
+	const auto ret = read_object(super_block_.inode_first_block + pos / block_bytes, pos % block_bytes,
+	                             super_block_.inode_size, inode, block_kind::inode);
 	if (ret < 0)
 		return ret;
+	clean_inode(inode);
 	inode->access_time = time(nullptr);
 	return ret;
 }
 
+// images without inline data or fragments never wrote these fields
+void file_system::clean_inode(inode_t* inode) const
+{
+	if (has_feature(SB_FEAT_INLINE_DATA | SB_FEAT_FRAGMENTS | SB_FEAT_HASHED_DIRS))
+		return;
+	inode->flags = 0;
+	inode->data_size = 0;
+	inode->fragment = 0;
+}
+
+// where a new or emptied file keeps its first bytes
+uint8_t file_system::get_small_data_flag(const file_type f_type) const
+{
+	// buckets must be whole blocks
+	if (has_feature(SB_FEAT_HASHED_DIRS) && f_type == file_type::dir)
+		return INODE_FLAG_HASHED;
+	if (has_feature(SB_FEAT_INLINE_DATA))
+		return INODE_FLAG_INLINE;
+	// packed directories are read a whole block at a time
+	if (has_feature(SB_FEAT_FRAGMENTS) && f_type == file_type::regular)
+		return INODE_FLAG_FRAGMENT;
+	return 0;
+}
+
+/**
+ * \brief reads a set of inodes, fetching each inode table block only once
+ * \param inode_ids inodes to read, in any order, duplicates allowed
+ * \param inodes_out receives the inodes in the same order as inode_ids
+ * \return error code
+ */
+int file_system::read_inodes(const std::vector<uint32_t>& inode_ids, std::vector<inode_t>* inodes_out)
+{
+	const auto block_bytes = super_block_.block_size * SECTOR_SIZE;
+	const auto inode_size = super_block_.inode_size;
+	const auto now = time(nullptr);
+
+	// visit inodes in table order so neighbours share a block read
+	std::vector<std::size_t> order(inode_ids.size());
+	for (std::size_t i = 0; i < order.size(); ++i)
+	{
+		if (!inode_map_->get(inode_ids[i]))
+			return EIND_INVALID_INODE;
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), [&inode_ids](const std::size_t a, const std::size_t b)
+	{
+		return inode_ids[a] < inode_ids[b];
+	});
+
+	inodes_out->resize(inode_ids.size());
+	std::vector<char> buffer(INODE_BATCH_MAX * block_bytes);
+
+	std::size_t i = 0;
+	while (i < order.size())
+	{
+		// gather a run of inodes whose table blocks are adjacent
+		const auto run_start = static_cast<uint32_t>(static_cast<std::size_t>(inode_ids[order[i]]) * inode_size / block_bytes);
+		auto run_end = run_start;
+		auto j = i;
+		for (; j < order.size(); ++j)
+		{
+			const auto pos = static_cast<std::size_t>(inode_ids[order[j]]) * inode_size;
+			const auto first = static_cast<uint32_t>(pos / block_bytes);
+			const auto last = static_cast<uint32_t>((pos + inode_size - 1) / block_bytes);
+			if (first > run_end + 1 || last - run_start >= INODE_BATCH_MAX)
+				break;
+			run_end = std::max(run_end, last);
+		}
+
+		const auto ret = read_block(super_block_.inode_first_block + run_start, buffer.data(), run_end - run_start + 1,
+		                            block_kind::inode);
+		if (ret < 0)
+			return ret;
+
+		for (; i < j; ++i)
+		{
+			const auto pos = static_cast<std::size_t>(inode_ids[order[i]]) * inode_size;
+			auto& inode = (*inodes_out)[order[i]];
+			memcpy(&inode, buffer.data() + (pos - run_start * block_bytes), inode_size);
+			clean_inode(&inode);
+			inode.access_time = now;
+		}
+	}
+	return 0;
+}
+
 inode_t file_system::get_new_inode(const file_type f_type, const uint16_t permissions)
 {
 	const auto curr_time = time(nullptr);
@@ -1053,49 +2199,221 @@ inode_t file_system::get_new_inode(const file_type f_type, const uint16_t permis
 	return inode;
 }
 
-uint32_t file_system::get_free_inode() const
+uint32_t file_system::alloc_inode(const uint32_t parent_inode, const file_type f_type)
 {
-	const auto ret = inode_map_->find_first_of(false);
+	auto goal = group_of_inode(parent_inode);
+	if (f_type == file_type::dir)
+	{
+		// spread directory trees over the groups
+		for (uint32_t g = 0; g < super_block_.groups_count; ++g)
+		{
+			if (groups_[g].free_inodes > groups_[goal].free_inodes && groups_[g].free_blocks > 0)
+				goal = g;
+		}
+	}
+
+	const auto ret = alloc_bit(inode_map_, super_block_.inodes_per_group, goal,
+	                           &alloc_group_t::free_inodes, &alloc_group_t::inode_lock, &thread_alloc().inode_hint);
 	if (ret == std::numeric_limits<std::size_t>::max())
 		return INVALID_INODE;
+
+	count_free(&counter_shard_t::inodes, -1);
+	im_dirty_ = true;
+	touch_inode(static_cast<uint32_t>(ret));
 	return static_cast<uint32_t>(ret);
 }
 
+uint32_t file_system::group_of_inode(const uint32_t inode_num) const
+{
+	if (inode_num == INVALID_INODE)
+		return 0;
+	return std::min(inode_num / super_block_.inodes_per_group, super_block_.groups_count - 1);
+}
+
+/**
+ * \brief claims a clear bit of map, trying the groups from goal onwards
+ * \param per_group bits of map in each group
+ * \param free the group counter of map, decremented on success
+ * \param lock the group lock of map for locked mode
+ * \param hint where the calling thread's last search ended, for lock-free mode
+ * \return index of the bit, SIZE_MAX if all groups are full
+ */
+std::size_t file_system::alloc_bit(const space_map* map, const uint32_t per_group, const uint32_t goal,
+                                   std::atomic<int64_t> alloc_group_t::* free, std::mutex alloc_group_t::* lock,
+                                   std::size_t* hint)
+{
+	const auto groups = super_block_.groups_count;
+	const auto locked = alloc_mode_ == alloc_mode::locked;
+	// busy groups are passed over at first, so concurrent writers spread out
+	for (auto wait = !(locked && groups > 1); ; wait = true)
+	{
+		for (uint32_t n = 0; n < groups; ++n)
+		{
+			const auto g = (goal + n) % groups;
+			auto& group = groups_[g];
+			if ((group.*free).load(std::memory_order_relaxed) <= 0)
+				continue;
+
+			const auto first = static_cast<std::size_t>(g) * per_group;
+			const auto last = std::min<std::size_t>(first + per_group, map->get_bits_count());
+			if (first >= last)
+				continue;
+
+			auto ret = std::numeric_limits<std::size_t>::max();
+			if (!locked)
+			{
+				const auto start = (*hint >= first && *hint < last) ? *hint : first + *hint % (last - first);
+				ret = map->claim(start, first, last);
+				if (ret != std::numeric_limits<std::size_t>::max())
+					*hint = ret + 1;
+			}
+			else
+			{
+				std::unique_lock<std::mutex> group_lock(group.*lock, std::defer_lock);
+				if (wait)
+					group_lock.lock();
+				else if (!group_lock.try_lock())
+					continue;
+				ret = map->find_first_of(false, first, last);
+				map->set(true, ret);
+			}
+			if (ret != std::numeric_limits<std::size_t>::max())
+			{
+				(group.*free).fetch_sub(1, std::memory_order_relaxed);
+				return ret;
+			}
+		}
+		if (wait)
+			return std::numeric_limits<std::size_t>::max();
+	}
+}
+
+void file_system::reset_groups()
+{
+	const auto groups = super_block_.groups_count;
+	groups_.reset(groups ? new alloc_group_t[groups] : nullptr);
+	if (space_map_ == nullptr || inode_map_ == nullptr)
+		return;
+
+	for (uint32_t g = 0; g < groups; ++g)
+	{
+		const auto first_block = static_cast<std::size_t>(g) * super_block_.blocks_per_group;
+		const auto first_inode = static_cast<std::size_t>(g) * super_block_.inodes_per_group;
+		groups_[g].free_blocks = space_map_->count(false, first_block, first_block + super_block_.blocks_per_group);
+		groups_[g].free_inodes = inode_map_->count(false, first_inode, first_inode + super_block_.inodes_per_group);
+	}
+}
+
 super_block_t file_system::get_super_block() const
 {
-	return this->super_block_;
+	auto sb = this->super_block_;
+	int64_t blocks = 0;
+	int64_t inodes = 0;
+	for (const auto& shard : free_counts_)
+	{
+		blocks += shard.blocks.load(std::memory_order_relaxed);
+		inodes += shard.inodes.load(std::memory_order_relaxed);
+	}
+	sb.blocks_free = static_cast<uint32_t>(sb.blocks_free + blocks);
+	sb.inodes_free = static_cast<uint32_t>(sb.inodes_free + inodes);
+	return sb;
 }
 
-uint32_t file_system::get_free_block() const
+uint32_t file_system::alloc_block(const uint32_t near_inode)
 {
-	const auto ret = space_map_->find_first_of(false);
+	const auto ret = alloc_bit(space_map_, super_block_.blocks_per_group, group_of_inode(near_inode),
+	                           &alloc_group_t::free_blocks, &alloc_group_t::block_lock, &thread_alloc().block_hint);
 	if (ret == std::numeric_limits<std::size_t>::max())
 		return INVALID_BLOCK;
+
+	count_free(&counter_shard_t::blocks, -1);
+	sm_dirty_ = true;
 	return static_cast<uint32_t>(ret);
 }
 
+// bits and counters are atomic, so releasing needs no lock
 void file_system::set_block_status(uint32_t block_id, bool is_busy)
 {
-	if (is_busy)
-		--super_block_.blocks_free;
-	else
-		++super_block_.blocks_free;
-	sb_dirty_ = true;
+	mark_block(block_id, is_busy);
+}
 
+void file_system::mark_block(uint32_t block_id, bool is_busy)
+{
+	count_free(&counter_shard_t::blocks, is_busy ? -1 : 1);
+	groups_[block_id / super_block_.blocks_per_group].free_blocks.fetch_add(is_busy ? -1 : 1, std::memory_order_relaxed);
 	space_map_->set(is_busy, block_id);
 	sm_dirty_ = true;
 }
 
-void file_system::set_inode_status(uint32_t inode_num, bool is_busy)
+void file_system::count_free(std::atomic<int64_t> counter_shard_t::* counter, const int64_t delta)
 {
-	if (is_busy)
-		--super_block_.inodes_free;
-	else
-		++super_block_.inodes_free;
+	(free_counts_[thread_alloc().shard].*counter).fetch_add(delta, std::memory_order_relaxed);
 	sb_dirty_ = true;
+}
+
+void file_system::reset_free_counts()
+{
+	for (auto& shard : free_counts_)
+	{
+		shard.blocks = 0;
+		shard.inodes = 0;
+	}
+}
+
+/**
+ * \brief claims a run of fragments inside a single data block
+ * \param count number of fragments, less than a block's worth
+ * \param near_inode owner, a new block is taken from its group
+ * \return first fragment, INVALID_FRAGMENT if the disk is full
+ */
+uint32_t file_system::get_free_fragments(const uint32_t count, const uint32_t near_inode)
+{
+	std::lock_guard<std::mutex> lock(sm_lock_);
+	auto first = frag_map_->find_run(count);
+	if (first == INVALID_FRAGMENT)
+	{
+		const auto block = alloc_block(near_inode);
+		if (block == INVALID_BLOCK)
+			return INVALID_FRAGMENT;
+		first = block * super_block_.block_size;
+	}
+	frag_map_->set(first, count, true);
+	fm_dirty_ = true;
+	return first;
+}
+
+// grows a run in place if the fragments after it are free
+bool file_system::extend_fragments(const uint32_t first, const uint32_t count, const uint32_t new_count)
+{
+	std::lock_guard<std::mutex> lock(sm_lock_);
+	if ((first % super_block_.block_size) + new_count > super_block_.block_size
+		|| !frag_map_->is_run_free(first + count, new_count - count))
+		return false;
+	frag_map_->set(first + count, new_count - count, true);
+	fm_dirty_ = true;
+	return true;
+}
+
+void file_system::free_fragments(const uint32_t first, const uint32_t count)
+{
+	if (count == 0)
+		return;
+	std::lock_guard<std::mutex> lock(sm_lock_);
+	frag_map_->set(first, count, false);
+	fm_dirty_ = true;
+
+	const auto block = first / super_block_.block_size;
+	if (frag_map_->block_empty(block))
+		mark_block(block, false);
+}
 
+void file_system::set_inode_status(uint32_t inode_num, bool is_busy)
+{
+	count_free(&counter_shard_t::inodes, is_busy ? -1 : 1);
+	groups_[group_of_inode(inode_num)].free_inodes.fetch_add(is_busy ? -1 : 1, std::memory_order_relaxed);
 	inode_map_->set(is_busy, inode_num);
 	im_dirty_ = true;
+	touch_inode(inode_num);
 }
 
 std::vector<std::string> file_system::get_dir_and_file(const std::string& file_name)
@@ -3,21 +3,60 @@
 
 #include <string>
 #include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <condition_variable>
+#include <set>
+#include <unordered_map>
 
 #include "../disk/disk.h"
 #include "../spacemap/spacemap.h"
+#include "../spacemap/fragmap.h"
 #include "../superblock/superblock.h"
 #include "../entities/file/file.h"
 #include "../entities/dir/dir.h"
 #include "../entities/dir/dirent.h"
 #include "../inode/inode.h"
-#include "../cache/cache.h"
+#include "../cache/blockcache.h"
 #include "../storage/storage.h"
+#include "../sync/rwlock.h"
+#include "../sync/locktable.h"
+#include "../pool/blockpool.h"
 
 #define SUPERBLOCK_SECT	(0)
 #define STORAGE_SIZE	(128)
-#define DATABUFFER_SIZE	(1)
-#define CACHE_SIZE_DEF	(6)
+// cache budgets in bytes, the block size set at init decides how many blocks fit
+#define CACHE_BUDGET_DEF	(64 * 1024)
+// blocks cached apart from file data for the inode table, the maps, directories and indirect blocks
+#define META_CACHE_BUDGET_DEF	(32 * 1024)
+// blocks evicted from either partition are kept lz compressed within these, until they are read again
+#define COMPRESSED_BUDGET_DEF	(32 * 1024)
+#define META_COMPRESSED_BUDGET_DEF	(32 * 1024)
+// max inode table blocks fetched by a single bulk inode read
+#define INODE_BATCH_MAX	(16)
+// inodes share this many reader/writer locks
+#define INODE_LOCK_STRIPES	(64)
+// blocks share this many locks for read-modify-write
+#define BLOCK_LOCK_STRIPES	(64)
+// directory hash buckets share this many locks
+#define BUCKET_LOCK_STRIPES	(64)
+// free block and inode counts are kept in this many per-thread slices
+#define COUNTER_SHARDS	(16)
+// init splits the maps into at least this many allocation groups when it can
+#define ALLOC_GROUPS_MIN	(8)
+// the blocks cached at unload are saved next to the image, in a file named after it with this suffix
+#define HOT_SET_EXT	".hot"
+#define HOT_SET_MAGIC	(0x54534f48)
+// most adjacent blocks warmed by a single disk read
+#define HOT_SET_BATCH_MAX	(32)
+// the writeback thread wakes this often, in ms, and writes out buffers and maps dirty for longer than the age
+#define WRITEBACK_INTERVAL	(500)
+#define WRITEBACK_AGE_DEF	(5000)
+// percents of the data cache budget: past the ratio all write buffers go out, past the limit writers wait
+#define DIRTY_RATIO_DEF	(50)
+#define DIRTY_LIMIT_DEF	(100)
 
 typedef unsigned int fid_t;
 typedef unsigned int did_t;
@@ -26,16 +65,88 @@ typedef unsigned int did_t;
 #define INVALID_DID		(static_cast<did_t>(-1))
 #define INVALID_BLOCK	(static_cast<uint32_t>(-1))
 
+// how free blocks and inodes are claimed
+enum class alloc_mode
+{
+	// first fit under a map lock, keeps data packed at the start
+	locked,
+	// compare-and-swap on map words from per-thread hints
+	lock_free
+};
+
+// what a block holds, every kind but data is cached in the metadata partition
+enum class block_kind
+{
+	data,
+	dir,
+	indirect,
+	inode,
+	map
+};
+
+typedef struct thread_alloc_struct
+{
+	std::size_t shard;
+	std::size_t block_hint;
+	std::size_t inode_hint;
+} thread_alloc_t;
+
+// followed by the data blocks then the metadata blocks, most used first
+typedef struct hot_set_header_struct
+{
+	uint32_t magic;
+	// of the image the file was written for
+	uint32_t blocks_count;
+	uint32_t block_size;
+	uint32_t data_count;
+	uint32_t meta_count;
+} hot_set_header_t;
+
+// changes to the free counts since load, one cache line each
+typedef struct counter_shard_struct
+{
+	std::atomic<int64_t> blocks{0};
+	std::atomic<int64_t> inodes{0};
+	char padding[48];
+} counter_shard_t;
+
+// free counts and search locks of one allocation group
+typedef struct alloc_group_struct
+{
+	std::atomic<int64_t> free_blocks{0};
+	std::atomic<int64_t> free_inodes{0};
+	// searches of the group's map slices in locked mode
+	std::mutex block_lock;
+	std::mutex inode_lock;
+} alloc_group_t;
+
+// blocks of the maps, by index from the map's first block
+typedef struct map_pages_struct
+{
+	std::set<uint32_t> inode;
+	std::set<uint32_t> space;
+	std::set<uint32_t> frag;
+} map_pages_t;
+
+/**
+ * \brief all public operations may be called from several threads at once,
+ * except init, load, unload, the rule of five and the trace functions.
+ * Lock order: ns_lock_, cwd_lock_, fid/did locks, inode stripes (ascending),
+ * bucket stripes, sm_lock_, group locks, block stripes, cache shards, handles_lock_, touched_lock_, buffers_lock_.
+ * writeback_lock_ is never held together with another, writeback_round_lock_ comes before all of them
+ */
 class file_system
 {
 public:
 	// Default constructor
 	file_system()
-		: file_system(CACHE_SIZE_DEF) {}
+		: file_system(CACHE_BUDGET_DEF) {}
 
-	explicit file_system(std::size_t cache_size)
-		: data_buffer_{nullptr}, super_block_{},
-		  inode_map_(nullptr), space_map_(nullptr), cache_{cache_size} {}
+	// budgets in bytes
+	explicit file_system(std::size_t cache_budget, std::size_t meta_cache_budget = META_CACHE_BUDGET_DEF)
+		: super_block_{},
+		  inode_map_(nullptr), space_map_(nullptr), cache_{cache_budget, cache_policy::clock, COMPRESSED_BUDGET_DEF},
+		  meta_cache_{meta_cache_budget, cache_policy::clock, META_COMPRESSED_BUDGET_DEF} {}
 
 	void trace();
 	void traceblock(uint32_t block);
@@ -53,12 +164,31 @@ public:
 	// DISK REGION ----------------
 	// Create a new disk image
 	int init(const std::string& disk_file, uint32_t inodes_count,
-	         std::size_t disk_size, uint32_t block_size);
+	         std::size_t disk_size, uint32_t block_size, uint16_t features = 0);
 	// Load a disk image from a file
 	int load(const std::string& disk_file);
 	// Unload current disk image
 	void unload();
-	// Sync changes to disk image file
+	// with it on, unload saves the blocks in the cache and load reads them back in the background
+	void set_hot_set(const bool enabled) { hot_set_ = enabled; }
+	bool get_hot_set() const { return hot_set_; }
+	// true while load is still reading the saved blocks
+	bool is_warming() const { return warming_; }
+	// off by default; with it on, init and load start a thread that writes back buffers and maps dirty for longer
+	// than the age, and every buffer once they pass the dirty ratio. Its last write error on a file is returned by the
+	// next close, fsync or fdatasync of that file, or by sync
+	void set_writeback(bool enabled);
+	bool get_writeback() const { return writeback_; }
+	void set_writeback_age(const uint32_t ms) { writeback_age_ = ms; }
+	uint32_t get_writeback_age() const { return writeback_age_; }
+	void set_dirty_ratio(const unsigned percent) { dirty_ratio_ = percent; }
+	unsigned get_dirty_ratio() const { return dirty_ratio_; }
+	// a writer finding more buffered than this waits for one round of the thread
+	void set_dirty_limit(const unsigned percent) { dirty_limit_ = percent; }
+	unsigned get_dirty_limit() const { return dirty_limit_; }
+	// held in the write buffers of open files
+	std::size_t get_dirty_bytes() const { return dirty_bytes_; }
+	// Sync changes to disk image file, the write buffers of open files first
 	int sync();
 	// END DISK REGION -------------
 
@@ -68,15 +198,36 @@ public:
 	int unlink(const std::string& file_name);
 	// Open a file
 	fid_t open(const std::string& disk_file);
-	// Close a file
-	int close(fid_t fid) const;
+	// Close a file, after writing out its buffer; fid is closed even if that fails
+	int close(fid_t fid);
 
 	int read(fid_t fid, char* buffer, std::size_t size);
+	// small writes are held in a buffer of fid, other fids see them once it is flushed
 	int write(fid_t fid, const char* buffer, std::size_t size);
+	// like read and write at offset, without moving the position of fid;
+	// several threads may use one fid at once
+	int pread(fid_t fid, char* buffer, std::size_t size, std::size_t offset);
+	int pwrite(fid_t fid, const char* buffer, std::size_t size, std::size_t offset);
+	// like read and write on the pieces of vec in turn, done as a single transfer
+	int readv(fid_t fid, const io_vec_t* vec, std::size_t count);
+	int writev(fid_t fid, const io_vec_t* vec, std::size_t count);
 
 	int seek(fid_t fid, std::size_t pos);
 
 	int trunc(fid_t fid, std::size_t new_length);
+
+	// tells how a range of the file will be used, length 0 means up to its end.
+	// sequential, random and noreuse apply to the whole fid
+	int advise(fid_t fid, std::size_t offset, std::size_t length, access_hint hint);
+	// keeps the range in the cache until unpinned, ECACHE_PIN_FULL if it doesn't fit
+	int pin(fid_t fid, std::size_t offset, std::size_t length);
+	int unpin(fid_t fid, std::size_t offset, std::size_t length);
+	// writes out the buffer of fid, then the map blocks changed for its inode and the blocks it holds since
+	// the last sync; the data, indirect blocks and inode are written through already. The free counts wait for sync.
+	// Returns once the image file reached the device, see fsync(2)
+	int fsync(fid_t fid);
+	// like fsync, but an inode that only has a new modify time is left for later
+	int fdatasync(fid_t fid);
 	// END FILE REGION -------------
 	// DIRECTORY REGION ------------
 	int cd(const std::string& new_dir);
@@ -90,61 +241,228 @@ public:
 	int closedir(did_t dir_id) const;
 
 	dirent_t readdir(did_t dir_id);
+	// read all remaining entries together with their inodes
+	int readdirplus(did_t dir_id, std::vector<direntplus_t>* entries_out);
 	int rewind_dir(did_t dir_id);
 	// END DIRECTORY REGION --------
 
 	static std::string concat_paths(const std::string& path1, const std::string& path2);
 	super_block_t get_super_block() const;
+	bool has_feature(uint16_t feature) const { return (super_block_.features & feature) != 0; }
 	space_map* get_inode_map() const { return inode_map_; }
 	space_map* get_space_map() const { return space_map_; }
+	frag_map* get_frag_map() const { return frag_map_; }
+	// change only while no other call is running
+	void set_alloc_mode(const alloc_mode mode) { alloc_mode_ = mode; }
+	alloc_mode get_alloc_mode() const { return alloc_mode_; }
+	// empties both partitions, change only while no other call is running
+	void set_cache_policy(const cache_policy policy)
+	{
+		cache_.set_policy(policy);
+		meta_cache_.set_policy(policy);
+	}
+	cache_policy get_cache_policy() const { return cache_.get_policy(); }
+	// safe while other calls run, a smaller budget evicts right away
+	void set_cache_budget(const std::size_t bytes) { cache_.resize(bytes); }
+	void set_meta_cache_budget(const std::size_t bytes) { meta_cache_.resize(bytes); }
+	std::size_t get_cache_budget() const { return cache_.get_budget(); }
+	std::size_t get_meta_cache_budget() const { return meta_cache_.get_budget(); }
+	void set_compressed_budget(const std::size_t bytes) { cache_.resize_compressed(bytes); }
+	void set_meta_compressed_budget(const std::size_t bytes) { meta_cache_.resize_compressed(bytes); }
+	std::size_t get_compressed_budget() const { return cache_.get_compressed_budget(); }
+	std::size_t get_meta_compressed_budget() const { return meta_cache_.get_compressed_budget(); }
+	cache_stats_t get_cache_stats() const { return cache_.get_stats(); }
+	cache_stats_t get_meta_cache_stats() const { return meta_cache_.get_stats(); }
+	void reset_cache_stats()
+	{
+		cache_.reset_stats();
+		meta_cache_.reset_stats();
+	}
 private:
 	disk disk_;
-	char* data_buffer_;
+	// block sized scratch for partial block reads and writes
+	block_pool scratch_;
+	lock_table block_locks_{BLOCK_LOCK_STRIPES};
 	super_block_t super_block_;
 	space_map* inode_map_;
 	space_map* space_map_;
-
-	bool sb_dirty_{false};
-	bool im_dirty_{false};
-	bool sm_dirty_{false};
-
-	cache<uint32_t, std::vector<char>> cache_{CACHE_SIZE_DEF};
+	frag_map* frag_map_{nullptr};
+	// frag_map_
+	mutable std::mutex sm_lock_;
+	// super_block_.groups_count entries, a single group without SB_FEAT_ALLOC_GROUPS
+	std::unique_ptr<alloc_group_t[]> groups_;
+	alloc_mode alloc_mode_{alloc_mode::locked};
+	counter_shard_t free_counts_[COUNTER_SHARDS];
+
+	std::atomic<bool> sb_dirty_{false};
+	std::atomic<bool> im_dirty_{false};
+	std::atomic<bool> sm_dirty_{false};
+	bool fm_dirty_{false};
+	// map blocks changed for each inode since the last sync, so that fsync writes only those
+	std::unordered_map<uint32_t, map_pages_t> touched_pages_;
+	std::mutex touched_lock_;
+
+	block_cache cache_{CACHE_BUDGET_DEF, cache_policy::clock, COMPRESSED_BUDGET_DEF};
+	// metadata never competes with file data for a slot
+	block_cache meta_cache_{META_CACHE_BUDGET_DEF, cache_policy::clock, META_COMPRESSED_BUDGET_DEF};
+
+	bool hot_set_{false};
+	std::string hot_set_file_;
+	std::thread warm_thread_;
+	std::atomic<bool> warming_{false};
+	std::atomic<bool> warm_stop_{false};
+
+	std::atomic<bool> writeback_{false};
+	std::atomic<uint32_t> writeback_age_{WRITEBACK_AGE_DEF};
+	std::atomic<unsigned> dirty_ratio_{DIRTY_RATIO_DEF};
+	std::atomic<unsigned> dirty_limit_{DIRTY_LIMIT_DEF};
+	std::atomic<std::size_t> dirty_bytes_{0};
+	// the last error of the thread writing the maps, returned by the next sync
+	std::atomic<int> writeback_error_{0};
+	// write buffers by inode, a buffer is changed under its inode held exclusively
+	std::unordered_map<uint32_t, write_buffer_t> buffers_;
+	// the last error of the thread writing the buffer of an inode, see set_writeback
+	std::unordered_map<uint32_t, int> buffer_errors_;
+	// the slots of buffers_, and buffer_errors_
+	std::mutex buffers_lock_;
+	std::thread writeback_thread_;
+	std::mutex writeback_lock_;
+	// held by the thread through a round, and by a copy of the file system so that it sees no half written buffer
+	mutable std::mutex writeback_round_lock_;
+	std::condition_variable writeback_cv_;
+	// the rest are guarded by writeback_lock_, stopped while no thread runs
+	bool writeback_stop_{true};
+	bool writeback_kick_{false};
+	uint64_t writeback_rounds_{0};
 
 	storage<file> files_{STORAGE_SIZE};
 	storage<directory> dirs_{STORAGE_SIZE};
 	directory cwd_;
 
-	uint32_t get_free_block() const;
+	// held shared by path operations, exclusive by rmdir
+	rw_lock ns_lock_;
+	std::mutex cwd_lock_;
+	// slot maps of files_ and dirs_
+	mutable std::mutex handles_lock_;
+	// one operation at a time per open handle
+	mutable std::mutex fid_locks_[STORAGE_SIZE];
+	mutable std::mutex did_locks_[STORAGE_SIZE];
+	lock_table inode_locks_{INODE_LOCK_STRIPES};
+	// entry changes in one bucket of a directory that is held shared
+	lock_table bucket_locks_{BUCKET_LOCK_STRIPES};
+
+	file& get_file(fid_t fid);
+	// writes out the write buffer of an inode, for every handle of it
+	int flush_inode(uint32_t inode, bool data_only = false);
+	// the write buffer of an inode, made empty if there is none; the caller holds the inode exclusively
+	write_buffer_t& get_buffer(uint32_t inode);
+	// nullptr while nothing of the inode is buffered
+	write_buffer_t* find_buffer(uint32_t inode);
+	// forgets the write buffer of an inode without writing it
+	void drop_buffer(uint32_t inode);
+	// the inodes whose buffers went dirty no later than since
+	std::vector<uint32_t> buffered_inodes(
+		std::chrono::steady_clock::time_point since = std::chrono::steady_clock::time_point::max());
+	// the writeback error recorded for an inode, cleared; 0 if there is none
+	int take_buffer_error(uint32_t inode);
+	// whether a handle other than except has the inode open
+	bool is_open(uint32_t inode, fid_t except);
+	// private copy of an open file, for calls that leave its position alone
+	int copy_file(fid_t fid, file* file_out);
+	directory& get_dir(did_t did);
+	directory get_cwd();
+
+	// finds and marks a free block in one step, preferably in the group of near_inode
+	uint32_t alloc_block(uint32_t near_inode);
 	void set_block_status(uint32_t block_id, bool is_busy);
-
-	// proxies for caching
-	int read_block(uint32_t start_block, char* buffer, std::size_t size);
-	int write_block(uint32_t start_block, const char* buffer, std::size_t size);
-
-	int read_data_block(uint32_t start_block, char* buffer, std::size_t size);
-	int write_data_block(uint32_t start_block, const char* buffer, std::size_t size);
-
-	int read_object(uint32_t start_block, std::size_t offset, std::size_t obj_size, void* buffer);
-	int write_object(uint32_t start_block, std::size_t offset, std::size_t obj_size, const void* buffer);
-
-	int read_data_object(uint32_t start_block, std::size_t offset, std::size_t obj_size, void* buffer);
-	int write_data_object(uint32_t start_block, std::size_t offset, std::size_t obj_size, const void* buffer);
+	void mark_block(uint32_t block_id, bool is_busy);
+	void count_free(std::atomic<int64_t> counter_shard_t::* counter, int64_t delta);
+	void reset_free_counts();
+
+	// recounts the free bits of every group from the maps
+	void reset_groups();
+	uint32_t group_of_inode(uint32_t inode_num) const;
+	std::size_t alloc_bit(const space_map* map, uint32_t per_group, uint32_t goal,
+	                      std::atomic<int64_t> alloc_group_t::* free, std::mutex alloc_group_t::* lock,
+	                      std::size_t* hint);
+	// the superblock and the dirty maps, whole, then the image file down to the device
+	int sync_maps();
+	int write_maps();
+	int write_map(uint32_t first_block, const space_map* map);
+	int write_map_pages(uint32_t first_block, const space_map* map, const std::set<uint32_t>& pages);
+	int sync_file(fid_t fid, bool data_only);
+	// remember the map blocks that a change of inode, or of its blocks and fragments, touched; see fsync
+	void touch_inode(uint32_t inode);
+	void touch_block(uint32_t inode, uint32_t block);
+	void touch_fragments(uint32_t inode, uint32_t first, uint32_t count);
+	// puts back pages that were taken to be written and failed
+	void retouch(uint32_t inode, const map_pages_t& pages);
+
+	uint32_t get_free_fragments(uint32_t count, uint32_t near_inode);
+	bool extend_fragments(uint32_t first, uint32_t count, uint32_t new_count);
+	void free_fragments(uint32_t first, uint32_t count);
+
+	// proxies for caching, kind picks the cache partition
+	block_cache& cache_of(const block_kind kind) { return kind == block_kind::data ? cache_ : meta_cache_; }
+	// prefetched blocks only count as used once they are read
+	int read_block(uint32_t start_block, char* buffer, std::size_t size, block_kind kind, bool prefetch = false);
+	// data area blocks change kind when they are freed and reused, the other partition drops them
+	int write_block(uint32_t start_block, const char* buffer, std::size_t size, block_kind kind);
+
+	int read_data_block(uint32_t start_block, char* buffer, std::size_t size, block_kind kind);
+	int write_data_block(uint32_t start_block, const char* buffer, std::size_t size, block_kind kind);
+	// pulls the blocks that are not cached yet into the cache
+	int prefetch_block(uint32_t start_block, std::size_t size, block_kind kind);
+	int prefetch_data_block(uint32_t start_block, std::size_t size, block_kind kind);
+	// loads and pins the data blocks, none stay pinned on failure
+	int pin_data_block(uint32_t start_block, std::size_t size, block_kind kind);
+	void unpin_data_block(uint32_t start_block, std::size_t size, block_kind kind);
+	// evicts a freed block from both partitions, even if pinned
+	void forget_data_block(uint32_t block);
+	void demote_data_block(uint32_t start_block, std::size_t size, block_kind kind);
+	void drop_data_block(uint32_t start_block, std::size_t size, block_kind kind);
+
+	int read_object(uint32_t start_block, std::size_t offset, std::size_t obj_size, void* buffer, block_kind kind);
+	int write_object(uint32_t start_block, std::size_t offset, std::size_t obj_size, const void* buffer,
+	                 block_kind kind);
+
+	int read_data_object(uint32_t start_block, std::size_t offset, std::size_t obj_size, void* buffer,
+	                     block_kind kind);
+	int write_data_object(uint32_t start_block, std::size_t offset, std::size_t obj_size, const void* buffer,
+	                      block_kind kind);
+
+	int save_hot_set() const;
+	// reads the saved list and starts warming the cache from it
+	void load_hot_set();
+	void warm(std::vector<uint32_t> blocks, block_kind kind);
+	void stop_warming();
+	void start_writeback();
+	void stop_writeback();
+	void writeback();
+	// wakes the writeback thread past the dirty ratio, waits for it past the limit
+	void throttle();
+	std::size_t dirty_threshold(const unsigned percent) const { return cache_.get_budget() / 100 * percent; }
 
 	int write_inode(uint32_t inode_id, const inode_t* inode);
 	int read_inode(uint32_t inode_id, inode_t* inode);
+	int read_inodes(const std::vector<uint32_t>& inode_ids, std::vector<inode_t>* inodes_out);
+	void clean_inode(inode_t* inode) const;
+	uint8_t get_small_data_flag(file_type f_type) const;
 
 	static inode_t get_new_inode(file_type f_type, uint16_t permissions);
-	uint32_t get_free_inode() const;
+	// finds and marks a free inode in one step, directories go to the emptiest group,
+	// everything else next to its parent
+	uint32_t alloc_inode(uint32_t parent_inode, file_type f_type);
 	void set_inode_status(uint32_t inode_num, bool is_busy);
 
 	static std::vector<std::string> get_dir_and_file(const std::string& file_name);
 	int get_inode_by_path(const std::string& path, uint32_t* inode_out);
 
 	int do_unlink(const std::string& file_name, bool force);
-	int do_create(const std::string& file_name, file_type f_type,
-	              uint32_t* inode_out = nullptr, uint32_t* prev_dir_inode_out = nullptr);
+	int do_create(const std::string& file_name, file_type f_type);
 
 	friend class file;
+	friend class directory;
 };
 
 #endif
@@ -2,6 +2,7 @@
 #define INODE_H_GUARD
 
 #include <cstdint>
+#include <cstddef>
 #include <iostream>
 #include <iomanip>
 
@@ -9,6 +10,18 @@
 #define INODE_BLOCKS_MAX    8
 #define INVALID_INODE       ((uint32_t)-1)
 
+// on-disk size of an inode without the inline data area
+#define INODE_BASE_SIZE     80
+// bytes of content an inode can hold itself (see SB_FEAT_INLINE_DATA)
+#define INODE_INLINE_MAX    176
+
+// content lives in inline_data rather than in blocks
+#define INODE_FLAG_INLINE   0x01
+// content lives in a run of fragments starting at fragment (see SB_FEAT_FRAGMENTS)
+#define INODE_FLAG_FRAGMENT 0x02
+// directory blocks are an extendible hash table of buckets (see SB_FEAT_HASHED_DIRS)
+#define INODE_FLAG_HASHED   0x04
+
 enum class file_type : uint8_t { regular = 0, dir = 1, other = 2 };
 
 typedef struct inode_struct
@@ -16,9 +29,12 @@ typedef struct inode_struct
 	inode_struct() : f_type(file_type::other), blocks(), indirect_block(0), double_indirect_block(0) {}
 
 	file_type f_type;
+	uint8_t flags{};
 	//file-type(4 bits)|SUID-SGID-STICKY|r-w-x|r-w-x|r-w-x
 	// total-- 16 bits used
 	uint16_t permissions{};
+	// bytes of content kept in inline_data or in fragments
+	uint32_t data_size{};
 
 	// time of last access
 	mutable uint64_t access_time{};
@@ -32,14 +48,20 @@ typedef struct inode_struct
 	uint32_t blocks[INODE_BLOCKS_MAX];
 	uint32_t indirect_block;
 	uint32_t double_indirect_block;
+	uint32_t fragment{};
+
+	char inline_data[INODE_INLINE_MAX]{};
 } inode_t;
 
+static_assert(offsetof(inode_t, inline_data) == INODE_BASE_SIZE, "inode base layout must not change");
+
 inline std::ostream& operator<<(std::ostream& os, inode_t inode)
 {
 	using std::endl;
 	using std::hex;
 	using std::dec;
 	os << "f_type: " << static_cast<int>(inode.f_type) << endl
+		<< "flags: " << static_cast<int>(inode.flags) << endl
 		<< "perms: " << inode.permissions << endl
 		<< "access time: " << inode.access_time << endl
 		<< "change time: " << inode.change_time << endl
@@ -52,6 +74,10 @@ inline std::ostream& operator<<(std::ostream& os, inode_t inode)
 	}
 	os << "indirect block: " << hex << inode.indirect_block << endl;
 	os << "double ind block: " << hex << inode.double_indirect_block << endl << dec;
+	if (inode.flags & INODE_FLAG_INLINE)
+		os << "inline bytes: " << inode.data_size << endl;
+	if (inode.flags & INODE_FLAG_FRAGMENT)
+		os << "fragment: " << hex << inode.fragment << dec << " bytes: " << inode.data_size << endl;
 	return os;
 }
 
@@ -0,0 +1,30 @@
+#include "blockpool.h"
+
+void block_pool::reset(const std::size_t block_bytes)
+{
+	std::lock_guard<std::mutex> lock(lock_);
+	for (const auto buffer : free_)
+		delete[] buffer;
+	free_.clear();
+	block_bytes_ = block_bytes;
+}
+
+char* block_pool::acquire()
+{
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		if (!free_.empty())
+		{
+			const auto buffer = free_.back();
+			free_.pop_back();
+			return buffer;
+		}
+	}
+	return new char[block_bytes_];
+}
+
+void block_pool::release(char* buffer)
+{
+	std::lock_guard<std::mutex> lock(lock_);
+	free_.push_back(buffer);
+}
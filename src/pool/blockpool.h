@@ -0,0 +1,49 @@
+#ifndef BLOCKPOOL_H_GUARD
+#define BLOCKPOOL_H_GUARD
+
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+
+// recycles block sized scratch buffers between operations
+class block_pool
+{
+public:
+	block_pool() = default;
+	~block_pool() { reset(0); }
+
+	block_pool(const block_pool& that) = delete;
+	block_pool& operator=(const block_pool& that) = delete;
+
+	// drops every idle buffer, later ones are block_bytes long
+	void reset(std::size_t block_bytes);
+
+	char* acquire();
+	void release(char* buffer);
+
+	std::size_t get_block_bytes() const { return block_bytes_; }
+private:
+	std::mutex lock_;
+	std::size_t block_bytes_{0};
+	std::vector<char*> free_;
+};
+
+// one buffer from a pool, handed back when it goes out of scope
+class scratch_block
+{
+public:
+	explicit scratch_block(block_pool& pool) : pool_(pool), data_(pool.acquire()) {}
+	~scratch_block() { pool_.release(data_); }
+
+	scratch_block(const scratch_block& that) = delete;
+	scratch_block& operator=(const scratch_block& that) = delete;
+
+	char* data() const { return data_; }
+	uint32_t* words() const { return reinterpret_cast<uint32_t *>(data_); }
+private:
+	block_pool& pool_;
+	char* data_;
+};
+
+#endif
@@ -0,0 +1,75 @@
+#include "fragmap.h"
+
+frag_map::frag_map(const uint32_t blocks_count, const uint32_t frags_per_block)
+	: map_(static_cast<std::size_t>(blocks_count) * frags_per_block), frags_per_block_(frags_per_block) {}
+
+uint32_t frag_map::find_run(const uint32_t count) const
+{
+	if (count == 0 || count >= frags_per_block_)
+		return INVALID_FRAGMENT;
+
+	for (const auto block : partial_)
+	{
+		const auto base = block * frags_per_block_;
+		uint32_t run = 0;
+		for (uint32_t i = 0; i < frags_per_block_; ++i)
+		{
+			run = map_.get(base + i) ? 0 : run + 1;
+			if (run == count)
+				return base + i + 1 - count;
+		}
+	}
+	return INVALID_FRAGMENT;
+}
+
+bool frag_map::is_run_free(const uint32_t first, const uint32_t count) const
+{
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		if (map_.get(first + i))
+			return false;
+	}
+	return true;
+}
+
+void frag_map::set(const uint32_t first, const uint32_t count, const bool busy)
+{
+	for (uint32_t i = 0; i < count; ++i)
+		map_.set(busy, first + i);
+
+	const auto first_block = first / frags_per_block_;
+	const auto last_block = (first + count - 1) / frags_per_block_;
+	for (auto block = first_block; block <= last_block; ++block)
+		update_block(block);
+}
+
+bool frag_map::block_empty(const uint32_t block) const
+{
+	return busy_in_block(block) == 0;
+}
+
+void frag_map::rebuild()
+{
+	partial_.clear();
+	const auto blocks = map_.get_bits_count() / frags_per_block_;
+	for (uint32_t block = 0; block < blocks; ++block)
+		update_block(block);
+}
+
+uint32_t frag_map::busy_in_block(const uint32_t block) const
+{
+	const auto base = block * frags_per_block_;
+	uint32_t busy = 0;
+	for (uint32_t i = 0; i < frags_per_block_; ++i)
+		busy += map_.get(base + i);
+	return busy;
+}
+
+void frag_map::update_block(const uint32_t block)
+{
+	const auto busy = busy_in_block(block);
+	if (busy == 0 || busy == frags_per_block_)
+		partial_.erase(block);
+	else
+		partial_.insert(block);
+}
@@ -0,0 +1,41 @@
+#ifndef FRAGMAP_H_GUARD
+#define FRAGMAP_H_GUARD
+
+#include <cstdint>
+#include <set>
+
+#include "spacemap.h"
+
+#define INVALID_FRAGMENT	(static_cast<uint32_t>(-1))
+
+// tracks sector-sized fragments of data blocks shared by small files.
+// fragment id = data block * frags_per_block + sector within the block
+class frag_map
+{
+public:
+	frag_map(uint32_t blocks_count, uint32_t frags_per_block);
+
+	// first fragment of a free run of count fragments inside one partly used block
+	uint32_t find_run(uint32_t count) const;
+	bool is_run_free(uint32_t first, uint32_t count) const;
+	void set(uint32_t first, uint32_t count, bool busy);
+
+	bool block_empty(uint32_t block) const;
+	uint32_t get_frags_per_block() const { return frags_per_block_; }
+
+	// rebuild bookkeeping after the bits were loaded from disk
+	void rebuild();
+
+	space_map* get_map() { return &map_; }
+	const space_map* get_map() const { return &map_; }
+private:
+	space_map map_;
+	uint32_t frags_per_block_;
+	// blocks holding both busy and free fragments
+	std::set<uint32_t> partial_;
+
+	uint32_t busy_in_block(uint32_t block) const;
+	void update_block(uint32_t block);
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <iomanip>
 #include <limits>
+#include <algorithm>
 
 struct hex_char_struct
 {
@@ -22,10 +23,8 @@ inline hex_char_struct hex(unsigned char _c)
 
 space_map::space_map(const space_map& that)
 {
-	bytes_count_ = that.bytes_count_;
-	bits_count_ = that.bits_count_;
-	bits_arr = new uint8_t[bytes_count_];
-	memcpy(this->bits_arr, that.bits_arr, sizeof(uint8_t) * bytes_count_);
+	alloc_bits(that.bits_count_);
+	that.snapshot(this->bits_arr);
 }
 
 space_map& space_map::operator=(const space_map& that)
@@ -33,29 +32,58 @@ space_map& space_map::operator=(const space_map& that)
 	if (this != &that)
 	{
 		delete[] bits_arr;
-		bytes_count_ = that.bytes_count_;
-		bits_count_ = that.bits_count_;
-		bits_arr = new uint8_t[bytes_count_];
-		memcpy(this->bits_arr, that.bits_arr, sizeof(uint8_t) * bytes_count_);
+		alloc_bits(that.bits_count_);
+		that.snapshot(this->bits_arr);
 	}
 	return *this;
 }
 
 space_map::space_map(const std::size_t bits_n)
 {
-	bytes_count_ = bits_n / 8 + ((bits_n % 8) != 0);
-	this->bits_arr = new uint8_t[bytes_count_]();
-	bits_count_ = bits_n;
+	alloc_bits(bits_n);
 }
 
 space_map::space_map(uint8_t* const bits_arr, const std::size_t bits_n)
 {
-	bytes_count_ = bits_n / 8 + ((bits_n % 8) != 0);
-	this->bits_arr = new uint8_t[bytes_count_];
-	bits_count_ = bits_n;
+	alloc_bits(bits_n);
 	memcpy(this->bits_arr, bits_arr, bytes_count_);
 }
 
+// new[] memory is aligned for any fundamental type, so the words can be used in place
+void space_map::alloc_bits(const std::size_t bits_n)
+{
+	bits_count_ = bits_n;
+	bytes_count_ = bits_n / 8 + ((bits_n % 8) != 0);
+	words_count_ = bits_n / 64 + ((bits_n % 64) != 0);
+	this->bits_arr = new uint8_t[words_count_ * sizeof(uint64_t)]();
+
+	tail_mask_ = 0;
+	for (auto i = (words_count_ - (words_count_ != 0)) * 64; i < bits_n; ++i)
+		tail_mask_ |= word_bit(i);
+}
+
+// bits are msb first inside each byte, the bytes keep their memory order inside a word
+uint64_t space_map::word_bit(const std::size_t index)
+{
+	const auto byte = (index % 64) / 8;
+	const auto bit = 7 - index % 8;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return 1ULL << ((7 - byte) * 8 + bit);
+#else
+	return 1ULL << (byte * 8 + bit);
+#endif
+}
+
+std::size_t space_map::bit_index(const std::size_t word_index, const unsigned bit)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	const auto byte = 7 - bit / 8;
+#else
+	const auto byte = bit / 8;
+#endif
+	return word_index * 64 + byte * 8 + (7 - bit % 8);
+}
+
 bool space_map::get(const std::size_t index) const
 {
 	return this->operator[](index);
@@ -65,7 +93,7 @@ bool space_map::operator[](const std::size_t index) const
 {
 	if (index >= bits_count_)
 		return false;
-	return bits_arr[index / 8] & (0b10000000 >> (index % 8));
+	return (__atomic_load_n(word(index), __ATOMIC_RELAXED) & word_bit(index)) != 0;
 }
 
 void space_map::set(bool value, const std::size_t index) const
@@ -73,30 +101,120 @@ void space_map::set(bool value, const std::size_t index) const
 	if (index >= bits_count_)
 		return;
 	if (value)
-		bits_arr[index / 8] |= (0b10000000 >> (index % 8));
+		__atomic_fetch_or(word(index), word_bit(index), __ATOMIC_RELEASE);
 	else
-		bits_arr[index / 8] &= (~(0b10000000 >> (index % 8)));
+		__atomic_fetch_and(word(index), ~word_bit(index), __ATOMIC_RELEASE);
+}
+
+uint64_t space_map::range_mask(const std::size_t w, const std::size_t first, std::size_t last) const
+{
+	if (last > bits_count_)
+		last = bits_count_;
+	const auto begin = w * 64;
+	const auto end = begin + 64;
+	if (first <= begin && end <= last)
+		return ~0ULL;
+	if (first <= begin && last == bits_count_)
+		return tail_mask_;
+
+	uint64_t mask = 0;
+	for (auto i = std::max(first, begin); i < std::min(last, end); ++i)
+		mask |= word_bit(i);
+	return mask;
 }
 
-std::size_t space_map::find_first_of(const bool val) const
+std::size_t space_map::find_first_of(const bool val, const std::size_t first, std::size_t last) const
 {
-	const auto seek_val = val ? 0x00 : 0xFF;
-	for (std::size_t i = 0; i < bytes_count_; ++i)
+	if (last > bits_count_)
+		last = bits_count_;
+	if (first >= last)
+		return std::numeric_limits<std::size_t>::max();
+
+	for (auto w = first / 64; w <= (last - 1) / 64; ++w)
 	{
-		if (bits_arr[i] != seek_val)
+		const auto valid = range_mask(w, first, last);
+		const auto bits = __atomic_load_n(reinterpret_cast<const uint64_t *>(bits_arr) + w, __ATOMIC_RELAXED);
+		if (((val ? bits : ~bits) & valid) == 0)
+			continue;
+		// lowest index, which is not the lowest bit of the word
+		for (auto i = std::max(first, w * 64); i < last && i < (w + 1) * 64; ++i)
 		{
-			auto j = i << 3;
-			std::size_t ret;
-			while (get(ret = j) != val && ++j < bits_count_)
-				;
-			if (j == bits_count_)
-				break;
-			return ret;
+			if (get(i) == val)
+				return i;
 		}
 	}
 	return std::numeric_limits<std::size_t>::max();
 }
 
+std::size_t space_map::claim(const std::size_t hint, const std::size_t first, std::size_t last) const
+{
+	if (last > bits_count_)
+		last = bits_count_;
+	if (first >= last)
+		return std::numeric_limits<std::size_t>::max();
+
+	const auto first_word = first / 64;
+	const auto last_word = (last - 1) / 64;
+	auto w = (hint >= first && hint < last ? hint : first) / 64;
+	for (auto n = first_word; n <= last_word; ++n)
+	{
+		const auto ptr = reinterpret_cast<uint64_t *>(bits_arr) + w;
+		const auto valid = range_mask(w, first, last);
+		auto bits = __atomic_load_n(ptr, __ATOMIC_RELAXED);
+		uint64_t free;
+		while ((free = ~bits & valid) != 0)
+		{
+			const auto bit = static_cast<unsigned>(__builtin_ctzll(free));
+			// a failed exchange reloads bits and tries the next free one
+			if (__atomic_compare_exchange_n(ptr, &bits, bits | (1ULL << bit), false,
+			                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+				return bit_index(w, bit);
+		}
+		w = (w == last_word) ? first_word : w + 1;
+	}
+	return std::numeric_limits<std::size_t>::max();
+}
+
+std::size_t space_map::count(const bool val, const std::size_t first, std::size_t last) const
+{
+	if (last > bits_count_)
+		last = bits_count_;
+	if (first >= last)
+		return 0;
+
+	std::size_t ret = 0;
+	for (auto w = first / 64; w <= (last - 1) / 64; ++w)
+	{
+		const auto bits = __atomic_load_n(reinterpret_cast<const uint64_t *>(bits_arr) + w, __ATOMIC_RELAXED);
+		ret += __builtin_popcountll((val ? bits : ~bits) & range_mask(w, first, last));
+	}
+	return ret;
+}
+
+void space_map::snapshot(uint8_t* bits_out) const
+{
+	for (std::size_t w = 0; w < words_count_; ++w)
+	{
+		const auto bits = __atomic_load_n(reinterpret_cast<const uint64_t *>(bits_arr) + w, __ATOMIC_ACQUIRE);
+		const auto size = (w + 1 == words_count_) ? bytes_count_ - w * sizeof(uint64_t) : sizeof(uint64_t);
+		memcpy(bits_out + w * sizeof(uint64_t), &bits, size);
+	}
+}
+
+void space_map::snapshot(uint8_t* bits_out, const std::size_t first_byte, const std::size_t count) const
+{
+	if (count == 0)
+		return;
+	for (std::size_t w = first_byte / sizeof(uint64_t); w <= (first_byte + count - 1) / sizeof(uint64_t); ++w)
+	{
+		const auto bits = __atomic_load_n(reinterpret_cast<const uint64_t *>(bits_arr) + w, __ATOMIC_ACQUIRE);
+		const auto word_first = w * sizeof(uint64_t);
+		const auto from = first_byte > word_first ? first_byte : word_first;
+		const auto to = first_byte + count < word_first + sizeof(uint64_t) ? first_byte + count : word_first + sizeof(uint64_t);
+		memcpy(bits_out + from - first_byte, reinterpret_cast<const uint8_t *>(&bits) + from - word_first, to - from);
+	}
+}
+
 std::ostream& operator<<(std::ostream& os, const space_map& sm)
 {
 	for (uint32_t i = 0; i < sm.bytes_count_; ++i)
@@ -16,9 +16,18 @@ public:
 	bool operator[](std::size_t index) const;
 
 	bool get(std::size_t index) const;
+	// atomic, may run alongside claim and other sets
 	void set(bool value, std::size_t index) const;
 
-	std::size_t find_first_of(bool val) const;
+	// searches are limited to the bits [first, last)
+	std::size_t find_first_of(bool val, std::size_t first = 0, std::size_t last = SIZE_MAX) const;
+	// atomically finds and sets a clear bit, searching from the word of hint onwards
+	std::size_t claim(std::size_t hint, std::size_t first = 0, std::size_t last = SIZE_MAX) const;
+	std::size_t count(bool val, std::size_t first = 0, std::size_t last = SIZE_MAX) const;
+	// consistent copy of the bits for writing out
+	void snapshot(uint8_t* bits_out) const;
+	// the same for the bytes [first_byte; first_byte + count) only
+	void snapshot(uint8_t* bits_out, std::size_t first_byte, std::size_t count) const;
 
 	uint8_t* bits_arr;
 	uint32_t get_bytes_count() const { return bytes_count_; }
@@ -29,6 +38,17 @@ public:
 private:
 	std::size_t bits_count_;
 	std::size_t bytes_count_;
+	// bits_arr is padded to whole 64 bit words for the atomic operations
+	std::size_t words_count_;
+	// valid bits of the last word
+	uint64_t tail_mask_;
+
+	void alloc_bits(std::size_t bits_n);
+	uint64_t* word(std::size_t index) const { return reinterpret_cast<uint64_t *>(bits_arr) + index / 64; }
+	// bits of word w that are inside [first, last) and the map
+	uint64_t range_mask(std::size_t w, std::size_t first, std::size_t last) const;
+	static uint64_t word_bit(std::size_t index);
+	static std::size_t bit_index(std::size_t word_index, unsigned bit);
 };
 
 
@@ -2,6 +2,7 @@
 #define STORAGE_H_GUARD
 
 #include <cstdlib>
+#include <cstring>
 #include <exception>
 #include <iostream>
 
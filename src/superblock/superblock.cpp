@@ -22,6 +22,14 @@ std::ostream& operator<<(std::ostream& os, const super_block_t sb)
 		<< "Space map first sector: " << sb.spacemap_first_block << endl
 		<< "Space map size (in blocks): " << sb.spacemap_size << endl
 		<< endl
+		<< "Fragment map first sector: " << sb.fragmap_first_block << endl
+		<< "Fragment map size (in blocks): " << sb.fragmap_size << endl
+		<< endl
+		<< "Allocation groups: " << sb.groups_count << endl
+		<< "Blocks per group: " << sb.blocks_per_group << endl
+		<< "Inodes per group: " << sb.inodes_per_group << endl
+		<< endl
 		<< "Data first sector: " << sb.data_first_block << endl
-		<< "Magic: " << sb.magic << endl;
+		<< "Magic: " << sb.magic << endl
+		<< "Features: " << std::hex << sb.features << std::dec << endl;
 }
@@ -2,6 +2,24 @@
 #define SUPERBLOCK_H_GUARD
 
 #include <cstdint>
+#include <iostream>
+
+#define SB_MAGIC	(0xBEEF)
+
+// optional on-disk features, chosen at init
+// directories hold variable-length packed entries instead of fixed_dirent_t
+#define SB_FEAT_PACKED_DIRS	(0x0001)
+// inodes are stored with their inline data area, small content lives there
+#define SB_FEAT_INLINE_DATA	(0x0002)
+// small regular files share blocks as runs of sector-sized fragments
+#define SB_FEAT_FRAGMENTS	(0x0004)
+// the maps are split into allocation groups, files are placed near their inode
+#define SB_FEAT_ALLOC_GROUPS	(0x0008)
+// directories are hash tables of packed entry blocks, needs SB_FEAT_PACKED_DIRS
+#define SB_FEAT_HASHED_DIRS	(0x0010)
+
+#define SB_FEAT_ALL	(SB_FEAT_PACKED_DIRS | SB_FEAT_INLINE_DATA | SB_FEAT_FRAGMENTS | \
+                 	 SB_FEAT_ALLOC_GROUPS | SB_FEAT_HASHED_DIRS)
 
 typedef struct super_block_struct
 {
@@ -27,10 +45,23 @@ typedef struct super_block_struct
 	uint32_t spacemap_size;
 
 	uint16_t magic;
+	uint16_t features;
 
-	uint8_t padding[453];
+	// SB_FEAT_FRAGMENTS only
+	uint32_t fragmap_first_block;
+	uint32_t fragmap_size;
+
+	// SB_FEAT_ALLOC_GROUPS only, group g owns the space map bits
+	// [g * blocks_per_group, (g + 1) * blocks_per_group) and the same slice of inodes
+	uint32_t groups_count;
+	uint32_t blocks_per_group;
+	uint32_t inodes_per_group;
+
+	uint8_t padding[431];
 } super_block_t;
 
+static_assert(sizeof(super_block_t) == 512, "superblock must fill exactly one sector");
+
 std::ostream& operator<<(std::ostream& os, super_block_t sb);
 
 #endif
@@ -0,0 +1,52 @@
+#include "locktable.h"
+
+#include <algorithm>
+
+table_guard::table_guard(lock_table& table, std::initializer_list<uint32_t> keys, const bool exclusive)
+	: table_(table)
+{
+	std::vector<std::pair<std::size_t, bool>> stripes;
+	for (const auto key : keys)
+		stripes.emplace_back(table_.index(key), exclusive);
+	lock_stripes(std::move(stripes));
+}
+
+table_guard::table_guard(lock_table& table, std::initializer_list<uint32_t> shared_keys,
+                         std::initializer_list<uint32_t> exclusive_keys)
+	: table_(table)
+{
+	std::vector<std::pair<std::size_t, bool>> stripes;
+	for (const auto key : shared_keys)
+		stripes.emplace_back(table_.index(key), false);
+	for (const auto key : exclusive_keys)
+		stripes.emplace_back(table_.index(key), true);
+	lock_stripes(std::move(stripes));
+}
+
+void table_guard::unlock()
+{
+	for (auto it = held_.rbegin(); it != held_.rend(); ++it)
+	{
+		if (it->second)
+			table_.at(it->first).unlock();
+		else
+			table_.at(it->first).unlock_shared();
+	}
+	held_.clear();
+}
+
+void table_guard::lock_stripes(std::vector<std::pair<std::size_t, bool>> stripes)
+{
+	// exclusive sorts after shared, so the last pair of each stripe decides
+	std::sort(stripes.begin(), stripes.end());
+	for (std::size_t i = 0; i < stripes.size(); ++i)
+	{
+		if (i + 1 < stripes.size() && stripes[i + 1].first == stripes[i].first)
+			continue;
+		if (stripes[i].second)
+			table_.at(stripes[i].first).lock();
+		else
+			table_.at(stripes[i].first).lock_shared();
+		held_.push_back(stripes[i]);
+	}
+}
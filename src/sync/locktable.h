@@ -0,0 +1,49 @@
+#ifndef LOCKTABLE_H_GUARD
+#define LOCKTABLE_H_GUARD
+
+#include <cstdint>
+#include <cstdlib>
+#include <initializer_list>
+#include <utility>
+#include <vector>
+
+#include "rwlock.h"
+
+// fixed set of rw locks shared by keys hashing to the same stripe
+class lock_table
+{
+public:
+	explicit lock_table(std::size_t stripes) : locks_(stripes) {}
+
+	std::size_t index(const uint32_t key) const { return key % locks_.size(); }
+	rw_lock& at(const std::size_t index) { return locks_[index]; }
+private:
+	std::vector<rw_lock> locks_;
+};
+
+/**
+ * \brief holds the stripes of several keys, always taken in stripe order
+ * so that two guards can never wait on each other
+ */
+class table_guard
+{
+public:
+	table_guard(lock_table& table, std::initializer_list<uint32_t> keys, bool exclusive);
+	// a stripe shared by keys of both lists is taken exclusively
+	table_guard(lock_table& table, std::initializer_list<uint32_t> shared_keys,
+	            std::initializer_list<uint32_t> exclusive_keys);
+	~table_guard() { unlock(); }
+
+	table_guard(const table_guard& that) = delete;
+	table_guard& operator=(const table_guard& that) = delete;
+
+	void unlock();
+private:
+	lock_table& table_;
+	// stripe and whether it is held exclusively
+	std::vector<std::pair<std::size_t, bool>> held_;
+
+	void lock_stripes(std::vector<std::pair<std::size_t, bool>> stripes);
+};
+
+#endif
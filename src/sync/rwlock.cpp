@@ -0,0 +1,38 @@
+#include "rwlock.h"
+
+void rw_lock::lock()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	++writers_waiting_;
+	writers_cv_.wait(lock, [this] { return !writer_ && readers_ == 0; });
+	--writers_waiting_;
+	writer_ = true;
+}
+
+void rw_lock::unlock()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		writer_ = false;
+	}
+	writers_cv_.notify_one();
+	readers_cv_.notify_all();
+}
+
+void rw_lock::lock_shared()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	readers_cv_.wait(lock, [this] { return !writer_ && writers_waiting_ == 0; });
+	++readers_;
+}
+
+void rw_lock::unlock_shared()
+{
+	bool last;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		last = --readers_ == 0;
+	}
+	if (last)
+		writers_cv_.notify_one();
+}
@@ -0,0 +1,55 @@
+#ifndef RWLOCK_H_GUARD
+#define RWLOCK_H_GUARD
+
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+
+// reader/writer lock, waiting writers keep new readers out
+class rw_lock
+{
+public:
+	rw_lock() = default;
+
+	rw_lock(const rw_lock& that) = delete;
+	rw_lock& operator=(const rw_lock& that) = delete;
+
+	void lock();
+	void unlock();
+
+	void lock_shared();
+	void unlock_shared();
+private:
+	std::mutex mutex_;
+	std::condition_variable readers_cv_;
+	std::condition_variable writers_cv_;
+	uint32_t readers_{0};
+	uint32_t writers_waiting_{0};
+	bool writer_{false};
+};
+
+class shared_guard
+{
+public:
+	explicit shared_guard(rw_lock& lock) : lock_(lock) { lock_.lock_shared(); }
+	~shared_guard() { lock_.unlock_shared(); }
+
+	shared_guard(const shared_guard& that) = delete;
+	shared_guard& operator=(const shared_guard& that) = delete;
+private:
+	rw_lock& lock_;
+};
+
+class unique_guard
+{
+public:
+	explicit unique_guard(rw_lock& lock) : lock_(lock) { lock_.lock(); }
+	~unique_guard() { lock_.unlock(); }
+
+	unique_guard(const unique_guard& that) = delete;
+	unique_guard& operator=(const unique_guard& that) = delete;
+private:
+	rw_lock& lock_;
+};
+
+#endif
@@ -4,9 +4,13 @@
 #include <vector>
 #include <limits>
 #include <iomanip>
+#include <random>
 
 #include "./fs/fs.h"
 #include "errors.h"
+#if __cplusplus >= 202002L
+#include "./async/coro.h"
+#endif
 
 #define PROMPT_STR      ("> ")
 
@@ -56,12 +60,17 @@ int prompt_user(const std::vector<std::string>& options)
 void do_ls(file_system* fs, const std::string& curr_dir, int depth = 0)
 {
 	const auto root_id = fs->opendir(curr_dir);
-	dirent_t dirent;
-	while ((dirent = fs->readdir(root_id)).inode_n != INVALID_INODE)
+	std::vector<direntplus_t> entries;
+	const auto ret = fs->readdirplus(root_id, &entries);
+	if (ret < 0)
+		cout << err_to_string(ret) << endl;
+	for (const auto& entry : entries)
 	{
+		const auto& dirent = entry.dirent;
 		for (auto i = 0; i < depth; ++i)
 			cout << '\t';
-		cout << dirent.name << ":" << static_cast<int>(dirent.f_type) << ":" << dirent.inode_n << endl;
+		cout << dirent.name << ":" << static_cast<int>(dirent.f_type) << ":" << dirent.inode_n
+			<< ":" << entry.inode.links_count << endl;
 		if (dirent.f_type == file_type::dir
 			&& strncmp(dirent.name, ".", DIRENT_NAME_MAX) != 0 && strncmp(dirent.name, "..", DIRENT_NAME_MAX) != 0)
 		{
@@ -127,6 +136,16 @@ void do_close(file_system* fs, fid_t fid)
 	cout << err_to_string(fs->close(fid)) << endl;
 }
 
+void do_fsync(file_system* fs, fid_t fid)
+{
+	cout << err_to_string(fs->fsync(fid)) << endl;
+}
+
+void do_fdatasync(file_system* fs, fid_t fid)
+{
+	cout << err_to_string(fs->fdatasync(fid)) << endl;
+}
+
 void do_read(file_system* fs, fid_t fid, const std::size_t size)
 {
 	char* buffer = new char[size];
@@ -149,6 +168,29 @@ void do_write(file_system* fs, fid_t fid, const std::string& input)
 		cout << ret << endl;
 }
 
+void do_pread(file_system* fs, fid_t fid, const std::size_t size, const std::size_t offset)
+{
+	char* buffer = new char[size];
+	cout << err_to_string(fs->pread(fid, buffer, size, offset)) << endl;
+	for (std::size_t i = 0; i < size; ++i)
+	{
+		if (i % 16 == 0)
+			cout << endl << setw(4) << setfill('0') << hex << static_cast<int>(i << 4) << dec << ": ";
+		cout << buffer[i];
+	}
+	cout << endl;
+	delete[] buffer;
+}
+
+void do_pwrite(file_system* fs, fid_t fid, const std::string& input, const std::size_t offset)
+{
+	const auto ret = fs->pwrite(fid, input.c_str(), input.size(), offset);
+	if (ret < 0)
+		cout << err_to_string(ret) << endl;
+	else
+		cout << ret << endl;
+}
+
 void do_trunc(file_system* fs, fid_t fid, std::size_t new_size)
 {
 	const auto ret = fs->trunc(fid, new_size);
@@ -166,6 +208,161 @@ void do_seek(file_system* fs, fid_t fid, std::size_t new_pos)
 	cout << ret << endl;
 }
 
+// hit rate of each policy on random lookups of a hot set mixed with a long sequential scan
+void do_cachebench(const std::size_t capacity)
+{
+	const auto hot_blocks = capacity / 2 ? capacity / 2 : 1;
+	const uint32_t scan_first = 1 << 20;
+	std::vector<char> buffer(SECTOR_SIZE);
+
+	for (const auto policy : {cache_policy::clock, cache_policy::car})
+	{
+		block_cache cache(capacity * SECTOR_SIZE, policy);
+		cache.reset(SECTOR_SIZE);
+		std::mt19937 random(42);
+		std::uniform_int_distribution<uint32_t> hot(0, hot_blocks - 1);
+		const auto lookup = [&](const uint32_t block)
+		{
+			if (!cache.read(block, buffer.data()))
+				cache.fill(block, buffer.data(), cache.epoch(block));
+		};
+
+		for (std::size_t i = 0; i < capacity * 20; ++i)
+			lookup(hot(random));
+		cache.reset_stats();
+		// three lookups for every block scanned, the scan is twenty times the cache
+		for (uint32_t i = 0; i < capacity * 20; ++i)
+		{
+			lookup(scan_first + i);
+			for (auto j = 0; j < 3; ++j)
+				lookup(hot(random));
+		}
+
+		const auto stats = cache.get_stats();
+		cout << (policy == cache_policy::clock ? "clock" : "car") << ": " << stats.hits << " hits, "
+			<< stats.misses << " misses, " << fixed << setprecision(1)
+			<< 100.0 * stats.hits / (stats.hits + stats.misses) << "% hit rate" << endl;
+	}
+}
+
+void print_cache_stats(const std::string& name, const cache_stats_t& stats)
+{
+	cout << name << " hits: " << stats.hits << " misses: " << stats.misses << " evictions: " << stats.evictions
+		<< " compressed hits: " << stats.compressed_hits << " compressed: " << stats.compressed_blocks << " blocks in "
+		<< stats.compressed_bytes << " bytes" << endl;
+}
+
+void do_cachestats(file_system* fs)
+{
+	print_cache_stats("data", fs->get_cache_stats());
+	print_cache_stats("meta", fs->get_meta_cache_stats());
+}
+
+// budgets in bytes: data, meta, compressed data, compressed meta; without arguments prints them
+void do_cachebudget(file_system* fs, const std::vector<std::string>& args)
+{
+	if (args.size() > 1)
+		fs->set_cache_budget(stoul(args[1]));
+	if (args.size() > 2)
+		fs->set_meta_cache_budget(stoul(args[2]));
+	if (args.size() > 3)
+		fs->set_compressed_budget(stoul(args[3]));
+	if (args.size() > 4)
+		fs->set_meta_compressed_budget(stoul(args[4]));
+	cout << "data: " << fs->get_cache_budget() << " (" << fs->get_compressed_budget() << " compressed) meta: "
+		<< fs->get_meta_cache_budget() << " (" << fs->get_meta_compressed_budget() << " compressed)" << endl;
+}
+
+void do_hotset(file_system* fs, const std::string& state)
+{
+	if (state == "on" || state == "off")
+		fs->set_hot_set(state == "on");
+	else
+		cout << "Use on or off" << endl;
+}
+
+void do_writeback(file_system* fs, const std::vector<std::string>& args)
+{
+	if (args.size() > 1 && args[1] != "on" && args[1] != "off")
+	{
+		cout << "Use on or off" << endl;
+		return;
+	}
+	if (args.size() > 1)
+		fs->set_writeback(args[1] == "on");
+	if (args.size() > 2)
+		fs->set_writeback_age(stoul(args[2]));
+	if (args.size() > 3)
+		fs->set_dirty_ratio(stoul(args[3]));
+	if (args.size() > 4)
+		fs->set_dirty_limit(stoul(args[4]));
+	cout << (fs->get_writeback() ? "on" : "off") << " age: " << fs->get_writeback_age() << " ms ratio: "
+		<< fs->get_dirty_ratio() << "% limit: " << fs->get_dirty_limit() << "% dirty: " << fs->get_dirty_bytes() << endl;
+}
+
+void do_cachepolicy(file_system* fs, const std::string& policy)
+{
+	if (policy == "clock")
+		fs->set_cache_policy(cache_policy::clock);
+	else if (policy == "car")
+		fs->set_cache_policy(cache_policy::car);
+	else
+		cout << "Unknown policy, use clock or car" << endl;
+}
+
+#if __cplusplus >= 202002L
+// yields the bytes read back, or the first error
+fs_task<int> coro_write_read(fs_executor* executor, const fid_t fid, const std::string& input)
+{
+	const auto written = co_await executor->write(fid, input.c_str(), input.size(), 0);
+	if (written < 0)
+		co_return written;
+	std::vector<char> buffer(input.size());
+	const auto ret = co_await executor->read(fid, buffer.data(), buffer.size(), 0);
+	if (ret >= 0)
+		cout << "read: " << std::string(buffer.data(), buffer.size()) << endl;
+	co_return ret;
+}
+
+fs_task<> coro_demo(fs_executor* executor, const std::string& filename, const std::string& input, const did_t did)
+{
+	const auto fid = co_await executor->open(filename);
+	if (fid < 0)
+	{
+		cout << err_to_string(fid) << endl;
+		co_return;
+	}
+	const auto ret = co_await coro_write_read(executor, fid, input);
+	if (ret < 0)
+		cout << err_to_string(ret) << endl;
+	cout << err_to_string(co_await executor->close(fid)) << endl;
+
+	for (auto entry = co_await executor->readdir(did); entry.inode_n != INVALID_INODE;
+	     entry = co_await executor->readdir(did))
+		cout << entry << endl;
+}
+#endif
+
+// the open, write, read, close and readdir of src/async/coro.h on filename, in the current directory
+void do_coro(file_system* fs, const std::string& filename, const std::string& input)
+{
+#if __cplusplus >= 202002L
+	fs->create(filename);
+	const auto did = fs->opendir(".");
+	{
+		fs_executor executor(fs);
+		executor.spawn(coro_demo(&executor, filename, input, did));
+		executor.run();
+	}
+	fs->closedir(did);
+#else
+	(void)fs;
+	(void)filename;
+	(void)input;
+	cout << "coro needs a C++20 build, see the nfso20 target" << endl;
+#endif
+}
+
 void do_rewind(file_system* fs, did_t did)
 {
 	cout << err_to_string(fs->rewind_dir(did)) << endl;
@@ -228,6 +425,14 @@ int exec_command(const std::vector<std::string>& args, file_system* fs)
 	{
 		do_close(fs, stoul(args[1]));
 	}
+	if (args[0] == "fsync" && args.size() > 1)
+	{
+		do_fsync(fs, stoul(args[1]));
+	}
+	if (args[0] == "fdatasync" && args.size() > 1)
+	{
+		do_fdatasync(fs, stoul(args[1]));
+	}
 	if (args[0] == "read" && args.size() > 2)
 	{
 		do_read(fs, stoul(args[1]), stoul(args[2]));
@@ -236,6 +441,14 @@ int exec_command(const std::vector<std::string>& args, file_system* fs)
 	{
 		do_write(fs, stoul(args[1]), args[2]);
 	}
+	if (args[0] == "pread" && args.size() > 3)
+	{
+		do_pread(fs, stoul(args[1]), stoul(args[2]), stoul(args[3]));
+	}
+	if (args[0] == "pwrite" && args.size() > 3)
+	{
+		do_pwrite(fs, stoul(args[1]), args[2], stoul(args[3]));
+	}
 	if (args[0] == "trunc" && args.size() > 2)
 	{
 		do_trunc(fs, stoul(args[1]), stoul(args[2]));
@@ -244,6 +457,34 @@ int exec_command(const std::vector<std::string>& args, file_system* fs)
 	{
 		do_seek(fs, stoul(args[1]), stoul(args[2]));
 	}
+	if (args[0] == "cachebench")
+	{
+		do_cachebench(args.size() > 1 ? stoul(args[1]) : 256);
+	}
+	if (args[0] == "cachestats")
+	{
+		do_cachestats(fs);
+	}
+	if (args[0] == "cachebudget")
+	{
+		do_cachebudget(fs, args);
+	}
+	if (args[0] == "hotset" && args.size() > 1)
+	{
+		do_hotset(fs, args[1]);
+	}
+	if (args[0] == "writeback")
+	{
+		do_writeback(fs, args);
+	}
+	if (args[0] == "cachepolicy" && args.size() > 1)
+	{
+		do_cachepolicy(fs, args[1]);
+	}
+	if (args[0] == "coro" && args.size() > 2)
+	{
+		do_coro(fs, args[1], args[2]);
+	}
 	if (args[0] == "trace")
 	{
 		fs->trace();
@@ -307,8 +548,9 @@ int create_fs(file_system* fs)
 	const auto inode_count = input_user<int>("How many inodes: ");
 	const auto disk_size = input_user<int>("Disk size: ");
 	const auto block_size = input_user<int>("Block size: ");
+	const auto features = input_user<int>("Feature flags: ");
 
-	fs->init(filename, inode_count, disk_size, block_size);
+	cout << err_to_string(fs->init(filename, inode_count, disk_size, block_size, features)) << endl;
 
 	return 0;
 }
@@ -0,0 +1,49 @@
+#include <iostream>
+#include <vector>
+
+#include "../src/fs/fs.h"
+
+#define IMAGE ("obj/tests/readdirplus.img")
+
+using namespace std;
+
+// data size readdirplus reports for name in dir, -1 if it's not listed
+static long listed_size(file_system* fs, const std::string& dir, const std::string& name)
+{
+	const auto did = fs->opendir(dir);
+	std::vector<direntplus_t> entries;
+	const auto ret = fs->readdirplus(did, &entries);
+	fs->closedir(did);
+	if (ret < 0)
+		return -1;
+	for (const auto& entry : entries)
+		if (name == entry.dirent.name)
+			return entry.inode.data_size;
+	return -1;
+}
+
+static int check(const bool ok, const std::string& what)
+{
+	if (!ok)
+		cerr << "FAILED: " << what << endl;
+	return ok ? 0 : 1;
+}
+
+int main()
+{
+	int failed = 0;
+	file_system fs;
+	if (fs.init(IMAGE, 64, 2048, 2, SB_FEAT_INLINE_DATA | SB_FEAT_PACKED_DIRS) < 0)
+		return check(false, "init");
+
+	fs.create("/a");
+	const auto fid = fs.open("/a");
+	fs.write(fid, "hello world", 11);
+	// the write is still buffered, readdirplus must see it anyway
+	failed += check(listed_size(&fs, "/", "a") == 11, "size of a buffered write");
+	failed += check(fs.close(fid) == 0, "close");
+	failed += check(listed_size(&fs, "/", "a") == 11, "size after close");
+
+	fs.unload();
+	return failed ? 1 : 0;
+}
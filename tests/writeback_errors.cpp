@@ -0,0 +1,56 @@
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "../src/fs/fs.h"
+#include "../src/errors.h"
+
+#define IMAGE ("obj/tests/writeback_errors.img")
+
+using namespace std;
+
+static int check(const bool ok, const std::string& what)
+{
+	if (!ok)
+		cerr << "FAILED: " << what << endl;
+	return ok ? 0 : 1;
+}
+
+int main()
+{
+	int failed = 0;
+	file_system fs;
+	if (fs.init(IMAGE, 64, 512, 2, 0) < 0)
+		return check(false, "init");
+
+	// fill the disk, so that the buffer of a can't be written back
+	fs.create("/big");
+	const auto big = fs.open("/big");
+	const std::vector<char> block(fs.get_super_block().block_size * SECTOR_SIZE, 'x');
+	while (fs.write(big, block.data(), block.size()) >= 0)
+		;
+	fs.close(big);
+
+	fs.create("/a");
+	fs.create("/b");
+	const auto a = fs.open("/a");
+	const auto b = fs.open("/b");
+	fs.write(a, "hello", 5);
+
+	fs.set_writeback_age(0);
+	fs.set_writeback(true);
+	std::this_thread::sleep_for(std::chrono::milliseconds(2 * WRITEBACK_INTERVAL));
+	fs.set_writeback(false);
+	fs.unlink("/big");
+
+	// the error belongs to a alone, and is returned once
+	failed += check(fs.fsync(b) == 0, "fsync of another file");
+	failed += check(fs.close(b) == 0, "close of another file");
+	failed += check(fs.fsync(a) == ED_OUT_OF_BLOCKS, "fsync of the file that failed");
+	failed += check(fs.fsync(a) == 0, "second fsync");
+	failed += check(fs.close(a) == 0, "close");
+
+	fs.unload();
+	return failed ? 1 : 0;
+}